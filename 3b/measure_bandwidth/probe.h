@@ -0,0 +1,58 @@
+/*************************************
+*Header at the front of every packet the sender generates, so the
+*receiver can count loss and reordering and measure one-way delay.
+*
+*All fields are big-endian.  sent_ns is CLOCK_REALTIME, so one-way
+*delays between two hosts are only as good as their clock sync; on a
+*single host they are exact.
+*************************************/
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdint.h>
+#include <endian.h>
+#include <time.h>
+
+#define PROBE_MAGIC 0x50524f42	// "PROB"
+
+struct probe_hdr {
+  uint32_t magic;
+  uint32_t stream;		// Sender thread; each has its own seq space
+  uint64_t seq;			// 0, 1, 2, ... per stream
+  uint64_t sent_ns;		// Wall clock when handed to the kernel
+};
+
+static inline uint64_t
+probe_clock()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void
+probe_stamp(void *buf, uint32_t stream, uint64_t seq, uint64_t now)
+{
+  struct probe_hdr *h = (struct probe_hdr *) buf;
+  h->magic = htobe32(PROBE_MAGIC);
+  h->stream = htobe32(stream);
+  h->seq = htobe64(seq);
+  h->sent_ns = htobe64(now);
+}
+
+// Fills *h from buf; returns false if buf is not a probe packet
+static inline bool
+probe_parse(const void *buf, size_t len, struct probe_hdr *h)
+{
+  const struct probe_hdr *p = (const struct probe_hdr *) buf;
+  if (len < sizeof(*p) || be32toh(p->magic) != PROBE_MAGIC)
+    return false;
+  h->magic = PROBE_MAGIC;
+  h->stream = be32toh(p->stream);
+  h->seq = be64toh(p->seq);
+  h->sent_ns = be64toh(p->sent_ns);
+  return true;
+}
+
+#endif
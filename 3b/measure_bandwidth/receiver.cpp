@@ -1,105 +1,417 @@
 /*************************************
-*this receiver is used for lab 4. You can use it to get a 
-*more accurate bandwidth of the relayer. This receiver grabs
-*all the packets relayed by the relayer in 30s, and calculate
-*(number of bits received / 30s). This is a more accurate estimation
-*of the relayer's bandwidth.
+*Receiver for ./sender, used for lab 4 to measure the relayer or any
+*UDP path.
 *
-*You may need to change the udpport according to the relayer's config.xml
-*use "g++ -o receiver receiver.cpp" to compile
-*To run: 
+*Takes every datagram arriving on its port in recvmmsg batches and
+*reads the probe_hdr (probe.h) the sender put in front of each one.
+*Every interval it prints throughput, loss, reordering and the average
+*one-way delay.  At the end it prints totals and a one-way-delay
+*histogram.  Nothing is printed per packet, so the receiver is never
+*the bottleneck.
+*
+*Receive times come from the kernel (SO_TIMESTAMPNS) and send times
+*from the sender's wall clock.  One-way delays across two hosts are
+*therefore only as good as their clock sync.
+*
+*The run starts with the first datagram and lasts -d seconds, so the
+*order in which the programs are started does not matter.
+*
+*use "make receiver" to compile
+*To run (matching the stock config.xml):
 *(1)start the relayer first
 *./relayer config.xml
-*(2)run the sender
-*./sender
-*(3)run the receiver
+*(2)run the receiver
 *./receiver
+*(3)run the sender
+*./sender -r 8M
 *after 30s, you'll get the relayer's bandwidth
 *************************************/
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <netdb.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
-#include <string.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
-#include <sys/time.h>
 #include <unistd.h>
+
+#include <map>
+#include <vector>
 using namespace std;
 
-#define PKT_SIZE 1016
-/*****************************************/
-//this is the receiver's listening port, you may need to change it before running
-unsigned short int udpport = 20000;
-/*****************************************/
+#include "probe.h"
 
-int udpsock;
-int listen_init(unsigned short int port)
-{
-    int length;
-    struct sockaddr_in server;   	
-    
-    /* Create a socket for receiving feedback */
-    udpsock=socket(AF_INET,SOCK_DGRAM,0);
-    if (udpsock<0)
-    {
- 	 printf("ERROR: opening stream socket!\n");
-   	exit(1);
+#define MAX_BATCH 256
+#define MAX_SIZE 65536
+#define WINDOW (1 << 16)	// Sequence numbers remembered per stream
+
+// One sender thread's sequence space
+struct stream {
+  uint64_t first, next;		// First seq seen; one past the highest
+  uint64_t received;		// Distinct seqs
+  uint64_t reordered;		// Arrived after a higher seq
+  uint64_t duplicates;
+  vector<uint64_t> seen;	// Bitmap of seqs in [next - WINDOW, next)
+
+  stream() : first(0), next(0), received(0), reordered(0), duplicates(0),
+	     seen(WINDOW / 64) {}
+
+  bool
+  test_and_set(uint64_t seq)
+  {
+    uint64_t &word = seen[(seq / 64) % (WINDOW / 64)], bit = 1ull << (seq % 64);
+    bool was = word & bit;
+    word |= bit;
+    return was;
+  }
+
+  void
+  add(uint64_t seq)
+  {
+    if (!received && !duplicates)
+      first = next = seq;
+    if (seq >= next) {
+      // Forget what the window slides past
+      if (seq - next >= WINDOW)
+	fill(seen.begin(), seen.end(), 0);
+      else
+	for (uint64_t s = next; s < seq; s++)
+	  seen[(s / 64) % (WINDOW / 64)] &= ~(1ull << (s % 64));
+      test_and_set(seq);
+      next = seq + 1;
+      received++;
+      return;
+    }
+    if (next - seq > WINDOW) {
+      // Too old to tell a duplicate from a latecomer; call it late
+      received++;
+      reordered++;
+      return;
+    }
+    if (test_and_set(seq)) {
+      duplicates++;
+      return;
+    }
+    if (seq < first)
+      first = seq;		// Sent before the first one we saw
+    received++;
+    reordered++;
+  }
+
+  uint64_t
+  lost()
+  {
+    uint64_t expected = next - first;
+    return expected > received ? expected - received : 0;
+  }
+};
+
+// One-way delay histogram: exact below 16 us, then 8 buckets per
+// power of two, so percentiles are within 12.5%.
+struct delay_hist {
+  uint64_t count, sum, max;	// ns
+  int64_t min;			// ns; negative if the clocks disagree
+  uint64_t negative;		// Delays below zero, counted as zero
+  uint64_t hist[16 + 8 * 60];
+
+  static int
+  bucket(uint64_t us)
+  {
+    if (us < 16)
+      return us;
+    int e = 63 - __builtin_clzll(us);
+    return 16 + (e - 4) * 8 + ((us >> (e - 3)) & 7);
+  }
+
+  // Lower edge of bucket b, in us
+  static uint64_t
+  lower(int b)
+  {
+    if (b < 16)
+      return b;
+    int e = (b - 16) / 8 + 4;
+    return (uint64_t) (8 + (b - 16) % 8) << (e - 3);
+  }
+
+  void
+  add(int64_t ns)
+  {
+    if (!count || ns < min)
+      min = ns;
+    if (ns < 0) {
+      negative++;
+      ns = 0;
     }
+    count++;
+    sum += ns;
+    if ((uint64_t) ns > max)
+      max = ns;
+    hist[bucket(ns / 1000)]++;
+  }
 
-    server.sin_family=AF_INET;
-    server.sin_addr.s_addr=INADDR_ANY;
-    server.sin_port=htons(port);
-    
-    /*Bind the socket to the listening port */
-    if (bind(udpsock,(struct sockaddr *)&server,sizeof server)<0)
-    {
-    	printf("UDP Binding error, maybe port number occupied by others. Change another port");
-   	exit(1);
-    };
-    length=sizeof server;
-    if (getsockname(udpsock,(struct sockaddr *)&server,(socklen_t *)&length)<0)
-    {
-	 printf("ERROR: getting socket name\n");
-   	exit(1);
+  // Midpoint of the bucket holding quantile q, in ns
+  uint64_t
+  percentile(double q)
+  {
+    uint64_t seen = 0, want = (uint64_t) (q * count);
+    for (int b = 0; b < (int) (sizeof(hist) / sizeof(hist[0])); b++) {
+      if ((seen += hist[b]) <= want || !hist[b])
+	continue;
+      return (lower(b) + lower(b + 1)) * 500;
     }
-    printf("UDP Socket port # %d\n",ntohs(server.sin_port)); 
-    return 0;
+    return max;
+  }
+
+  // One line per power of two that saw any packets
+  void
+  print()
+  {
+    uint64_t most = 0, sums[64] = { 0 };
+    for (int b = 0; b < (int) (sizeof(hist) / sizeof(hist[0])); b++)
+      if (hist[b]) {
+	uint64_t us = lower(b);
+	sums[us ? 64 - __builtin_clzll(us) : 0] += hist[b];
+      }
+    for (int e = 0; e < 64; e++)
+      if (sums[e] > most)
+	most = sums[e];
+    for (int e = 0; e < 64; e++) {
+      if (!sums[e])
+	continue;
+      double lo = e ? (1ull << (e - 1)) / 1e3 : 0, hi = (1ull << e) / 1e3;
+      printf("  %9.3f - %9.3f ms %10llu%s%.*s\n", lo, hi,
+	     (unsigned long long) sums[e], sums[e] * 40 >= most ? "  " : "",
+	     (int) (sums[e] * 40 / most),
+	     "########################################");
+    }
+  }
 };
 
+static volatile sig_atomic_t stop;
+
+static void
+on_signal(int)
+{
+  stop = 1;
+}
 
-int main()
+static uint64_t
+now_ns()
 {
-  if (listen_init(udpport)!=0) { printf("UDP Socket establish failure!\n"); return 1;};
-  double num = 0.0;
-  struct timeval start;
-  struct timeval current;
-  gettimeofday (&start, NULL);
-
-  char buf[PKT_SIZE];
-  fd_set setForSelect;
-  while (1)
-  { 
-    FD_ZERO(&setForSelect);
-    FD_SET(udpsock,&setForSelect);   	 
-    select(udpsock+1,&setForSelect,0,0,NULL);
-    if (FD_ISSET(udpsock,&setForSelect))
-    {
-      struct sockaddr incoming_addr;
-      memset(buf,0,PKT_SIZE);   
-      socklen_t incoming_len = sizeof(incoming_addr);
-      int rval = recvfrom(udpsock,buf,PKT_SIZE,0,&incoming_addr, &incoming_len);   
-      if(rval == PKT_SIZE)
-      {
-          num = num + 1.0;
-          printf("%f\n", num);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+listen_init(unsigned short port)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  int one = 1, rcvbuf = 8 << 20;
+  struct timeval tv = { 0, 100000 };
+  if (fd < 0) {
+    perror("socket");
+    exit(1);
+  }
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+  // Wake up now and then to print intervals even when nothing arrives
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = INADDR_ANY;
+  sin.sin_port = htons(port);
+  if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+    fprintf(stderr, "bind port %d: %s\n", port, strerror(errno));
+    exit(1);
+  }
+  return fd;
+}
+
+// Kernel receive time of a datagram, or now if there is none
+static uint64_t
+rx_time(struct msghdr *mh)
+{
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(mh); c; c = CMSG_NXTHDR(mh, c))
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+      return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+  return probe_clock();
+}
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr,
+	  "usage: %s [options] [port]   (default 20000)\n"
+	  "  -d SECONDS   how long to measure after the first datagram,"
+	  " 0 = until interrupted (default 30)\n"
+	  "  -i SECONDS   report interval, 0 = totals only (default 1)\n"
+	  "  -b BATCH     datagrams per recvmmsg, up to %d (default 64)\n",
+	  prog, MAX_BATCH);
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  double duration = 30, interval = 1;
+  int batch = 64, c;
+  while ((c = getopt(argc, argv, "d:i:b:")) != -1) {
+    switch (c) {
+    case 'd': duration = atof(optarg); break;
+    case 'i': interval = atof(optarg); break;
+    case 'b': batch = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  int port = optind < argc ? atoi(argv[optind]) : 20000;
+  if (optind < argc - 1 || duration < 0 || interval < 0 || batch < 1
+      || batch > MAX_BATCH || port < 1 || port > 65535)
+    usage(argv[0]);
+  int fd = listen_init(port);
+  printf("UDP Socket port # %d\n", port);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;	// No SA_RESTART: interrupts recvmmsg
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  vector<char> buf((size_t) batch * MAX_SIZE);
+  vector<char> ctrl(batch * CMSG_SPACE(sizeof(struct timespec)));
+  vector<struct mmsghdr> msgs(batch);
+  vector<struct iovec> iov(batch);
+
+  map<uint32_t, stream> streams;
+  delay_hist owd = delay_hist();
+  uint64_t pkts = 0, bytes = 0, other = 0;
+  uint64_t first_ns = 0, last_ns = 0, end_ns = 0, next_tick = 0;
+  bool done = false;
+  uint64_t tick_ns = (uint64_t) (interval * 1e9);
+  // Totals at the start of the current interval
+  uint64_t i_pkts = 0, i_bytes = 0, i_lost = 0, i_reord = 0, i_t = 0;
+  uint64_t i_owd_sum = 0, i_owd_n = 0;
+
+  while (!stop) {
+    for (int i = 0; i < batch; i++) {
+      iov[i].iov_base = &buf[(size_t) i * MAX_SIZE];
+      iov[i].iov_len = MAX_SIZE;
+      memset(&msgs[i], 0, sizeof(msgs[i]));
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_control = &ctrl[i * CMSG_SPACE(sizeof(struct timespec))];
+      msgs[i].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(struct timespec));
+    }
+    int n = recvmmsg(fd, &msgs[0], batch, MSG_WAITFORONE, NULL);
+    uint64_t now = now_ns();
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      perror("recvmmsg");
+      return 1;
+    }
+    if (n > 0 && !first_ns) {
+      first_ns = i_t = now;
+      end_ns = duration ? now + (uint64_t) (duration * 1e9) : 0;
+      next_tick = now + tick_ns;
+      if (tick_ns)
+	printf("%7s %9s %10s %7s %7s %9s\n",
+	       "time s", "pkts", "Mb/s", "lost", "reord", "owd ms");
+    }
+    for (int i = 0; i < n; i++) {
+      struct probe_hdr h;
+      pkts++;
+      bytes += msgs[i].msg_len;
+      if (!probe_parse(iov[i].iov_base, msgs[i].msg_len, &h)) {
+	other++;
+	continue;
       }
+      streams[h.stream].add(h.seq);
+      int64_t d = (int64_t) (rx_time(&msgs[i].msg_hdr) - h.sent_ns);
+      owd.add(d);
     }
-    gettimeofday (&current, NULL);
-    if(current.tv_sec - start.tv_sec >= 30)
+    if (n > 0)
+      last_ns = now;
+    if (!first_ns)
+      continue;
+
+    done = end_ns && now >= end_ns;
+    if (tick_ns && (now >= next_tick || done || stop)) {
+      uint64_t lost = 0, reord = 0;
+      for (map<uint32_t, stream>::iterator s = streams.begin();
+	   s != streams.end(); ++s) {
+	lost += s->second.lost();
+	reord += s->second.reordered;
+      }
+      printf("%7.1f %9llu %10.2f %7lld %7llu %9.3f\n", (now - first_ns) / 1e9,
+	     (unsigned long long) (pkts - i_pkts),
+	     (bytes - i_bytes) * 8e3 / (now - i_t),
+	     // Late packets can fill an earlier interval's gaps
+	     (long long) (lost - i_lost),
+	     (unsigned long long) (reord - i_reord),
+	     owd.count > i_owd_n
+	     ? (owd.sum - i_owd_sum) / 1e6 / (owd.count - i_owd_n) : 0.0);
+      fflush(stdout);
+      i_pkts = pkts;
+      i_bytes = bytes;
+      i_lost = lost;
+      i_reord = reord;
+      i_owd_sum = owd.sum;
+      i_owd_n = owd.count;
+      i_t = now;
+      while (next_tick <= now)
+	next_tick += tick_ns;
+    }
+    if (done)
       break;
   }
-  printf("!!! relayer's bandwidth is %f kb/s\n", (((8.0 * PKT_SIZE) / (current.tv_sec - start.tv_sec)) * num) / 1000.0);
+
+  if (!first_ns) {
+    printf("nothing received\n");
+    return 1;
+  }
+  // A full run is measured over exactly -d seconds; an interrupted
+  // one up to the last datagram
+  double secs = ((done ? end_ns : last_ns) - first_ns) / 1e9;
+  if (secs <= 0)
+    secs = 1e-9;
+  printf("received %llu pkts, %llu bytes in %.2f s\n",
+	 (unsigned long long) pkts, (unsigned long long) bytes, secs);
+  printf("!!! relayer's bandwidth is %f kb/s\n", bytes * 8 / secs / 1000);
+
+  uint64_t expected = 0, lost = 0, reord = 0, dups = 0;
+  for (map<uint32_t, stream>::iterator s = streams.begin();
+       s != streams.end(); ++s) {
+    expected += s->second.next - s->second.first;
+    lost += s->second.lost();
+    reord += s->second.reordered;
+    dups += s->second.duplicates;
+  }
+  printf("%zu streams: %llu of %llu lost (%.3f%%), %llu reordered,"
+	 " %llu duplicates\n", streams.size(), (unsigned long long) lost,
+	 (unsigned long long) expected, expected ? 100.0 * lost / expected : 0,
+	 (unsigned long long) reord, (unsigned long long) dups);
+  if (other)
+    printf("%llu datagrams without a probe header (not from ./sender)\n",
+	   (unsigned long long) other);
+  if (owd.count) {
+    printf("one-way delay ms: min %.3f avg %.3f p50 %.3f p90 %.3f"
+	   " p99 %.3f max %.3f\n", owd.min / 1e6,
+	   owd.sum / 1e6 / owd.count, owd.percentile(0.5) / 1e6,
+	   owd.percentile(0.9) / 1e6, owd.percentile(0.99) / 1e6,
+	   owd.max / 1e6);
+    if (owd.negative)
+      printf("%llu packets arrived before they were sent:"
+	     " the two clocks are out of sync\n",
+	     (unsigned long long) owd.negative);
+    owd.print();
+  }
+  return 0;
 }
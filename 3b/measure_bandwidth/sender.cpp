@@ -1,83 +1,419 @@
 /*************************************
-*this sender is used for lab 4. You can use it to get a 
-*more accurate bandwidth of the relayer. This sender keeps on sending
-*2016-byte packets to the relayer, The relayer may drop some of them,
-*and relay the rest of them. The receiver on the other end will grabs
-*all the packets relayed by the relayer in 30s and calculates
-*(number of received bits / 30s). This is a more accurate estimation
-*of the relayer's bandwidth.
+*Traffic generator for measuring the relayer (lab 4) or any UDP path.
 *
-*You may need to change some of the values bellow according to the relayer's config.xml
-*use "g++ -o sender sender.cpp" to compile
-*To run: 
+*Sends datagrams to host:port at a controlled rate, each starting with
+*a probe_hdr (probe.h) carrying a per-thread sequence number and a send
+*timestamp, so ./receiver can report throughput, loss, reordering and
+*one-way delay.  Datagrams go out in sendmmsg batches from one or more
+*threads, which is enough to fill multi-Gb/s paths.
+*
+*Rate patterns:
+*  constant   evenly spaced packets at -r
+*  poisson    exponential gaps averaging -r
+*  onoff      -r for ON_MS, then silence for OFF_MS, repeating
+*
+*The average rate is exact; packets that fall due while the thread
+*sleeps go out together in the next batch.  After a stall of more than
+*100 ms the schedule restarts instead of bursting to catch up.
+*
+*use "make sender" to compile
+*To run (matching the stock config.xml):
 *(1)start the relayer first
 *./relayer config.xml
-*(2)run the sender
-*./sender
-*(3)run the receiver
+*(2)run the receiver
 *./receiver
-*after 30s, you'll get the relayer's bandwidth
+*(3)run the sender, e.g. at 8 Mb/s for 30 s
+*./sender -r 8M localhost:50001
 *************************************/
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
-#include <string.h>
 #include <stdlib.h>
-#include <sys/time.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
 using namespace std;
 
-#define PKT_SIZE 1016
+#include "probe.h"
+
+#define MAX_BATCH 256
+#define MAX_SIZE 65507		// Largest UDP payload over IPv4
+#define MAX_LAG 100000000	// ns behind schedule before restarting it
+
+enum pattern { P_CONSTANT, P_POISSON, P_ONOFF };
+
+struct options {
+  double rate;			// bits/s over all threads, 0 = unpaced
+  int size;			// Datagram bytes
+  double duration;		// s, 0 = until interrupted
+  pattern pat;
+  uint64_t on_ns, off_ns;
+  int threads;
+  int batch;
+  int local_port;		// 0 = any
+  bool quiet;
+  struct sockaddr_in to;
+};
+
+struct worker {
+  int id;
+  pthread_t tid;
+  int fd;
+  double gap_ns;		// Mean time between packets, 0 = unpaced
+  uint64_t rng;			// xorshift64 state, for poisson
+  atomic<uint64_t> pkts, bytes;
+  uint64_t refused, nobufs, other_errors; // Datagrams not sent
+};
+
+static options opt;
+static uint64_t start_ns, end_ns; // Monotonic; end_ns 0 = no end
+static volatile sig_atomic_t stop;
+
+static void
+on_signal(int)
+{
+  stop = 1;
+}
+
+static uint64_t
+now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Sleep, or for short waits spin, until monotonic time t
+static void
+wait_until(uint64_t t)
+{
+  if (t > now_ns() + 20000) {
+    struct timespec ts;
+    ts.tv_sec = t / 1000000000;
+    ts.tv_nsec = t % 1000000000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+  }
+  else
+    while (now_ns() < t && !stop)
+      ;
+}
+
+static double
+next_gap(worker &w)
+{
+  if (opt.pat != P_POISSON)
+    return w.gap_ns;
+  w.rng ^= w.rng << 13;
+  w.rng ^= w.rng >> 7;
+  w.rng ^= w.rng << 17;
+  double u = ((w.rng >> 11) + 1) * (1.0 / 9007199254740993.0);
+  return -log(u) * w.gap_ns;
+}
+
+static void *
+send_loop(void *arg)
+{
+  worker &w = *(worker *) arg;
+  vector<char> buf(opt.batch * opt.size);
+  struct mmsghdr msgs[MAX_BATCH];
+  struct iovec iov[MAX_BATCH];
+  uint64_t seq = 0, pkts = 0;
+  double next = 0;		// When the next packet is due, ns after start
+
+  memset(msgs, 0, sizeof(msgs));
+  for (int i = 0; i < opt.batch; i++) {
+    iov[i].iov_base = &buf[i * opt.size];
+    iov[i].iov_len = opt.size;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  while (!stop) {
+    uint64_t abs = now_ns(), now = abs - start_ns;
+    if (end_ns && abs >= end_ns)
+      break;
+    if (opt.pat == P_ONOFF) {
+      uint64_t cycle = opt.on_ns + opt.off_ns;
+      uint64_t phase = now % cycle;
+      if (phase >= opt.on_ns) {
+	// Off: nothing is owed for the silent period
+	next = now + (cycle - phase);
+	wait_until(start_ns + (uint64_t) next);
+	continue;
+      }
+    }
+    if (w.gap_ns) {
+      if (next > now) {
+	wait_until(start_ns + (uint64_t) next);
+	continue;
+      }
+      if (now - next > MAX_LAG)
+	next = now;
+    }
+
+    int n = 0;
+    while (n < opt.batch && (!w.gap_ns || next <= now)) {
+      n++;
+      next += next_gap(w);
+    }
+    uint64_t wall = probe_clock();
+    for (int i = 0; i < n; i++)
+      probe_stamp(&buf[i * opt.size], w.id, seq + i, wall);
+
+    int sent = 0;
+    while (sent < n) {
+      int r = sendmmsg(w.fd, msgs + sent, n - sent, 0);
+      if (r >= 0) {
+	sent += r;
+	continue;
+      }
+      if (errno == EINTR)
+	continue;
+      // The rest of the batch is dropped here, not in the network,
+      // and its sequence numbers are reused so the receiver never
+      // counts it as loss
+      if (errno == ECONNREFUSED)
+	w.refused += n - sent;
+      else if (errno == ENOBUFS || errno == EAGAIN)
+	w.nobufs += n - sent;
+      else
+	w.other_errors += n - sent;
+      break;
+    }
+    seq += sent;
+    pkts += sent;
+    w.pkts.store(pkts, memory_order_relaxed);
+    w.bytes.store(pkts * opt.size, memory_order_relaxed);
+  }
+  return NULL;
+}
+
+static struct sockaddr_in
+resolve(const char *hostport)
+{
+  string s(hostport);
+  size_t colon = s.rfind(':');
+  if (colon == string::npos) {
+    fprintf(stderr, "%s: expected host:port\n", hostport);
+    exit(1);
+  }
+  string host = s.substr(0, colon), port = s.substr(colon + 1);
+
+  struct addrinfo hints, *ai;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &ai);
+  if (err) {
+    fprintf(stderr, "%s: %s\n", hostport, gai_strerror(err));
+    exit(1);
+  }
+  struct sockaddr_in sin = *(struct sockaddr_in *) ai->ai_addr;
+  freeaddrinfo(ai);
+  return sin;
+}
+
+static int
+open_socket()
+{
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  int one = 1, sndbuf = 4 << 20;
+  if (fd < 0) {
+    perror("socket");
+    exit(1);
+  }
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  if (opt.local_port) {
+    // All threads send from the same port, as the relayer expects
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = INADDR_ANY;
+    sin.sin_port = htons(opt.local_port);
+    if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+      fprintf(stderr, "bind port %d: %s\n", opt.local_port, strerror(errno));
+      exit(1);
+    }
+  }
+  if (connect(fd, (struct sockaddr *) &opt.to, sizeof(opt.to)) < 0) {
+    perror("connect");
+    exit(1);
+  }
+  return fd;
+}
+
+// "100M" -> 1e8
+static double
+parse_rate(const char *s)
+{
+  char *end;
+  double v = strtod(s, &end);
+  switch (*end) {
+  case 'k': case 'K': v *= 1e3; end++; break;
+  case 'm': case 'M': v *= 1e6; end++; break;
+  case 'g': case 'G': v *= 1e9; end++; break;
+  }
+  if (*end || v < 0) {
+    fprintf(stderr, "bad rate: %s\n", s);
+    exit(1);
+  }
+  return v;
+}
 
-/***************************************/
-//you may need to change these configurations according to relayer's config.xml
-char* host_name = (char*)"linux25";//relayer's host name
-short int sender_port = 10000;     //this sender's sending port
-short int relayer_port = 50001;    //relayer's listening port
-/***************************************/
+static void
+parse_pattern(const char *s)
+{
+  double on = 100, off = 100;
+  if (!strcmp(s, "constant"))
+    opt.pat = P_CONSTANT;
+  else if (!strcmp(s, "poisson"))
+    opt.pat = P_POISSON;
+  else if (!strncmp(s, "onoff", 5)
+	   && (!s[5] || (sscanf(s + 5, ":%lf,%lf", &on, &off) == 2
+			 && on > 0 && off >= 0)))
+    opt.pat = P_ONOFF;
+  else {
+    fprintf(stderr, "bad pattern: %s\n", s);
+    exit(1);
+  }
+  opt.on_ns = (uint64_t) (on * 1e6);
+  opt.off_ns = (uint64_t) (off * 1e6);
+}
 
-int main()
+static void
+usage(const char *prog)
 {
-  int udpsock = socket(AF_INET,SOCK_DGRAM,0);
-  if (udpsock<0)
-  {
-     printf("ERROR: opening UDP socket\n");
-    return 0;
-  }
-  struct sockaddr_in l_s_i;
-  l_s_i.sin_family=AF_INET;
-  l_s_i.sin_addr.s_addr=INADDR_ANY;
-  l_s_i.sin_port=htons(sender_port);
-  if (bind(udpsock, (struct sockaddr *)&(l_s_i), sizeof(struct sockaddr_in))<0)
-  {
-    printf("ERROR: UDP Binding error\n");
-    return 0;
-  }
-  
-  struct sockaddr_in r_s_i;
-  r_s_i.sin_family=AF_INET;
-  struct hostent *address = gethostbyname(host_name);
-  if(address)
-  {
-    memcpy(&r_s_i.sin_addr , address->h_addr, address->h_length);
-    r_s_i.sin_port=htons(relayer_port);
-  }
-  else
-  {
-    printf("ERROR: UDP INIT error\n");
-    return 0;
+  fprintf(stderr,
+	  "usage: %s [options] [host:port]   (default localhost:50001)\n"
+	  "  -r RATE      total bits/s, with k/M/G suffix; 0 = as fast as"
+	  " possible (default 0)\n"
+	  "  -s BYTES     datagram size, at least %zu (default 1016)\n"
+	  "  -d SECONDS   how long to send, 0 = until interrupted"
+	  " (default 30)\n"
+	  "  -p PATTERN   constant, poisson or onoff[:ON_MS,OFF_MS]"
+	  " (default constant; onoff is 100,100)\n"
+	  "  -t THREADS   sending threads, each with its own socket"
+	  " and sequence numbers (default 1)\n"
+	  "  -b BATCH     datagrams per sendmmsg, up to %d (default 32)\n"
+	  "  -l PORT      local port shared by all threads, 0 = any"
+	  " (default 10000)\n"
+	  "  -q           no per-second report\n",
+	  prog, sizeof(struct probe_hdr), MAX_BATCH);
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  int c;
+  opt.size = 1016;
+  opt.duration = 30;
+  opt.pat = P_CONSTANT;
+  opt.threads = 1;
+  opt.batch = 32;
+  opt.local_port = 10000;
+  while ((c = getopt(argc, argv, "r:s:d:p:t:b:l:q")) != -1) {
+    switch (c) {
+    case 'r': opt.rate = parse_rate(optarg); break;
+    case 's': opt.size = atoi(optarg); break;
+    case 'd': opt.duration = atof(optarg); break;
+    case 'p': parse_pattern(optarg); break;
+    case 't': opt.threads = atoi(optarg); break;
+    case 'b': opt.batch = atoi(optarg); break;
+    case 'l': opt.local_port = atoi(optarg); break;
+    case 'q': opt.quiet = true; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind < argc - 1 || opt.size < (int) sizeof(struct probe_hdr)
+      || opt.size > MAX_SIZE || opt.duration < 0 || opt.threads < 1
+      || opt.batch < 1 || opt.batch > MAX_BATCH
+      || opt.local_port < 0 || opt.local_port > 65535)
+    usage(argv[0]);
+  opt.to = resolve(optind < argc ? argv[optind] : "localhost:50001");
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  vector<worker> workers(opt.threads);
+  for (int i = 0; i < opt.threads; i++) {
+    worker &w = workers[i];
+    w.id = i;
+    w.fd = open_socket();
+    w.gap_ns = opt.rate ? opt.size * 8e9 * opt.threads / opt.rate : 0;
+    w.rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+    w.pkts = w.bytes = 0;
+    w.refused = w.nobufs = w.other_errors = 0;
   }
+  start_ns = now_ns();
+  end_ns = opt.duration ? start_ns + (uint64_t) (opt.duration * 1e9) : 0;
+  for (int i = 0; i < opt.threads; i++)
+    if ((errno = pthread_create(&workers[i].tid, NULL, send_loop,
+				&workers[i]))) {
+      perror("pthread_create");
+      return 1;
+    }
 
-  char sendbuf[PKT_SIZE];
-  while(1)
-  {
-    if(sendto(udpsock, sendbuf, PKT_SIZE, 0, (struct sockaddr *)&r_s_i, sizeof(struct sockaddr_in))<0)
-    {
-      printf("Error in loop \n");
-      continue;
+  // Per-second report from the published counters
+  uint64_t last_pkts = 0, last_bytes = 0, last_t = start_ns;
+  for (uint64_t tick = start_ns + 1000000000; !stop; tick += 1000000000) {
+    if (end_ns && tick > end_ns)
+      tick = end_ns;
+    struct timespec ts = { (time_t) (tick / 1000000000),
+			   (long) (tick % 1000000000) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+	   == EINTR && !stop)
+      ;
+    uint64_t pkts = 0, bytes = 0, t = now_ns();
+    for (int i = 0; i < opt.threads; i++) {
+      pkts += workers[i].pkts.load(memory_order_relaxed);
+      bytes += workers[i].bytes.load(memory_order_relaxed);
     }
+    if (!opt.quiet)
+      printf("%6.1f s  %9llu pkts  %9.2f Mb/s\n", (t - start_ns) / 1e9,
+	     (unsigned long long) (pkts - last_pkts),
+	     (bytes - last_bytes) * 8e3 / (t - last_t));
+    last_pkts = pkts;
+    last_bytes = bytes;
+    last_t = t;
+    if (end_ns && tick >= end_ns)
+      break;
+  }
+  stop = 1;
+
+  uint64_t pkts = 0, bytes = 0, refused = 0, nobufs = 0, other = 0;
+  for (int i = 0; i < opt.threads; i++) {
+    pthread_join(workers[i].tid, NULL);
+    pkts += workers[i].pkts;
+    bytes += workers[i].bytes;
+    refused += workers[i].refused;
+    nobufs += workers[i].nobufs;
+    other += workers[i].other_errors;
   }
+  double secs = (now_ns() - start_ns) / 1e9;
+  printf("sent %llu pkts, %llu bytes in %.2f s: %.2f Mb/s, %.0f pkts/s\n",
+	 (unsigned long long) pkts, (unsigned long long) bytes, secs,
+	 bytes * 8 / secs / 1e6, pkts / secs);
+  if (refused || nobufs || other)
+    printf("not sent: %llu refused (nobody at the target),"
+	   " %llu out of buffers, %llu other errors\n",
+	   (unsigned long long) refused, (unsigned long long) nobufs,
+	   (unsigned long long) other);
+  return 0;
 }
@@ -0,0 +1,1242 @@
+/*************************************
+*Network emulator, a source-available stand-in for ./relayer.
+*
+*Reads the same config.xml and relays every pair the same way: packets a
+*sender sends to its <dst> port are delivered to the receiver's <src>
+*from the receiver's <dst> port, and packets the receiver sends to its
+*<dst> port go back to the sender's <src> from the sender's <dst> port.
+*
+*Each direction is one bottleneck link shared by all pairs: a drop-tail
+*queue of <buffer_size> packets served at <bandwidth> kb/s, followed by
+*<propagation_delay> ms of delay.  A bandwidth of 0 means unlimited.
+*
+*Optional extensions to config.xml (paths are relative to it):
+*
+*  <forward_trace>file</forward_trace>   sender->receiver direction
+*  <reverse_trace>file</reverse_trace>   receiver->sender direction
+*    A Mahimahi packet-delivery trace: one line per delivery
+*    opportunity, giving its time in ms.  Each opportunity can carry
+*    1504 bytes, a packet may span several, bytes unused when
+*    the queue is empty are lost, and the trace repeats with a period
+*    of its last timestamp.  Replaces <bandwidth> for that
+*    direction.
+*
+*  <schedule>file</schedule>   inside a <pair>
+*    Lines of "time_ms delay_ms loss_percent"; each line sets the
+*    pair's one-way delay and random loss, in both directions, from
+*    time_ms after startup until the next line.  The last line holds
+*    forever.  Overrides <propagation_delay> for that pair.  Delay
+*    changes never reorder packets.
+*
+*  <seed>n</seed>   seeds the loss generators (default 1), so runs
+*    with the same config drop the same packets.
+*
+*  <queue>droptail|red|codel|fq_codel</queue>   (default droptail)
+*    The discipline of both bottleneck queues, each still limited to
+*    <buffer_size> packets.  fq_codel gives every pair its own flow
+*    queue.  Tuning, with defaults:
+*      <codel_target>5</codel_target>  <codel_interval>100</codel_interval>
+*        ms, for codel and fq_codel
+*      <fq_quantum>1514</fq_quantum>  bytes per round
+*      <red_min>, <red_max>  average queue length in packets,
+*        buffer_size/4 and 3*buffer_size/4
+*      <red_max_p>0.1</red_max_p>
+*    The exit summary gives each queue's sojourn time (avg, p50, p99,
+*    max) and its drops.
+*
+*Packets are moved with recvmmsg/sendmmsg and the links are clocked
+*with a single timerfd, all driven from a single epoll loop, so the
+*emulator itself keeps up with well over 1 Gb/s on loopback.
+*
+*To build: make emulator
+*To run:   ./emulator config.xml
+*With <enable_log>1</enable_log> it prints per-second link counters.
+*SIGINT/SIGTERM print totals and exit.
+*************************************/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+#define MAX_PKT 65507		// The largest UDP/IPv4 datagram
+#define CODEL_MTU 1514		// CoDel never drops with less than this queued
+#define BATCH 64		// Datagrams per recvmmsg/sendmmsg
+
+static uint64_t
+now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* ---------------- config.xml ---------------- */
+
+struct endpoint_cfg {
+  string src, dst;		// host:port
+};
+
+struct pair_cfg {
+  endpoint_cfg sender, receiver;
+  string schedule;		// Empty if none
+};
+
+struct config {
+  int enable_log;
+  double propagation_delay;	// ms
+  double bandwidth;		// kb/s, 0 = unlimited
+  int buffer_size;		// packets
+  string forward_trace, reverse_trace; // Empty if none
+  unsigned int seed;
+  string queue;			// Queue discipline
+  double codel_target, codel_interval; // ms
+  double red_min, red_max, red_max_p; // packets, packets, 0..1
+  int fq_quantum;		// bytes
+  vector<pair_cfg> pairs;
+};
+
+// Resolve a path from config.xml relative to the file's directory
+static string
+config_path(const char *config, const string &path)
+{
+  const char *slash = strrchr(config, '/');
+  if (path.empty() || path[0] == '/' || !slash)
+    return path;
+  return string(config, slash + 1 - config) + path;
+}
+
+// Text between <tag> and </tag> at or after pos; pos moves past it.
+static bool
+xml_tag(const string &doc, const string &tag, string &out, size_t &pos)
+{
+  size_t b = doc.find("<" + tag + ">", pos);
+  if (b == string::npos)
+    return false;
+  b += tag.size() + 2;
+  size_t e = doc.find("</" + tag + ">", b);
+  if (e == string::npos)
+    return false;
+  out = doc.substr(b, e - b);
+  pos = e + tag.size() + 3;
+  // Trim whitespace
+  size_t s = out.find_first_not_of(" \t\r\n");
+  size_t t = out.find_last_not_of(" \t\r\n");
+  out = s == string::npos ? "" : out.substr(s, t - s + 1);
+  return true;
+}
+
+static string
+xml_required(const string &doc, const string &tag)
+{
+  string v;
+  size_t pos = 0;
+  if (!xml_tag(doc, tag, v, pos)) {
+    fprintf(stderr, "config: missing <%s>\n", tag.c_str());
+    exit(1);
+  }
+  return v;
+}
+
+static double
+xml_optional(const string &doc, const string &tag, double dflt)
+{
+  string v;
+  size_t pos = 0;
+  return xml_tag(doc, tag, v, pos) ? atof(v.c_str()) : dflt;
+}
+
+static config
+load_config(const char *path)
+{
+  ifstream in(path);
+  if (!in) {
+    perror(path);
+    exit(1);
+  }
+  stringstream ss;
+  ss << in.rdbuf();
+  string doc = ss.str();
+
+  // Drop comments, so commented-out pairs are ignored
+  size_t c;
+  while ((c = doc.find("<!--")) != string::npos) {
+    size_t e = doc.find("-->", c);
+    doc.erase(c, e == string::npos ? string::npos : e + 3 - c);
+  }
+
+  config cfg;
+  string log;
+  size_t pos = 0;
+  cfg.enable_log = xml_tag(doc, "enable_log", log, pos) ? atoi(log.c_str()) : 0;
+  cfg.propagation_delay = atof(xml_required(doc, "propagation_delay").c_str());
+  cfg.bandwidth = atof(xml_required(doc, "bandwidth").c_str());
+  cfg.buffer_size = atoi(xml_required(doc, "buffer_size").c_str());
+  string v;
+  pos = 0;
+  cfg.seed = xml_tag(doc, "seed", v, pos) ? strtoul(v.c_str(), NULL, 10) : 1;
+  pos = 0;
+  if (xml_tag(doc, "forward_trace", v, pos))
+    cfg.forward_trace = config_path(path, v);
+  pos = 0;
+  if (xml_tag(doc, "reverse_trace", v, pos))
+    cfg.reverse_trace = config_path(path, v);
+
+  pos = 0;
+  cfg.queue = xml_tag(doc, "queue", v, pos) ? v : "droptail";
+  cfg.codel_target = xml_optional(doc, "codel_target", 5);
+  cfg.codel_interval = xml_optional(doc, "codel_interval", 100);
+  cfg.red_min = xml_optional(doc, "red_min", cfg.buffer_size / 4.0);
+  cfg.red_max = xml_optional(doc, "red_max", cfg.buffer_size * 3 / 4.0);
+  cfg.red_max_p = xml_optional(doc, "red_max_p", 0.1);
+  cfg.fq_quantum = (int) xml_optional(doc, "fq_quantum", CODEL_MTU);
+
+  string block;
+  pos = 0;
+  while (xml_tag(doc, "pair", block, pos)) {
+    pair_cfg p;
+    string side;
+    size_t q = 0;
+    if (!xml_tag(block, "sender", side, q))
+      continue;
+    p.sender.src = xml_required(side, "src");
+    p.sender.dst = xml_required(side, "dst");
+    q = 0;
+    if (!xml_tag(block, "receiver", side, q))
+      continue;
+    p.receiver.src = xml_required(side, "src");
+    p.receiver.dst = xml_required(side, "dst");
+    q = 0;
+    if (xml_tag(block, "schedule", side, q))
+      p.schedule = config_path(path, side);
+    cfg.pairs.push_back(p);
+  }
+  if (cfg.pairs.empty() || cfg.buffer_size < 1 || cfg.bandwidth < 0
+      || cfg.propagation_delay < 0) {
+    fprintf(stderr, "config: need at least one pair, buffer_size >= 1,"
+	    " bandwidth >= 0 and propagation_delay >= 0\n");
+    exit(1);
+  }
+  if (cfg.queue != "droptail" && cfg.queue != "red" && cfg.queue != "codel"
+      && cfg.queue != "fq_codel") {
+    fprintf(stderr, "config: <queue> must be droptail, red, codel"
+	    " or fq_codel\n");
+    exit(1);
+  }
+  if (cfg.codel_target <= 0 || cfg.codel_interval <= 0
+      || cfg.red_min < 0 || cfg.red_max <= cfg.red_min
+      || cfg.red_max_p <= 0 || cfg.red_max_p > 1 || cfg.fq_quantum < 1) {
+    fprintf(stderr, "config: need codel_target, codel_interval > 0,"
+	    " red_min < red_max, 0 < red_max_p <= 1 and fq_quantum >= 1\n");
+    exit(1);
+  }
+  return cfg;
+}
+
+static struct sockaddr_in
+resolve(const string &hostport)
+{
+  size_t colon = hostport.rfind(':');
+  string host = colon == string::npos ? "localhost" : hostport.substr(0, colon);
+  string port = colon == string::npos ? hostport : hostport.substr(colon + 1);
+
+  struct addrinfo hints, *ai;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &ai);
+  if (err) {
+    fprintf(stderr, "%s: %s\n", hostport.c_str(), gai_strerror(err));
+    exit(1);
+  }
+  struct sockaddr_in sin;
+  memcpy(&sin, ai->ai_addr, sizeof(sin));
+  freeaddrinfo(ai);
+  return sin;
+}
+
+/* ---------------- traces and schedules ---------------- */
+
+#define OPP_BYTES 1504		// Bytes per Mahimahi delivery opportunity
+
+struct trace {
+  vector<uint64_t> opp;		// Opportunity times, ns into the period
+  uint64_t period;		// ns
+};
+
+struct step {
+  uint64_t at;			// ns after startup
+  uint64_t delay;		// ns
+  double loss;			// 0..1
+};
+
+static void
+read_lines(const string &path, vector<string> &lines)
+{
+  ifstream in(path.c_str());
+  if (!in) {
+    perror(path.c_str());
+    exit(1);
+  }
+  string line;
+  while (getline(in, line)) {
+    size_t hash = line.find('#');
+    if (hash != string::npos)
+      line.erase(hash);
+    if (line.find_first_not_of(" \t\r") != string::npos)
+      lines.push_back(line);
+  }
+}
+
+static trace *
+load_trace(const string &path)
+{
+  vector<string> lines;
+  read_lines(path, lines);
+  trace *t = new trace;
+  uint64_t last = 0;
+  for (size_t i = 0; i < lines.size(); i++) {
+    uint64_t ms = strtoull(lines[i].c_str(), NULL, 10);
+    if (ms < last) {
+      fprintf(stderr, "%s:%zu: timestamps must not decrease\n",
+	      path.c_str(), i + 1);
+      exit(1);
+    }
+    t->opp.push_back(ms * 1000000);
+    last = ms;
+  }
+  if (t->opp.empty() || last == 0) {
+    fprintf(stderr, "%s: trace needs a last timestamp above 0\n",
+	    path.c_str());
+    exit(1);
+  }
+  t->period = last * 1000000;
+  return t;
+}
+
+static vector<step>
+load_schedule(const string &path)
+{
+  vector<string> lines;
+  vector<step> steps;
+  read_lines(path, lines);
+  for (size_t i = 0; i < lines.size(); i++) {
+    double at, delay, loss;
+    if (sscanf(lines[i].c_str(), "%lf %lf %lf", &at, &delay, &loss) != 3
+	|| at < 0 || delay < 0 || loss < 0 || loss > 100
+	|| (!steps.empty() && at * 1e6 < steps.back().at)) {
+      fprintf(stderr, "%s:%zu: expected increasing "
+	      "\"time_ms delay_ms loss_percent\"\n", path.c_str(), i + 1);
+      exit(1);
+    }
+    step st = { (uint64_t) (at * 1e6), (uint64_t) (delay * 1e6), loss / 100 };
+    steps.push_back(st);
+  }
+  if (steps.empty()) {
+    fprintf(stderr, "%s: empty schedule\n", path.c_str());
+    exit(1);
+  }
+  return steps;
+}
+
+// xorshift64, uniform in [0, 1)
+static double
+uniform(uint64_t &rng)
+{
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return (rng >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* ---------------- packets ---------------- */
+
+struct delay_line;
+
+struct packet {
+  uint64_t arrive;		// When it entered the bottleneck queue
+  uint64_t deliver;		// When it leaves the delay line
+  delay_line *dl;		// Where it goes after the bottleneck
+  uint16_t len;
+  char *data;			// MAX_PKT bytes, only touched as far as len
+};
+
+// All packet buffers; queues hold indices, so moving a packet from
+// one stage to the next never copies it.
+struct pool {
+  vector<packet> slots;
+  vector<uint32_t> free_list;
+
+  // Make sure n slots can be taken without growing (which would move
+  // buffers recvmmsg has been pointed at)
+  void
+  reserve(size_t n)
+  {
+    while (free_list.size() < n) {
+      size_t old = slots.size(), grow = old ? old : 256;
+      slots.resize(old + grow);
+      for (size_t i = old + grow; i > old; i--) {
+	if (!(slots[i - 1].data = (char *) malloc(MAX_PKT))) {
+	  perror("malloc");
+	  exit(1);
+	}
+	free_list.push_back(i - 1);
+      }
+    }
+  }
+
+  uint32_t
+  get()
+  {
+    uint32_t i = free_list.back();
+    free_list.pop_back();
+    return i;
+  }
+
+  void
+  put(uint32_t i)
+  {
+    free_list.push_back(i);
+  }
+
+  packet &
+  operator[](uint32_t i)
+  {
+    return slots[i];
+  }
+};
+
+static pool pkts;
+
+// FIFO of packet indices
+struct fifo {
+  vector<uint32_t> ring;
+  size_t head, count;
+
+  fifo() : ring(64), head(0), count(0) {}
+
+  uint32_t
+  front()
+  {
+    return ring[head];
+  }
+
+  void
+  pop()
+  {
+    head = (head + 1) & (ring.size() - 1);
+    count--;
+  }
+
+  void
+  push(uint32_t i)
+  {
+    if (count == ring.size()) {
+      vector<uint32_t> bigger(ring.size() * 2);
+      for (size_t k = 0; k < count; k++)
+	bigger[k] = ring[(head + k) & (ring.size() - 1)];
+      ring.swap(bigger);
+      head = 0;
+    }
+    ring[(head + count) & (ring.size() - 1)] = i;
+    count++;
+  }
+};
+
+/* ---------------- links ---------------- */
+
+static uint64_t start_ns;	// Time zero for traces and schedules
+
+// One pair's propagation in one direction, and its random loss.
+struct delay_line {
+  fifo queue;
+  int out_fd;			// Socket it leaves the emulator from
+  struct sockaddr_in to;
+  int flow;			// Pair index, the FQ-CoDel flow it belongs to
+  uint64_t delay;		// Used when there is no schedule
+  vector<step> sched;
+  size_t sched_i;
+  uint64_t last_deliver;	// Never deliver before this: no reordering
+  uint64_t rng;			// xorshift64 state
+  uint64_t lost;
+
+  const step *
+  current(uint64_t now)
+  {
+    if (sched.empty())
+      return NULL;
+    while (sched_i + 1 < sched.size() && sched[sched_i + 1].at <= now - start_ns)
+      sched_i++;
+    return &sched[sched_i];
+  }
+
+  bool
+  lose(uint64_t now)
+  {
+    const step *st = current(now);
+    if (!st || st->loss <= 0)
+      return false;
+    return uniform(rng) < st->loss;
+  }
+
+  void
+  push(uint32_t i, uint64_t departed)
+  {
+    const step *st = current(departed);
+    uint64_t at = departed + (st ? st->delay : delay);
+    if (at < last_deliver)
+      at = last_deliver;
+    last_deliver = at;
+    pkts[i].deliver = at;
+    queue.push(i);
+  }
+};
+
+// Queueing delay histogram: exact below 16 us, then 8 buckets per
+// power of two, so percentiles are within 12.5%.
+struct sojourn_stats {
+  uint64_t count, sum, max;	// ns
+  uint64_t hist[16 + 8 * 60];
+
+  static int
+  bucket(uint64_t us)
+  {
+    if (us < 16)
+      return us;
+    int e = 63 - __builtin_clzll(us);
+    return 16 + (e - 4) * 8 + ((us >> (e - 3)) & 7);
+  }
+
+  void
+  add(uint64_t ns)
+  {
+    count++;
+    sum += ns;
+    if (ns > max)
+      max = ns;
+    hist[bucket(ns / 1000)]++;
+  }
+
+  // Midpoint of the bucket holding quantile q, in ns
+  uint64_t
+  percentile(double q)
+  {
+    uint64_t seen = 0, want = (uint64_t) (q * count);
+    for (int b = 0; b < (int) (sizeof(hist) / sizeof(hist[0])); b++) {
+      if ((seen += hist[b]) <= want || !hist[b])
+	continue;
+      if (b < 16)
+	return b * 1000;
+      int e = (b - 16) / 8 + 4;
+      uint64_t lo = (uint64_t) (8 + (b - 16) % 8) << (e - 3);
+      return (lo + (1ull << (e - 4))) * 1000;
+    }
+    return max;
+  }
+};
+
+// One FIFO with its CoDel state.  Drop-tail, RED and CoDel queue
+// everything in a single flow; FQ-CoDel has one flow per pair.
+struct flow {
+  fifo queue;
+  uint64_t bytes;		// Queued bytes
+
+  // CoDel, RFC 8289
+  uint64_t first_above_time, drop_next;
+  uint32_t count, lastcount;
+  bool dropping;
+
+  // FQ-CoDel, RFC 8290
+  int64_t deficit;
+  bool listed;			// On new_flows or old_flows
+
+  uint64_t tail_dropped, aqm_dropped;
+  sojourn_stats sojourn;
+};
+
+enum qdisc { Q_DROPTAIL, Q_RED, Q_CODEL, Q_FQ_CODEL };
+
+static const char *qdisc_names[] = { "droptail", "red", "codel", "fq_codel" };
+
+// The shared queue for one direction.  Packets leave it at a fixed
+// rate, or at the delivery opportunities of a trace, in the order the
+// queue discipline picks.
+struct bottleneck {
+  const char *name;
+  qdisc disc;
+  int limit;			// Queue length, in packets
+  size_t backlog;		// Packets queued in all flows
+  vector<flow> flows;
+  deque<int> new_flows, old_flows; // FQ-CoDel round robin
+  uint64_t target, interval;	// CoDel, ns
+  int64_t quantum;		// FQ-CoDel, bytes
+  double red_min, red_max, red_max_p, red_avg;
+  int red_count;
+  uint64_t idle_since;		// For RED's average while idle
+  uint64_t typical_tx;		// ns to send one full-sized packet
+  uint64_t rng;
+
+  int64_t cur;			// Packet being sent, or -1
+  uint64_t cur_end;		// When its last byte leaves
+
+  // Fixed rate
+  uint64_t tx_ns_per_byte_q16;	// Serialization time per byte << 16
+  uint64_t busy_until;		// When the last departed packet left
+
+  // Trace driven
+  trace *tr;			// NULL for fixed rate
+  size_t opp_i;			// Current opportunity
+  uint64_t opp_base;		// Start of the current trace period
+  uint32_t opp_left;		// Bytes left in the current opportunity
+
+  uint64_t forwarded, bytes;
+
+  void
+  init(const char *n, const config &cfg, const string &trace_path,
+       size_t npairs, uint64_t seed)
+  {
+    name = n;
+    for (int d = 0; d <= Q_FQ_CODEL; d++)
+      if (cfg.queue == qdisc_names[d])
+	disc = (qdisc) d;
+    limit = cfg.buffer_size;
+    backlog = 0;
+    flows.assign(disc == Q_FQ_CODEL ? npairs : 1, flow());
+    target = (uint64_t) (cfg.codel_target * 1e6);
+    interval = (uint64_t) (cfg.codel_interval * 1e6);
+    quantum = cfg.fq_quantum;
+    red_min = cfg.red_min;
+    red_max = cfg.red_max;
+    red_max_p = cfg.red_max_p;
+    red_avg = 0;
+    red_count = -1;
+    idle_since = start_ns;
+    rng = seed;
+    cur = -1;
+    // kb/s -> ns per byte, in 16.16 fixed point
+    tx_ns_per_byte_q16 = cfg.bandwidth > 0
+      ? (uint64_t) (8e6 / cfg.bandwidth * 65536) : 0;
+    busy_until = 0;
+    tr = trace_path.empty() ? NULL : load_trace(trace_path);
+    opp_i = 0;
+    opp_base = start_ns;
+    opp_left = OPP_BYTES;
+    typical_tx = tr ? tr->period / tr->opp.size()
+      : (CODEL_MTU * tx_ns_per_byte_q16) >> 16;
+    forwarded = bytes = 0;
+  }
+
+  flow &
+  flow_of(uint32_t i)
+  {
+    return flows[disc == Q_FQ_CODEL ? pkts[i].dl->flow : 0];
+  }
+
+  // RED's drop decision for a packet arriving now (Floyd and
+  // Jacobson 1993, without the "gentle" extension)
+  bool
+  red_drop(uint64_t now)
+  {
+    const double w = 0.002;
+    if (backlog || cur >= 0)
+      red_avg = (1 - w) * red_avg + w * backlog;
+    else if (typical_tx)
+      red_avg *= pow(1 - w, (double) (now - idle_since) / typical_tx);
+    else
+      red_avg = 0;
+    if (red_avg < red_min) {
+      red_count = -1;
+      return false;
+    }
+    if (red_avg >= red_max) {
+      red_count = 0;
+      return true;
+    }
+    red_count++;
+    double pb = red_max_p * (red_avg - red_min) / (red_max - red_min);
+    double pa = red_count * pb < 1 ? pb / (1 - red_count * pb) : 1;
+    if (uniform(rng) < pa) {
+      red_count = 0;
+      return true;
+    }
+    return false;
+  }
+
+  // Queue packet i, or drop it.  A full FQ-CoDel queue drops from the
+  // head of the flow with the most bytes queued instead.
+  void
+  enqueue(uint32_t i, uint64_t now)
+  {
+    flow &f = flow_of(i);
+    if (disc == Q_RED && red_drop(now)) {
+      f.aqm_dropped++;
+      pkts.put(i);
+      return;
+    }
+    if ((int) backlog >= limit && disc != Q_FQ_CODEL) {
+      f.tail_dropped++;
+      pkts.put(i);
+      return;
+    }
+    f.queue.push(i);
+    f.bytes += pkts[i].len;
+    backlog++;
+    if (disc == Q_FQ_CODEL && !f.listed) {
+      new_flows.push_back(&f - &flows[0]);
+      f.deficit = quantum;
+      f.listed = true;
+    }
+    if ((int) backlog > limit) {
+      flow *fat = &flows[0];
+      for (size_t k = 1; k < flows.size(); k++)
+	if (flows[k].bytes > fat->bytes)
+	  fat = &flows[k];
+      fat->tail_dropped++;
+      pkts.put(pop(*fat));
+    }
+  }
+
+  uint32_t
+  pop(flow &f)
+  {
+    uint32_t i = f.queue.front();
+    f.queue.pop();
+    f.bytes -= pkts[i].len;
+    backlog--;
+    return i;
+  }
+
+  // RFC 8289 dodequeue(): take f's head, if any, and decide whether
+  // CoDel may drop it
+  int64_t
+  codel_pop(flow &f, uint64_t now, bool &ok_to_drop)
+  {
+    ok_to_drop = false;
+    if (!f.queue.count) {
+      f.first_above_time = 0;
+      return -1;
+    }
+    uint32_t i = pop(f);
+    if (now - pkts[i].arrive < target || f.bytes <= CODEL_MTU)
+      f.first_above_time = 0;
+    else if (!f.first_above_time)
+      f.first_above_time = now + interval;
+    else if (now >= f.first_above_time)
+      ok_to_drop = true;
+    return i;
+  }
+
+  uint64_t
+  control_law(uint64_t t, uint32_t count)
+  {
+    return t + (uint64_t) (interval / sqrt(count));
+  }
+
+  // RFC 8289 dequeue()
+  int64_t
+  codel_dequeue(flow &f, uint64_t now)
+  {
+    bool ok_to_drop;
+    int64_t i = codel_pop(f, now, ok_to_drop);
+    if (f.dropping) {
+      if (!ok_to_drop)
+	f.dropping = false;
+      while (f.dropping && now >= f.drop_next) {
+	f.aqm_dropped++;
+	pkts.put(i);
+	f.count++;
+	i = codel_pop(f, now, ok_to_drop);
+	if (!ok_to_drop)
+	  f.dropping = false;
+	else
+	  f.drop_next = control_law(f.drop_next, f.count);
+      }
+    }
+    else if (ok_to_drop) {
+      f.aqm_dropped++;
+      pkts.put(i);
+      i = codel_pop(f, now, ok_to_drop);
+      f.dropping = true;
+      uint32_t delta = f.count - f.lastcount;
+      f.count = delta > 1 && (int64_t) (now - f.drop_next) < 16 * (int64_t) interval
+	? delta : 1;
+      f.drop_next = control_law(now, f.count);
+      f.lastcount = f.count;
+    }
+    return i;
+  }
+
+  // The packet to send at now, or -1 if the discipline dropped all
+  // that were queued
+  int64_t
+  dequeue(uint64_t now)
+  {
+    if (disc == Q_CODEL)
+      return codel_dequeue(flows[0], now);
+    if (disc != Q_FQ_CODEL)
+      return pop(flows[0]);
+    // RFC 8290 deficit round robin, new flows first
+    for (;;) {
+      deque<int> &list = new_flows.empty() ? old_flows : new_flows;
+      if (list.empty())
+	return -1;
+      int id = list.front();
+      flow &f = flows[id];
+      if (f.deficit <= 0) {
+	f.deficit += quantum;
+	list.pop_front();
+	old_flows.push_back(id);
+	continue;
+      }
+      int64_t i = codel_dequeue(f, now);
+      if (i < 0) {
+	list.pop_front();
+	// An emptied new flow goes round once more as an old one, so a
+	// flow can't stay new by sending one packet at a time
+	if (&list == &new_flows && !old_flows.empty())
+	  old_flows.push_back(id);
+	else
+	  f.listed = false;
+	continue;
+      }
+      f.deficit -= pkts[i].len;
+      return i;
+    }
+  }
+
+  // When the link can start sending another packet
+  uint64_t
+  link_free()
+  {
+    if (!tr)
+      return busy_until;
+    if (!opp_left)
+      advance(opp_i, opp_base, opp_left);
+    return opp_base + tr->opp[opp_i];
+  }
+
+  void
+  advance(size_t &i, uint64_t &base, uint32_t &left)
+  {
+    if (++i == tr->opp.size()) {
+      i = 0;
+      base += tr->period;
+    }
+    left = OPP_BYTES;
+  }
+
+  // Send len bytes starting at start; returns when the last one has
+  // left.  With a trace, a packet is sent piecewise over as many
+  // opportunities at or after start as it needs, like Mahimahi, and
+  // opportunities that pass while the queue is empty are wasted.
+  uint64_t
+  transmit(uint64_t start, uint16_t len)
+  {
+    if (!tr)
+      return busy_until = start + ((len * tx_ns_per_byte_q16) >> 16);
+    // Skip whole idle periods at once
+    if (start > opp_base + 2 * tr->period) {
+      opp_base += ((start - opp_base) / tr->period - 1) * tr->period;
+      opp_i = 0;
+      opp_left = OPP_BYTES;
+    }
+    while (opp_base + tr->opp[opp_i] < start)
+      advance(opp_i, opp_base, opp_left);
+    uint32_t need = len;
+    for (;;) {
+      uint32_t take = need < opp_left ? need : opp_left;
+      need -= take;
+      opp_left -= take;
+      if (!need)
+	return opp_base + tr->opp[opp_i];
+      advance(opp_i, opp_base, opp_left);
+    }
+  }
+
+  // Totals over all flows
+  uint64_t
+  total(uint64_t flow::*counter)
+  {
+    uint64_t n = 0;
+    for (size_t k = 0; k < flows.size(); k++)
+      n += flows[k].*counter;
+    return n;
+  }
+
+  uint64_t
+  total_sojourn(uint64_t sojourn_stats::*field)
+  {
+    uint64_t n = 0;
+    for (size_t k = 0; k < flows.size(); k++)
+      n += flows[k].sojourn.*field;
+    return n;
+  }
+
+  uint64_t
+  earliest_arrival()
+  {
+    uint64_t t = UINT64_MAX;
+    for (size_t k = 0; k < flows.size(); k++)
+      if (flows[k].queue.count && pkts[flows[k].queue.front()].arrive < t)
+	t = pkts[flows[k].queue.front()].arrive;
+    return t;
+  }
+
+  // Move every packet whose departure time has come onto its delay
+  // line.  Returns the next time there is work, or UINT64_MAX.
+  //
+  // Each choice of the next packet is made at the moment the link
+  // frees up; since this runs before every enqueue, it only ever sees
+  // packets that had arrived by then.
+  uint64_t
+  service(uint64_t now)
+  {
+    for (;;) {
+      if (cur < 0) {
+	if (!backlog)
+	  return UINT64_MAX;
+	uint64_t t = link_free(), first = earliest_arrival();
+	if (t < first)
+	  t = first;
+	if (t > now)
+	  return t;
+	if ((cur = dequeue(t)) < 0)
+	  continue;
+	packet &p = pkts[cur];
+	flow_of(cur).sojourn.add(t - p.arrive);
+	cur_end = transmit(t, p.len);
+      }
+      if (cur_end > now)
+	return cur_end;
+      packet &p = pkts[cur];
+      forwarded++;
+      bytes += p.len;
+      p.dl->push(cur, cur_end);
+      cur = -1;
+      idle_since = cur_end;
+    }
+  }
+};
+
+// Send everything due on a delay line.  Returns the next delivery
+// time, or UINT64_MAX.
+static uint64_t
+delay_service(delay_line &dl, uint64_t now)
+{
+  struct mmsghdr msgs[BATCH];
+  struct iovec iov[BATCH];
+  uint32_t idx[BATCH];
+
+  for (;;) {
+    int n = 0;
+    while (n < BATCH && n < (int) dl.queue.count) {
+      idx[n] = dl.queue.ring[(dl.queue.head + n) & (dl.queue.ring.size() - 1)];
+      packet &p = pkts[idx[n]];
+      if (p.deliver > now)
+	break;
+      iov[n].iov_base = p.data;
+      iov[n].iov_len = p.len;
+      memset(&msgs[n], 0, sizeof(msgs[n]));
+      msgs[n].msg_hdr.msg_name = &dl.to;
+      msgs[n].msg_hdr.msg_namelen = sizeof(dl.to);
+      msgs[n].msg_hdr.msg_iov = &iov[n];
+      msgs[n].msg_hdr.msg_iovlen = 1;
+      n++;
+    }
+    int sent = 0;
+    while (sent < n) {
+      int r = sendmmsg(dl.out_fd, msgs + sent, n - sent, 0);
+      if (r < 0) {
+	if (errno == EINTR)
+	  continue;
+	// Peer not up (ECONNREFUSED) or socket full: the network lost it
+	sent++;
+	continue;
+      }
+      sent += r;
+    }
+    for (int k = 0; k < n; k++) {
+      dl.queue.pop();
+      pkts.put(idx[k]);
+    }
+    if (n < BATCH)
+      break;
+  }
+  return dl.queue.count ? pkts[dl.queue.front()].deliver : UINT64_MAX;
+}
+
+/* ---------------- relaying ---------------- */
+
+// One bound socket.  Whatever arrives on it enters bottleneck b and
+// then delay line dl.
+struct port {
+  int fd;
+  bottleneck *b;
+  delay_line *dl;
+};
+
+static volatile sig_atomic_t stop;
+
+static void
+on_signal(int)
+{
+  stop = 1;
+}
+
+static int
+bind_udp(const string &hostport)
+{
+  struct sockaddr_in sin = resolve(hostport);
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  int n = 4 << 20;
+  if (fd < 0) {
+    perror("socket");
+    exit(1);
+  }
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &n, sizeof(n));
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &n, sizeof(n));
+  sin.sin_addr.s_addr = INADDR_ANY;
+  if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+    fprintf(stderr, "bind %s: %s\n", hostport.c_str(), strerror(errno));
+    exit(1);
+  }
+  return fd;
+}
+
+// Drain a socket into its bottleneck with recvmmsg, receiving
+// straight into pool slots.
+static void
+port_receive(port &pt)
+{
+  struct mmsghdr msgs[BATCH];
+  struct iovec iov[BATCH];
+  uint32_t idx[BATCH];
+  bottleneck &b = *pt.b;
+
+  for (;;) {
+    // Anything due to leave before these arrivals must go first.
+    // This has to happen per batch: serviced once up front, a deep
+    // socket backlog would all land in the queue at one instant.
+    uint64_t now = now_ns();
+    b.service(now);
+    pkts.reserve(BATCH);
+    for (int i = 0; i < BATCH; i++) {
+      idx[i] = pkts.get();
+      iov[i].iov_base = pkts[idx[i]].data;
+      iov[i].iov_len = MAX_PKT;
+      memset(&msgs[i], 0, sizeof(msgs[i]));
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int n = recvmmsg(pt.fd, msgs, BATCH, MSG_DONTWAIT, NULL);
+    for (int i = 0; i < BATCH; i++) {
+      // (Nothing over MAX_PKT gets here over IPv4, but never
+      // forward a cut-off datagram)
+      if (i >= n || (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+	  || pt.dl->lose(now)) {
+	if (i < n && !(msgs[i].msg_hdr.msg_flags & MSG_TRUNC))
+	  pt.dl->lost++;
+	pkts.put(idx[i]);
+	continue;
+      }
+      packet &p = pkts[idx[i]];
+      p.len = msgs[i].msg_len;
+      p.arrive = now;
+      p.dl = pt.dl;
+      b.enqueue(idx[i], now);
+    }
+    if (n < BATCH)
+      return;
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s config.xml\n", argv[0]);
+    return 1;
+  }
+  config cfg = load_config(argv[1]);
+  start_ns = now_ns();
+
+  bottleneck fwd, rev;
+  size_t np = cfg.pairs.size();
+  fwd.init("sender->receiver", cfg, cfg.forward_trace, np, cfg.seed * 2 + 1);
+  rev.init("receiver->sender", cfg, cfg.reverse_trace, np, cfg.seed * 2 + 2);
+
+  // Per pair: a port and a delay line for each direction
+  vector<port> ports(2 * np);
+  vector<delay_line> lines(2 * np);
+  for (size_t i = 0; i < np; i++) {
+    const pair_cfg &p = cfg.pairs[i];
+    vector<step> sched;
+    if (!p.schedule.empty())
+      sched = load_schedule(p.schedule);
+    int sfd = bind_udp(p.sender.dst);
+    int rfd = bind_udp(p.receiver.dst);
+    for (int d = 0; d < 2; d++) {
+      delay_line &dl = lines[2 * i + d];
+      dl.out_fd = d ? sfd : rfd;
+      dl.to = resolve(d ? p.sender.src : p.receiver.src);
+      dl.flow = i;
+      dl.delay = (uint64_t) (cfg.propagation_delay * 1e6);
+      dl.sched = sched;
+      dl.sched_i = 0;
+      dl.last_deliver = 0;
+      dl.rng = 0x9e3779b97f4a7c15ULL * (cfg.seed * 2 * np + 2 * i + d + 1);
+      dl.lost = 0;
+      port &pt = ports[2 * i + d];
+      pt.fd = d ? rfd : sfd;
+      pt.b = d ? &rev : &fwd;
+      pt.dl = &dl;
+    }
+  }
+
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (ep < 0 || timer_fd < 0) {
+    perror("epoll/timerfd");
+    return 1;
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  for (size_t i = 0; i < ports.size(); i++) {
+    ev.data.u64 = i;
+    epoll_ctl(ep, EPOLL_CTL_ADD, ports[i].fd, &ev);
+  }
+  ev.data.u64 = ports.size();
+  epoll_ctl(ep, EPOLL_CTL_ADD, timer_fd, &ev);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  bottleneck *links[2] = { &fwd, &rev };
+  for (int i = 0; i < 2; i++) {
+    const string &tp = i ? cfg.reverse_trace : cfg.forward_trace;
+    if (links[i]->tr)
+      fprintf(stderr, "emulator: %s follows %s\n", links[i]->name, tp.c_str());
+    else
+      fprintf(stderr, "emulator: %s at %.0f kb/s%s\n", links[i]->name,
+	      cfg.bandwidth, cfg.bandwidth > 0 ? "" : " (unlimited)");
+  }
+  fprintf(stderr, "emulator: %zu pairs, %.1f ms delay, %d packet %s queue\n",
+	  np, cfg.propagation_delay, cfg.buffer_size, cfg.queue.c_str());
+
+  uint64_t next_log = start_ns + 1000000000;
+  uint64_t last_fwd = 0, last_drop = 0, last_bytes = 0;
+  uint64_t last_sojourn = 0, last_sojourn_n = 0;
+  uint64_t timer_at = 0;	// Deadline timer_fd is armed for
+  struct epoll_event events[32];
+  while (!stop) {
+    int n = epoll_wait(ep, events, 32, cfg.enable_log ? 1000 : -1);
+    uint64_t now = now_ns();
+    for (int i = 0; i < n; i++) {
+      size_t id = events[i].data.u64;
+      if (id < ports.size())
+	port_receive(ports[id]);
+      else {
+	uint64_t expirations;
+	if (read(timer_fd, &expirations, sizeof(expirations)) < 0
+	    && errno != EAGAIN)
+	  perror("timerfd read");
+	timer_at = 0;
+      }
+    }
+
+    // Zero-delay packets go out in the same iteration they arrived
+    now = now_ns();
+    uint64_t next = UINT64_MAX, t;
+    for (int i = 0; i < 2; i++)
+      if ((t = links[i]->service(now)) < next)
+	next = t;
+    for (size_t i = 0; i < lines.size(); i++)
+      if ((t = delay_service(lines[i], now)) < next)
+	next = t;
+    if (next == UINT64_MAX)
+      next = 0;
+    if (next != timer_at) {
+      struct itimerspec its;
+      memset(&its, 0, sizeof(its));
+      its.it_value.tv_sec = next / 1000000000;
+      its.it_value.tv_nsec = next % 1000000000;
+      timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+      timer_at = next;
+    }
+
+    if (cfg.enable_log && now >= next_log) {
+      uint64_t drop = fwd.total(&flow::tail_dropped)
+	+ fwd.total(&flow::aqm_dropped);
+      uint64_t sojourn = fwd.total_sojourn(&sojourn_stats::sum);
+      uint64_t sojourn_n = fwd.total_sojourn(&sojourn_stats::count);
+      fprintf(stderr, "%s: %llu pkts %.2f Mb/s, %llu dropped,"
+	      " %.2f ms queueing\n", fwd.name,
+	      (unsigned long long) (fwd.forwarded - last_fwd),
+	      (fwd.bytes - last_bytes) * 8 / 1e6,
+	      (unsigned long long) (drop - last_drop),
+	      sojourn_n > last_sojourn_n
+	      ? (sojourn - last_sojourn) / 1e6 / (sojourn_n - last_sojourn_n)
+	      : 0.0);
+      last_fwd = fwd.forwarded;
+      last_drop = drop;
+      last_bytes = fwd.bytes;
+      last_sojourn = sojourn;
+      last_sojourn_n = sojourn_n;
+      next_log = now + 1000000000;
+    }
+  }
+
+  for (int i = 0; i < 2; i++) {
+    bottleneck &b = *links[i];
+    fprintf(stderr, "%s: %llu forwarded (%llu bytes), %llu dropped\n",
+	    b.name, (unsigned long long) b.forwarded,
+	    (unsigned long long) b.bytes,
+	    (unsigned long long) (b.total(&flow::tail_dropped)
+				  + b.total(&flow::aqm_dropped)));
+    // Per queue: how long packets waited, and what was dropped
+    for (size_t k = 0; k < b.flows.size(); k++) {
+      flow &f = b.flows[k];
+      sojourn_stats &st = f.sojourn;
+      if (b.flows.size() > 1)
+	fprintf(stderr, "  pair %zu queue:", k);
+      else
+	fprintf(stderr, "  queue:");
+      fprintf(stderr, " sojourn ms avg %.2f p50 %.2f p99 %.2f max %.2f,"
+	      " %llu tail drops, %llu %s drops\n",
+	      st.count ? st.sum / 1e6 / st.count : 0.0,
+	      st.percentile(0.5) / 1e6, st.percentile(0.99) / 1e6,
+	      st.max / 1e6, (unsigned long long) f.tail_dropped,
+	      (unsigned long long) f.aqm_dropped, qdisc_names[b.disc]);
+    }
+  }
+  for (size_t i = 0; i < lines.size(); i++)
+    if (lines[i].lost)
+      fprintf(stderr, "pair %zu %s: %llu lost\n", i / 2,
+	      i % 2 ? "receiver->sender" : "sender->receiver",
+	      (unsigned long long) lines[i].lost);
+  return 0;
+}
@@ -0,0 +1,558 @@
+/* In-process loopback benchmark for reliable.c.
+ *
+ * Runs a sender and a receiver as two rlib loops on their own
+ * threads, talking over localhost UDP, for every combination of file
+ * size and window size.  With -l, traffic goes through a lossy
+ * forwarding thread instead, and with -S the receiver is a -S server
+ * taking the file into a directory.  Needs no relayer and no
+ * network.
+ *
+ * For each cell it reports completion-time percentiles over the
+ * runs, median goodput, process CPU time per MB transferred and
+ * system calls per data packet, from the loops' counters.
+ *
+ * A transfer is complete, and timed, when the output matches and
+ * either end has finished: the sender only does once all its data
+ * is acked, the receiver once it has the sender's EOF.  If the last
+ * ack between them is lost, the other end resends to nobody; it is
+ * torn down STALL_TIMEOUTS retransmission timeouts later, and the
+ * run counted under "stall" rather than as failed. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+
+#include "rlib.h"
+
+#define MAX_CELLS 16
+#define STALL_TIMEOUTS 4
+
+struct endpoint {
+  loop_t *l;
+  struct config_common c;
+  struct config_server *server;	/* The receiver with -S... */
+  int served;			/* ...once its connection has come */
+  pthread_t tid;
+  volatile uint64_t finished;	/* now_ns when its loop ran dry... */
+  volatile int done;
+  int killed;			/* ...or was torn down */
+};
+
+struct proxy {
+  int s[2];			/* [0] faces the sender, [1] the receiver */
+  struct sockaddr_storage to[2]; /* Where packets arriving on s[i] go */
+  double loss;
+  unsigned int seed;
+  volatile int stop;
+  pthread_t tid;
+};
+
+static volatile int expired;	/* Run deadline passed: tear down */
+static int ack_every = 1;	/* Both endpoints' delayed-ack setting */
+static int byte_seq;		/* ...and sequence numbering */
+static int max_datagram = MAX_DATAGRAM;
+static uint32_t isn = 1;
+static int fec_group;
+static int compress;
+static int server_mode;
+static char outdir[] = "/tmp/relbench-dir.XXXXXX";
+
+static void
+wake_handler (int sig)
+{
+}
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+endpoint_main (void *arg)
+{
+  struct endpoint *e = arg;
+  conn_t *c, *nc;
+
+  while (e->l->conn_list || (e->server && !e->served && !expired)) {
+    if (expired)
+      for (c = e->l->conn_list; c; c = nc) {
+	nc = c->next;
+	if (!c->delete_me) {
+	  e->killed = 1;
+	  rel_destroy (c->rel);
+	}
+      }
+    if (e->server) {
+      server_poll (e->l, e->server);
+      e->served |= e->l->conn_list != NULL;
+    }
+    else
+      conn_poll (e->l, &e->c);
+  }
+  e->finished = now_ns ();
+  e->done = 1;
+  return NULL;
+}
+
+static void *
+proxy_main (void *arg)
+{
+  struct proxy *p = arg;
+  struct pollfd pfd[2];
+  char buf[MAX_DATAGRAM];
+  int i, n;
+
+  pfd[0].fd = p->s[0];
+  pfd[1].fd = p->s[1];
+  pfd[0].events = pfd[1].events = POLLIN;
+  while (!p->stop) {
+    if (poll (pfd, 2, 20) <= 0)
+      continue;
+    for (i = 0; i < 2; i++)
+      while ((n = recv (p->s[i], buf, sizeof (buf), MSG_DONTWAIT)) >= 0)
+	if (rand_r (&p->seed) >= p->loss * RAND_MAX)
+	  sendto (p->s[!i], buf, n, 0, (struct sockaddr *) &p->to[i],
+		  addrsize (&p->to[i]));
+  }
+  return NULL;
+}
+
+static int
+udp_bind (int port, struct sockaddr_storage *ss)
+{
+  char name[16];
+  snprintf (name, sizeof (name), "%d", port);
+  if (get_address (ss, 1, 1, AF_INET, name) < 0)
+    return -1;
+  return listen_on (1, ss);
+}
+
+static uint64_t
+cpu_ns (void)
+{
+  struct rusage ru;
+  getrusage (RUSAGE_SELF, &ru);
+  return ((uint64_t) ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000
+    + ((uint64_t) ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+}
+
+static uint64_t
+syscalls (loop_t *l)
+{
+  return l->counters.polls + l->counters.sends + l->counters.recvs
+    + l->counters.reads + l->counters.writes;
+}
+
+struct result {
+  uint64_t elapsed;		/* Nanoseconds */
+  uint64_t cpu;
+  uint64_t syscalls;
+  int ok;
+  int stalled;			/* ok, but one end had to be stopped */
+};
+
+static char infile[] = "/tmp/relbench-in.XXXXXX";
+static char outfile[] = "/tmp/relbench-out.XXXXXX";
+
+static void
+setup_failed (int port)
+{
+  fprintf (stderr, "%s: cannot set up endpoints on ports %d-%d\n",
+	   progname, port, port + 3);
+  exit (1);
+}
+
+/* One transfer of size bytes (already in infile) with the given
+ * window. */
+static void
+run_once (size_t size, const char *data, int window, int timeout,
+	  double loss, int port, int deadline_ms, struct result *res)
+{
+  struct endpoint snd, rcv;
+  struct proxy px;
+  struct sockaddr_storage ss;
+  char local[16], remote[16], *buf, path[64];
+  int rpipe[2], ifd, ofd, nullfd;
+  uint64_t start, cpu0;
+
+  memset (&snd, 0, sizeof (snd));
+  memset (&rcv, 0, sizeof (rcv));
+  memset (&px, 0, sizeof (px));
+  expired = 0;
+
+  snd.c.window = rcv.c.window = window;
+  snd.c.timeout = rcv.c.timeout = timeout;
+  snd.c.ack_every = rcv.c.ack_every = ack_every;
+  snd.c.byte_seq = rcv.c.byte_seq = byte_seq;
+  snd.c.max_datagram = rcv.c.max_datagram = max_datagram;
+  snd.c.isn = rcv.c.isn = isn;
+  snd.c.fec_group = rcv.c.fec_group = fec_group;
+  snd.c.compress = compress;
+  snd.c.sender_receiver = SENDER;
+  rcv.c.sender_receiver = RECEIVER;
+
+  if ((ifd = open (infile, O_RDONLY)) < 0
+      || (ofd = open (outfile, O_RDWR|O_TRUNC)) < 0
+      || (nullfd = open ("/dev/null", O_WRONLY)) < 0
+      || pipe (rpipe) < 0) {
+    perror ("bench");
+    exit (1);
+  }
+
+  /* Sender on port, receiver on port+1.  With loss they each talk
+   * to their side of the proxy, on port+2 and port+3. */
+  if (loss > 0) {
+    if ((px.s[0] = udp_bind (port + 2, &ss)) < 0
+	|| (px.s[1] = udp_bind (port + 3, &ss)) < 0)
+      setup_failed (port);
+    snprintf (remote, sizeof (remote), "%d", port + 1);
+    get_address (&px.to[0], 0, 1, AF_INET, remote);
+    snprintf (remote, sizeof (remote), "%d", port);
+    get_address (&px.to[1], 0, 1, AF_INET, remote);
+    px.loss = loss;
+    px.seed = port;
+    pthread_create (&px.tid, NULL, proxy_main, &px);
+  }
+
+  /* The sender must be bound before the receiver sends its EOF */
+  snd.l = loop_create ();
+  rcv.l = loop_create ();
+  snprintf (local, sizeof (local), "%d", port);
+  snprintf (remote, sizeof (remote), "%d", loss > 0 ? port + 2 : port + 1);
+  if (!conn_start (snd.l, &snd.c, ifd, nullfd, local, remote))
+    setup_failed (port);
+  snprintf (local, sizeof (local), "%d", port + 1);
+  snprintf (remote, sizeof (remote), "%d", loss > 0 ? port + 3 : port);
+  if (server_mode) {
+    /* The server names the file after where the sender's packets
+     * come from */
+    snprintf (path, sizeof (path), "%s/127.0.0.1_%s", outdir, remote);
+    close (ofd);
+    close (rpipe[0]);
+    if (!(rcv.server = server_start (rcv.l, &rcv.c, local, outdir)))
+      setup_failed (port);
+  }
+  else {
+    strcpy (path, outfile);
+    if (!conn_start (rcv.l, &rcv.c, rpipe[0], ofd, local, remote))
+      setup_failed (port);
+  }
+
+  start = now_ns ();
+  cpu0 = cpu_ns ();
+  pthread_create (&snd.tid, NULL, endpoint_main, &snd);
+  pthread_create (&rcv.tid, NULL, endpoint_main, &rcv);
+
+  /* Wait for both sides, then interrupt anything still in poll */
+  while (!(snd.done && rcv.done)) {
+    uint64_t now = now_ns ();
+    uint64_t first = snd.done ? snd.finished : rcv.finished;
+    if (now - start > (uint64_t) deadline_ms * 1000000
+	|| ((snd.done || rcv.done)
+	    && now - first > (uint64_t) STALL_TIMEOUTS * timeout * 1000000))
+      expired = 1;
+    if (expired) {
+      if (!snd.done)
+	pthread_kill (snd.tid, SIGUSR2);
+      if (!rcv.done)
+	pthread_kill (rcv.tid, SIGUSR2);
+    }
+    usleep (expired ? 5000 : 1000);
+  }
+  pthread_join (snd.tid, NULL);
+  pthread_join (rcv.tid, NULL);
+  res->cpu = cpu_ns () - cpu0;
+  res->syscalls = syscalls (snd.l) + syscalls (rcv.l);
+
+  buf = xmalloc (size + 1);
+  ofd = open (path, O_RDONLY);
+  res->ok = !(snd.killed && rcv.killed)
+    && ofd >= 0 && read (ofd, buf, size + 1) == size
+    && !memcmp (buf, data, size);
+  res->stalled = res->ok && (snd.killed || rcv.killed);
+  if (!res->ok)
+    res->elapsed = now_ns () - start;
+  else if (snd.killed || (!rcv.killed && rcv.finished < snd.finished))
+    res->elapsed = rcv.finished - start;
+  else
+    res->elapsed = snd.finished - start;
+  close (ofd);
+  free (buf);
+  if (server_mode) {
+    unlink (path);
+    server_stop (rcv.l, rcv.server);
+  }
+
+  if (loss > 0) {
+    px.stop = 1;
+    pthread_join (px.tid, NULL);
+    close (px.s[0]);
+    close (px.s[1]);
+  }
+  close (rpipe[1]);
+  loop_destroy (snd.l);
+  loop_destroy (rcv.l);
+}
+
+static int
+cmp_u64 (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of a sorted array */
+static uint64_t
+percentile (const uint64_t *v, int n, int pct)
+{
+  int rank = (pct * n + 99) / 100;
+  return v[rank > 0 ? rank - 1 : 0];
+}
+
+static int
+parse_list (char *arg, long *out, int max)
+{
+  int n = 0;
+  char *tok, *end;
+
+  for (tok = strtok (arg, ","); tok && n < max; tok = strtok (NULL, ",")) {
+    long v = strtol (tok, &end, 10);
+    if (*end == 'k' || *end == 'K')
+      v *= 1024, end++;
+    else if (*end == 'm' || *end == 'M')
+      v *= 1024 * 1024, end++;
+    if (*end || v <= 0)
+      return -1;
+    out[n++] = v;
+  }
+  return n;
+}
+
+/* Something like a service log: repetitive, but not trivially so */
+static void
+fill_logs (char *data, size_t size, unsigned int seed)
+{
+  static const char *const levels[] = {
+    "INFO", "INFO", "INFO", "WARN", "DEBUG",
+  };
+  static const char *const paths[] = {
+    "/api/v1/users", "/api/v1/orders", "/healthz", "/static/app.js",
+  };
+  char line[256];
+  size_t off = 0;
+  unsigned int t = 1700000000;
+
+  while (off < size) {
+    int n, r = rand_r (&seed);
+
+    t += r % 3;
+    n = snprintf (line, sizeof (line),
+		  "%u.%03d %s web-%02d[%d]: GET %s id=%08x status=%d"
+		  " bytes=%d ms=%d\n",
+		  t, r % 1000, levels[r % 5], r % 7, 4000 + r % 13,
+		  paths[(r >> 8) % 4], rand_r (&seed),
+		  (r >> 4) % 20 ? 200 : 404, (r >> 12) % 50000,
+		  (r >> 16) % 300);
+    if (n > size - off)
+      n = size - off;
+    memcpy (data + off, line, n);
+    off += n;
+  }
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+	   "usage: %s [-s sizes] [-w windows] [-n runs] [-l loss-percent]\n"
+	   "          [-t timeout-ms] [-a ack-every] [-b] [-m max-datagram]\n"
+	   "          [-i isn] [-f fec-group] [-z] [-g] [-d deadline-ms]\n"
+	   "          [-p base-port] [-S] [-v]\n"
+	   "       -s: comma-separated file sizes, k/m suffixes allowed"
+	   " (default 10k,100k,1m)\n"
+	   "       -w: comma-separated window sizes (default 1,4,16)\n"
+	   "       -n: runs per cell (default 5)\n"
+	   "       -l: drop this percentage of packets each way\n"
+	   "       -t: retransmission timeout (default 10)\n"
+	   "       -a: ack every N in-order packets (default 1)\n"
+	   "       -b: number bytes rather than packets\n"
+	   "       -m: largest datagram to probe for (default 65507)\n"
+	   "       -f: at most this many data packets per parity packet\n"
+	   "       -z: compress payloads\n"
+	   "       -g: send generated log lines instead of random bytes\n"
+	   "       -i: initial sequence number, e.g. 0xffffff00 to run"
+	   " across the wrap\n"
+	   "       -S: receive as a -S server would, into a directory\n"
+	   "       -d: give up on a transfer after this long (default 30000)\n"
+	   "       -v: keep the endpoints' stderr output\n",
+	   progname);
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  char sizearg[] = "10k,100k,1m", windowarg[] = "1,4,16";
+  char *sizes_s = sizearg, *windows_s = windowarg;
+  long sizes[MAX_CELLS], windows[MAX_CELLS];
+  int nsizes, nwindows, runs = 5, timeout = 10, deadline = 30000;
+  int port = 42000, verbose = 0, logs = 0;
+  double loss = 0;
+  struct sigaction sa;
+  int opt, i, j, k, fd, savedfd = -1;
+
+  progname = "relbench";
+  while ((opt = getopt (argc, argv, "s:w:n:l:t:a:bm:i:f:zgd:p:Sv")) != -1)
+    switch (opt) {
+    case 's':
+      sizes_s = optarg;
+      break;
+    case 'w':
+      windows_s = optarg;
+      break;
+    case 'n':
+      runs = atoi (optarg);
+      break;
+    case 'l':
+      loss = atof (optarg) / 100;
+      break;
+    case 't':
+      timeout = atoi (optarg);
+      break;
+    case 'a':
+      ack_every = atoi (optarg);
+      break;
+    case 'b':
+      byte_seq = 1;
+      break;
+    case 'm':
+      max_datagram = atoi (optarg);
+      break;
+    case 'i':
+      isn = strtoul (optarg, NULL, 0);
+      break;
+    case 'f':
+      fec_group = atoi (optarg);
+      break;
+    case 'z':
+      compress = 1;
+      break;
+    case 'g':
+      logs = 1;
+      break;
+    case 'd':
+      deadline = atoi (optarg);
+      break;
+    case 'p':
+      port = atoi (optarg);
+      break;
+    case 'S':
+      server_mode = 1;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      usage ();
+    }
+  nsizes = parse_list (sizes_s, sizes, MAX_CELLS);
+  nwindows = parse_list (windows_s, windows, MAX_CELLS);
+  if (optind != argc || nsizes <= 0 || nwindows <= 0 || runs < 1
+      || timeout < 1 || ack_every < 1 || loss < 0 || loss >= 1
+      || max_datagram < BASE_DATAGRAM || max_datagram > MAX_DATAGRAM
+      || fec_group < 0 || fec_group > FEC_MAX_GROUP)
+    usage ();
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = SIG_IGN;
+  sigaction (SIGPIPE, &sa, NULL);
+  /* No SA_RESTART: the signal exists to knock threads out of poll */
+  sa.sa_handler = wake_handler;
+  sigaction (SIGUSR2, &sa, NULL);
+
+  if ((fd = mkstemp (outfile)) < 0) {
+    perror (outfile);
+    exit (1);
+  }
+  close (fd);
+  if (server_mode && !mkdtemp (outdir)) {
+    perror (outdir);
+    exit (1);
+  }
+
+  printf ("%8s %6s %4s %4s %5s %9s %9s %9s %10s %9s %9s\n",
+	  "size", "window", "runs", "ok", "stall", "p50_ms", "p90_ms", "max_ms",
+	  "Mbit/s", "cpu_ms/MB", "sys/pkt");
+
+  for (i = 0; i < nsizes; i++) {
+    size_t size = sizes[i];
+    char *data = xmalloc (size);
+    unsigned int seed = size;
+
+    if (logs)
+      fill_logs (data, size, seed);
+    else
+      for (k = 0; k < size; k++)
+	data[k] = rand_r (&seed);
+    if ((fd = mkstemp (infile)) < 0 || write (fd, data, size) != size) {
+      perror (infile);
+      exit (1);
+    }
+    close (fd);
+
+    for (j = 0; j < nwindows; j++) {
+      uint64_t elapsed[runs], cpu = 0, sys = 0;
+      struct result res;
+      int ok = 0, stalled = 0;
+
+      fflush (stdout);
+      if (!verbose) {
+	savedfd = dup (2);
+	fd = open ("/dev/null", O_WRONLY);
+	dup2 (fd, 2);
+	close (fd);
+      }
+      for (k = 0; k < runs; k++) {
+	run_once (size, data, windows[j], timeout, loss, port, deadline, &res);
+	elapsed[k] = res.elapsed;
+	cpu += res.cpu;
+	sys += res.syscalls;
+	ok += res.ok;
+	stalled += res.stalled;
+      }
+      if (!verbose) {
+	dup2 (savedfd, 2);
+	close (savedfd);
+      }
+
+      qsort (elapsed, runs, sizeof (elapsed[0]), cmp_u64);
+      printf ("%8zu %6ld %4d %4d %5d %9.1f %9.1f %9.1f %10.2f %9.1f %9.1f\n",
+	      size, windows[j], runs, ok, stalled,
+	      percentile (elapsed, runs, 50) / 1e6,
+	      percentile (elapsed, runs, 90) / 1e6,
+	      elapsed[runs - 1] / 1e6,
+	      size * 8 / (percentile (elapsed, runs, 50) / 1e3),
+	      cpu / 1e6 / ((double) size * runs / (1024 * 1024)),
+	      (double) sys / ((double) runs * ((size + 999) / 1000 + 1)));
+    }
+    unlink (infile);
+    strcpy (infile + strlen (infile) - 6, "XXXXXX");
+    free (data);
+  }
+  unlink (outfile);
+  if (server_mode)
+    rmdir (outdir);
+  return 0;
+}
@@ -0,0 +1,267 @@
+/* Directory transfers, see dirxfer.h */
+
+#define _GNU_SOURCE		/* fallocate */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "dirxfer.h"
+
+#define DIR_CLOSED -2		/* Not opened yet */
+
+struct dir_file {
+  char *name;			/* NULL if the manifest's was unusable */
+  uint64_t size;		/* As the manifest gives it */
+  uint64_t off;			/* Receiver: bytes written so far */
+  int fd;			/* DIR_CLOSED, or -1 once done with */
+};
+
+struct dir_xfer {
+  int dirfd;
+  struct dir_file *files;	/* nents of them in use, cap allocated */
+  int nents;
+  int cap;
+  int nfiles;			/* What dir_nfiles reports */
+  char line[4096 + 32];		/* Receiver: manifest line so far... */
+  size_t linelen;
+  int overlong;			/* ...unless it got too long to keep */
+};
+
+static struct dir_xfer *
+dir_alloc (const char *path)
+{
+  struct dir_xfer *d = calloc (1, sizeof (*d));
+
+  if (!d)
+    return NULL;
+  d->dirfd = open (path, O_RDONLY|O_DIRECTORY);
+  if (d->dirfd < 0) {
+    fprintf (stderr, "%s: %s\n", path, strerror (errno));
+    free (d);
+    return NULL;
+  }
+  return d;
+}
+
+struct dir_xfer *
+dir_send_open (const char *path, int *manifest)
+{
+  struct dir_xfer *d;
+  struct dirent **ents;
+  FILE *m;
+  int n, i;
+
+  if (!(d = dir_alloc (path)))
+    return NULL;
+  if ((n = scandir (path, &ents, NULL, alphasort)) < 0) {
+    fprintf (stderr, "%s: %s\n", path, strerror (errno));
+    dir_close (d);
+    return NULL;
+  }
+  d->files = calloc (n > 0 ? n : 1, sizeof (*d->files));
+  if (!d->files || !(m = tmpfile ())) {
+    perror ("dir_send_open");
+    exit (1);
+  }
+
+  for (i = 0; i < n; i++) {
+    const char *name = ents[i]->d_name;
+    struct stat sb;
+    if (fstatat (d->dirfd, name, &sb, 0) < 0 || !S_ISREG (sb.st_mode)
+	|| strchr (name, '\n'))
+      continue;
+    if (d->nents == DIR_MAX_FILES) {
+      fprintf (stderr, "%s: sending only the first %d files\n",
+	       path, DIR_MAX_FILES);
+      break;
+    }
+    d->files[d->nents].name = strdup (name);
+    d->files[d->nents].size = sb.st_size;
+    d->files[d->nents].off = 0;
+    d->files[d->nents].fd = DIR_CLOSED;
+    d->nents++;
+    fprintf (m, "%llu %s\n", (unsigned long long) sb.st_size, name);
+  }
+  for (i = 0; i < n; i++)
+    free (ents[i]);
+  free (ents);
+  d->nfiles = d->nents;
+
+  fflush (m);
+  *manifest = dup (fileno (m));
+  fclose (m);
+  lseek (*manifest, 0, SEEK_SET);
+  return d;
+}
+
+struct dir_xfer *
+dir_recv_open (const char *path)
+{
+  struct dir_xfer *d = dir_alloc (path);
+
+  if (d)
+    d->nfiles = DIR_MAX_FILES;
+  return d;
+}
+
+int
+dir_nfiles (const struct dir_xfer *d)
+{
+  return d->nfiles;
+}
+
+int
+dir_read (struct dir_xfer *d, int i, void *buf, size_t n)
+{
+  struct dir_file *f = &d->files[i];
+  int r;
+
+  if (f->fd == DIR_CLOSED) {
+    f->fd = openat (d->dirfd, f->name, O_RDONLY);
+    if (f->fd < 0)
+      fprintf (stderr, "%s: %s\n", f->name, strerror (errno));
+  }
+  if (f->fd < 0)
+    return -1;
+  r = read (f->fd, buf, n);
+  if (r > 0)
+    return r;
+  if (r < 0)
+    fprintf (stderr, "%s: %s\n", f->name, strerror (errno));
+  close (f->fd);
+  f->fd = -1;
+  return -1;
+}
+
+/* A name the manifest gives has to stay inside the directory */
+static int
+dir_name_ok (const char *name)
+{
+  return *name && !strchr (name, '/')
+    && strcmp (name, ".") && strcmp (name, "..");
+}
+
+/* Add the file a complete manifest line describes */
+static void
+dir_manifest_line (struct dir_xfer *d, const char *line)
+{
+  struct dir_file *f;
+  char *name;
+
+  if (d->nents == DIR_MAX_FILES)
+    return;
+  if (d->nents == d->cap) {
+    d->cap = d->cap ? 2 * d->cap : 64;
+    d->files = realloc (d->files, d->cap * sizeof (*d->files));
+  }
+  f = &d->files[d->nents++];
+  f->size = strtoull (line, &name, 10);
+  f->off = 0;
+  f->fd = DIR_CLOSED;
+  if (*name == ' ' && dir_name_ok (name + 1) && !d->overlong)
+    f->name = strdup (name + 1);
+  else {
+    /* Its stream is still received, but goes nowhere */
+    fprintf (stderr, "manifest: bad entry for file %d\n", d->nents);
+    f->name = NULL;
+    f->fd = -1;
+  }
+}
+
+void
+dir_manifest (struct dir_xfer *d, const void *_buf, size_t n)
+{
+  const char *buf = _buf, *end = buf + n;
+
+  if (n == 0) {
+    if (d->linelen > 0 || d->overlong)
+      dir_manifest_line (d, d->line);
+    d->linelen = 0;
+    d->nfiles = d->nents;
+    return;
+  }
+  while (buf < end) {
+    const char *nl = memchr (buf, '\n', end - buf);
+    size_t len = (nl ? nl : end) - buf;
+    if (d->linelen + len >= sizeof (d->line)) {
+      d->overlong = 1;
+      len = 0;
+    }
+    memcpy (d->line + d->linelen, buf, len);
+    d->linelen += len;
+    if (!nl)
+      break;
+    d->line[d->linelen] = '\0';
+    dir_manifest_line (d, d->line);
+    d->linelen = 0;
+    d->overlong = 0;
+    buf = nl + 1;
+  }
+}
+
+int
+dir_known (const struct dir_xfer *d, int i)
+{
+  return i < d->nents;
+}
+
+int
+dir_write (struct dir_xfer *d, int i, const void *_buf, size_t n)
+{
+  const char *buf = _buf;
+  struct dir_file *f;
+
+  if (i >= d->nents)
+    return -1;
+  f = &d->files[i];
+  if (f->fd == DIR_CLOSED) {
+    f->fd = openat (d->dirfd, f->name, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (f->fd < 0)
+      fprintf (stderr, "%s: %s\n", f->name, strerror (errno));
+    else if (f->size > 0 && fallocate (f->fd, 0, 0, f->size) < 0
+	     && errno != EOPNOTSUPP)
+      fprintf (stderr, "%s: fallocate: %s\n", f->name, strerror (errno));
+  }
+  if (f->fd < 0)
+    return -1;
+
+  if (n == 0) {
+    if (f->off != f->size && ftruncate (f->fd, f->off) < 0)
+      fprintf (stderr, "%s: ftruncate: %s\n", f->name, strerror (errno));
+    close (f->fd);
+    f->fd = -1;
+    return 0;
+  }
+  while (n > 0) {
+    ssize_t r = pwrite (f->fd, buf, n, f->off);
+    if (r < 0) {
+      fprintf (stderr, "%s: %s\n", f->name, strerror (errno));
+      return -1;
+    }
+    buf += r;
+    n -= r;
+    f->off += r;
+  }
+  return buf - (const char *) _buf;
+}
+
+void
+dir_close (struct dir_xfer *d)
+{
+  int i;
+
+  for (i = 0; i < d->nents; i++) {
+    if (d->files[i].fd >= 0)
+      close (d->files[i].fd);
+    free (d->files[i].name);
+  }
+  free (d->files);
+  close (d->dirfd);
+  free (d);
+}
@@ -0,0 +1,63 @@
+#ifndef DIRXFER_H
+#define DIRXFER_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* -----------------------------------------------------------------------
+
+   Directory transfers, when -s or -r names a directory.
+
+   The sender lists the regular files directly in its directory and
+   sends them all over one connection, file i as stream i + 1 (see
+   PKT_STREAM in rlib.h).  Stream 0 carries the manifest first, one
+   line per file in stream order:
+
+       <size in bytes> <name>\n
+
+   The receiver creates each file in its own directory once the
+   manifest has named it, preallocates the size it gives with
+   fallocate, and writes the stream out with pwrite at the offset it
+   has got to, so any number of files can be written at once without
+   seeking.  A file that turns out shorter than its manifest size is
+   cut back to what arrived.  Files are opened when their stream
+   starts and closed at its EOF, so the sender's concurrency (-c)
+   bounds how many are open at either end.
+
+ */
+
+#define DIR_MAX_FILES 65535	/* Stream ids are 16 bits, less stream 0 */
+
+struct dir_xfer;
+
+/* Sender: list the files in path and write their manifest to a
+ * temporary file, whose descriptor, positioned at the start, goes to
+ * *manifest.  Returns NULL on error. */
+struct dir_xfer *dir_send_open (const char *path, int *manifest);
+
+/* Receiver: receive into path, which must exist.  Returns NULL on
+ * error. */
+struct dir_xfer *dir_recv_open (const char *path);
+
+/* Number of files, which for a receiver is the most it can take
+ * until the manifest is in. */
+int dir_nfiles (const struct dir_xfer *d);
+
+/* Sender: like read on file i, opening it first if need be.  Returns
+ * -1 at its end or on error, after which the file is closed. */
+int dir_read (struct dir_xfer *d, int i, void *buf, size_t n);
+
+/* Receiver: feed manifest bytes as they arrive, n == 0 at its end. */
+void dir_manifest (struct dir_xfer *d, const void *buf, size_t n);
+
+/* Receiver: non-zero once the manifest has named file i. */
+int dir_known (const struct dir_xfer *d, int i);
+
+/* Receiver: append n bytes to file i, n == 0 closing it.  Returns n,
+ * or -1 on error. */
+int dir_write (struct dir_xfer *d, int i, const void *buf, size_t n);
+
+/* Close any files left open and free d. */
+void dir_close (struct dir_xfer *d);
+
+#endif /* !DIRXFER_H */
@@ -0,0 +1,160 @@
+/* LZ77 block codec, see lz.h */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_HASH_BITS 12
+
+static inline uint32_t
+lz_read32 (const char *p)
+{
+  uint32_t v;
+  memcpy (&v, p, sizeof (v));
+  return v;
+}
+
+static inline unsigned
+lz_hash (uint32_t v)
+{
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Continuation bytes a length of n needs beyond its nibble */
+static inline int
+lz_extra (int n)
+{
+  return n < 15 ? 0 : (n - 15) / 255 + 1;
+}
+
+static char *
+lz_put_length (char *op, int n)
+{
+  for (n -= 15; n >= 255; n -= 255)
+    *op++ = (char) 255;
+  *op++ = n;
+  return op;
+}
+
+static int
+lz_get_length (const uint8_t **ipp, const uint8_t *iend, int n)
+{
+  const uint8_t *ip = *ipp;
+  int b;
+
+  do {
+    if (ip >= iend)
+      return -1;
+    b = *ip++;
+    n += b;
+  } while (b == 255);
+  *ipp = ip;
+  return n;
+}
+
+int
+lz_compress (const char *src, int srclen, char *dst, int dstcap, int *used)
+{
+  uint32_t table[1 << LZ_HASH_BITS];
+  const char *ip = src, *anchor = src, *end = src + srclen;
+  char *op = dst, *oend = dst + dstcap;
+  int lit, len, room, misses = 0;
+
+  memset (table, 0, sizeof (table));
+  while (end - ip >= LZ_MINMATCH) {
+    uint32_t seq = lz_read32 (ip);
+    unsigned h = lz_hash (seq);
+    const char *ref = src + table[h];
+    const char *mp;
+
+    table[h] = ip - src;
+    if (ref >= ip || ip - ref > LZ_MAXOFFSET || lz_read32 (ref) != seq) {
+      /* Step faster through data that keeps not matching */
+      ip += 1 + (misses++ >> 5);
+      continue;
+    }
+
+    for (mp = ip + LZ_MINMATCH; mp < end && *mp == ref[mp - ip]; mp++)
+      ;
+    lit = ip - anchor;
+    len = mp - ip - LZ_MINMATCH;
+    if (oend - op < 1 + lz_extra (lit) + lit + 2 + lz_extra (len))
+      break;
+
+    *op++ = (lit < 15 ? lit : 15) << 4 | (len < 15 ? len : 15);
+    if (lit >= 15)
+      op = lz_put_length (op, lit);
+    memcpy (op, anchor, lit);
+    op += lit;
+    *op++ = (ip - ref) & 0xff;
+    *op++ = (ip - ref) >> 8;
+    if (len >= 15)
+      op = lz_put_length (op, len);
+
+    ip = anchor = mp;
+    misses = 0;
+  }
+
+  /* The rest goes out as literals, as many of them as fit */
+  lit = end - anchor;
+  room = oend - op;
+  if (1 + lz_extra (lit) + lit > room)
+    lit = room - 1 - lz_extra (room - 1);
+  if (lit > 0) {
+    *op++ = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15)
+      op = lz_put_length (op, lit);
+    memcpy (op, anchor, lit);
+    op += lit;
+    anchor += lit;
+  }
+
+  *used = anchor - src;
+  return op - dst;
+}
+
+int
+lz_decompress (const char *src, int srclen, char *dst, int rawlen)
+{
+  const uint8_t *ip = (const uint8_t *) src, *iend = ip + srclen;
+  char *op = dst, *oend = dst + rawlen;
+
+  while (ip < iend) {
+    int token = *ip++;
+    int lit = token >> 4, len = token & 15, off;
+    const char *ref;
+
+    if (lit == 15 && (lit = lz_get_length (&ip, iend, lit)) < 0)
+      return -1;
+    if (lit > iend - ip || lit > oend - op)
+      return -1;
+    memcpy (op, ip, lit);
+    op += lit;
+    ip += lit;
+    if (ip == iend)
+      break;			/* Last sequence, no match */
+
+    if (iend - ip < 2)
+      return -1;
+    off = ip[0] | ip[1] << 8;
+    ip += 2;
+    if (len == 15 && (len = lz_get_length (&ip, iend, len)) < 0)
+      return -1;
+    len += LZ_MINMATCH;
+    if (off == 0 || off > op - dst || len > oend - op)
+      return -1;
+
+    /* A match may overlap the bytes it produces, e.g. a run */
+    ref = op - off;
+    if (off >= len) {
+      memcpy (op, ref, len);
+      op += len;
+    }
+    else {
+      while (len-- > 0)
+	*op++ = *ref++;
+    }
+  }
+  return op == oend ? 0 : -1;
+}
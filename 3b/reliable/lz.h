@@ -0,0 +1,36 @@
+#ifndef LZ_H
+#define LZ_H 1
+
+/* -----------------------------------------------------------------------
+
+   Small LZ77 block codec for packet payloads, in the spirit of LZ4.
+
+   A block is a series of sequences.  Each starts with a token byte
+   whose high nibble is the number of literals and low nibble the
+   match length less LZ_MINMATCH; a nibble of 15 is continued by
+   bytes that are added to it, up to and including the first one
+   below 255.  The literals follow, then the match offset as two
+   little-endian bytes (1 = the byte just before), then any match
+   length continuation.  The block may end right after a sequence's
+   literals, in which case that sequence has no match.
+
+   Blocks are independent of each other, so a packet can be decoded
+   whatever order packets arrive in, and nothing has to be
+   negotiated: a receiver decodes any block it is handed.
+
+ */
+
+#define LZ_MINMATCH 4
+#define LZ_MAXOFFSET 65535
+
+/* Compress as much of src[0..srclen) as fits in dst[0..dstcap), which
+ * may be less than all of it.  Returns the length of the block and
+ * sets *used to the number of source bytes it encodes. */
+int lz_compress (const char *src, int srclen, char *dst, int dstcap,
+		 int *used);
+
+/* Decode a block that must expand to exactly rawlen bytes into dst.
+ * Returns 0 on success, -1 if the block is malformed. */
+int lz_decompress (const char *src, int srclen, char *dst, int rawlen);
+
+#endif /* !LZ_H */
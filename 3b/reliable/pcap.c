@@ -0,0 +1,190 @@
+/* Buffered pcap writer, see pcap.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "pcap.h"
+
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_SNAPLEN 65535
+#define PCAP_BUFSIZE (256 * 1024)
+
+struct pcap_file_header {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+};
+
+struct pcap_rec_header {
+  uint32_t ts_sec;
+  uint32_t ts_nsec;
+  uint32_t incl_len;
+  uint32_t orig_len;
+};
+
+int pcap_fd = -1;
+
+/* Records go into pcap_buf.  A full one is handed to the writer
+ * thread as pcap_out while recording carries on in the other. */
+static char *pcap_bufs[2];
+static char *pcap_buf;		/* Being filled... */
+static size_t pcap_used;
+static char *pcap_out;		/* ...and being written, or NULL */
+static size_t pcap_out_len;
+static int pcap_writing;	/* The writer has taken pcap_out */
+static pthread_mutex_t pcap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pcap_cond = PTHREAD_COND_INITIALIZER;
+
+static void
+pcap_write (const char *buf, size_t len)
+{
+  size_t off = 0;
+  ssize_t n;
+
+  while (off < len) {
+    n = write (pcap_fd, buf + off, len - off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    off += n;
+  }
+}
+
+static void *
+pcap_writer (void *arg)
+{
+  char *buf;
+  size_t len;
+
+  pthread_mutex_lock (&pcap_lock);
+  for (;;) {
+    while (!pcap_out || pcap_writing)
+      pthread_cond_wait (&pcap_cond, &pcap_lock);
+    buf = pcap_out;
+    len = pcap_out_len;
+    pcap_writing = 1;
+    pthread_mutex_unlock (&pcap_lock);
+    pcap_write (buf, len);
+    pthread_mutex_lock (&pcap_lock);
+    pcap_out = NULL;
+    pcap_writing = 0;
+    pthread_cond_broadcast (&pcap_cond);
+  }
+  return NULL;
+}
+
+int
+pcap_open (const char *path)
+{
+  struct pcap_file_header h;
+  pthread_t tid;
+
+  if (!(pcap_bufs[0] = malloc (PCAP_BUFSIZE))
+      || !(pcap_bufs[1] = malloc (PCAP_BUFSIZE))) {
+    fprintf (stderr, "pcap: out of memory\n");
+    return -1;
+  }
+  if ((pcap_fd = open (path, O_WRONLY|O_CREAT|O_TRUNC, 0666)) < 0) {
+    perror (path);
+    return -1;
+  }
+  memset (&h, 0, sizeof (h));
+  h.magic = PCAP_MAGIC_NSEC;
+  h.version_major = 2;
+  h.version_minor = 4;
+  h.snaplen = PCAP_SNAPLEN;
+  h.linktype = PCAP_LINKTYPE;
+  if (write (pcap_fd, &h, sizeof (h)) != sizeof (h)) {
+    perror (path);
+    close (pcap_fd);
+    pcap_fd = -1;
+    return -1;
+  }
+  pcap_buf = pcap_bufs[0];
+  if ((errno = pthread_create (&tid, NULL, pcap_writer, NULL))) {
+    perror ("pcap: pthread_create");
+    close (pcap_fd);
+    pcap_fd = -1;
+    return -1;
+  }
+  pthread_detach (tid);
+  return 0;
+}
+
+void
+pcap_flush_unlocked (void)
+{
+  int saved_errno = errno;
+
+  /* A buffer the writer is part way through is lost */
+  if (pcap_out && !pcap_writing)
+    pcap_write (pcap_out, pcap_out_len);
+  pcap_out = NULL;
+  pcap_write (pcap_buf, pcap_used);
+  pcap_used = 0;
+  errno = saved_errno;
+}
+
+void
+pcap_flush (void)
+{
+  if (pcap_fd < 0)
+    return;
+  pthread_mutex_lock (&pcap_lock);
+  while (pcap_out)
+    pthread_cond_wait (&pcap_cond, &pcap_lock);
+  pcap_write (pcap_buf, pcap_used);
+  pcap_used = 0;
+  pthread_mutex_unlock (&pcap_lock);
+}
+
+void
+pcap_record (int dir, uint32_t conn, uint16_t port,
+	     const void *buf, size_t len)
+{
+  struct pcap_rec_header rh;
+  struct pcap_pseudo ph;
+  struct timespec ts;
+  size_t need;
+
+  if (pcap_fd < 0 || len > PCAP_SNAPLEN - sizeof (ph))
+    return;
+  clock_gettime (CLOCK_REALTIME, &ts);
+  rh.ts_sec = ts.tv_sec;
+  rh.ts_nsec = ts.tv_nsec;
+  rh.incl_len = rh.orig_len = sizeof (ph) + len;
+  memset (&ph, 0, sizeof (ph));
+  ph.dir = dir;
+  ph.port = htons (port);
+  ph.conn = htonl (conn);
+  need = sizeof (rh) + sizeof (ph) + len;
+
+  pthread_mutex_lock (&pcap_lock);
+  if (pcap_used + need > PCAP_BUFSIZE) {
+    /* Only waits if the disk can't keep up with a whole buffer */
+    while (pcap_out)
+      pthread_cond_wait (&pcap_cond, &pcap_lock);
+    pcap_out = pcap_buf;
+    pcap_out_len = pcap_used;
+    pcap_buf = pcap_buf == pcap_bufs[0] ? pcap_bufs[1] : pcap_bufs[0];
+    pcap_used = 0;
+    pthread_cond_broadcast (&pcap_cond);
+  }
+  memcpy (pcap_buf + pcap_used, &rh, sizeof (rh));
+  memcpy (pcap_buf + pcap_used + sizeof (rh), &ph, sizeof (ph));
+  memcpy (pcap_buf + pcap_used + sizeof (rh) + sizeof (ph), buf, len);
+  pcap_used += need;
+  pthread_mutex_unlock (&pcap_lock);
+}
@@ -0,0 +1,54 @@
+#ifndef PCAP_H
+#define PCAP_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* -----------------------------------------------------------------------
+
+   pcap export of every datagram the library sends or receives.
+
+   The file uses the nanosecond pcap format with link type
+   LINKTYPE_USER0 (147).  Each record is a struct pcap_pseudo header
+   followed by the UDP payload exactly as it went over the wire, so
+   the cksum/len/ackno/rwnd/seqno fields stay in network order.
+   reliable.lua teaches Wireshark to decode it.
+
+   Records are appended to an in-memory buffer.  A full one goes to
+   a writer thread while recording carries on in a second, and the
+   rest is written at exit or when a fatal signal arrives, so
+   capturing costs a clock read and a memcpy per packet, and the
+   send and receive paths never write to the file themselves.
+
+ */
+
+#define PCAP_LINKTYPE 147	/* LINKTYPE_USER0 */
+
+#define PCAP_SENT 0
+#define PCAP_RECEIVED 1
+
+struct pcap_pseudo {
+  uint8_t dir;			/* PCAP_SENT or PCAP_RECEIVED */
+  uint8_t pad;
+  uint16_t port;		/* Peer UDP port, big-endian */
+  uint32_t conn;		/* conn_t id, big-endian; 0 if unknown */
+};
+
+extern int pcap_fd;		/* -1 when not capturing */
+
+/* Create the capture file and write its header.  Returns 0 on
+ * success, -1 on error. */
+int pcap_open (const char *path);
+
+/* Append one datagram to the capture. */
+void pcap_record (int dir, uint32_t conn, uint16_t port,
+		  const void *buf, size_t len);
+
+/* Write out everything buffered so far. */
+void pcap_flush (void);
+
+/* Like pcap_flush, but takes no lock, so it may be called from a
+ * signal handler.  Records being appended concurrently may be lost. */
+void pcap_flush_unlocked (void);
+
+#endif /* !PCAP_H */
@@ -8,12 +8,15 @@
 #include <poll.h>
 #include <errno.h>
 #include <time.h>
-#include <sys/time.h>
+#include <endian.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <netinet/in.h>
+#include <netdb.h>
 
 #include "rlib.h"
+#include "trace.h"
+#include "lz.h"
 
 /* CLIENT STATES */
 #define CLIENT_WAITING_DATA 0
@@ -26,16 +29,85 @@
 #define SERVER_WAITING_FLUSH 1
 #define SERVER_DONE 2
 
-#define MAX_PAYLOAD_SIZE 1000
 #define HEADER_SIZE 16
+#define STREAM_HEADER_SIZE ((int) sizeof(struct stream_header))
+#define NO_STREAM -1      // sendDataPacket: a plain packet, e.g. our EOF
 #define ACK_PACKET_SIZE 12
+#define MAX_PAYLOAD_SIZE (MAX_DATAGRAM - HEADER_SIZE)
+#define BASE_PAYLOAD_SIZE (BASE_DATAGRAM - HEADER_SIZE)
+
+/* Sequence numbers are 32-bit serial numbers (RFC 1982): they wrap,
+ * and a < b means b is less than 2^31 ahead of a.  Never compare them
+ * with plain < or subtract them into anything wider than int32_t. */
+#define SEQ_DIFF(a, b) ((int32_t) ((uint32_t) (a) - (uint32_t) (b)))
+#define SEQ_LT(a, b) (SEQ_DIFF(a, b) < 0)
+#define SEQ_LEQ(a, b) (SEQ_DIFF(a, b) <= 0)
 
 typedef struct packetWrapper {
   packet_t *packet;
-  uint32_t sentTime;
+  int size;           // Bytes allocated for packet, see wrapperFit
+  uint64_t sentTime;  // conn_clock() nanoseconds
   int acked;
+  int retransmitted;  // Karn: no RTT sample from resent packets
+  int delivered;      // Receiving side: output ahead of the slots before it
 } wrapper;
 
+// An unacked segment in byte-sequence mode; its payload is in sndBuf
+typedef struct segment {
+  uint32_t seqno;
+  int len;            // Payload bytes, 0 for EOF
+  uint64_t sentTime;  // conn_clock() nanoseconds
+  int retransmitted;
+} segment;
+
+// One stream of the connection: its input read ahead of sending, see
+// pendInput, and with PKT_STREAM where it has got to.  A connection
+// without streams keeps its input in streams[0].
+typedef struct relStream {
+  char *pending;     // pendingCap bytes, allocated on first use...
+  int pendingCap;
+  int pendingOff;    // ...of which pendingLen from here on are unsent
+  int pendingLen;
+  int inputEof;      // conn_stream_input has returned -1
+  int eof;           // Its EOF has been sent, or output
+  uint32_t seqno;    // Stream seqno of the next packet to send, or output
+} relStream;
+
+// A receiver's running XOR of one FEC group, see fecAccept
+typedef struct fecGroup {
+  uint32_t first;     // Seqno of the group's first packet
+  int k;              // Packets in the group, known once the parity is in
+  uint32_t have;      // Bit i set: packet first + i has been XORed in
+  int parity;         // The parity packet has been XORed in
+  uint16_t lenXor;    // XOR of the payload lengths...
+  uint32_t hdrXor;    // ...and of flags << 16 | rwnd
+  int len;            // Bytes of buf in use
+  char *buf;          // XOR of the payloads, maxPayload bytes
+} fecGroup;
+
+// Per-connection counters, bumped inline on the hot path
+typedef struct relStats {
+  uint64_t pktsSent;        // Data packets put on the wire, incl. resends
+  uint64_t bytesSent;       // Payload bytes of those packets
+  uint64_t pktsRecv;        // Everything handed to rel_recvpkt
+  uint64_t acksSent;
+  uint64_t bytesAcked;      // Payload bytes cumulatively acked by the peer
+  uint64_t bytesDelivered;  // Payload bytes passed to conn_output
+  uint64_t rtxTimeout;      // Retransmits because the timer expired
+  uint64_t rtxFast;         // Retransmits on triple duplicate ack
+  uint64_t dupAcks;
+  uint64_t dupData;         // Data below NEXT_PACKET_EXPECTED
+  uint64_t outOfWindow;     // Data beyond the receive window, acks beyond sent
+  uint64_t badChecksum;
+  uint64_t badLength;       // Header length disagrees with datagram
+  uint64_t paritySent;      // FEC parity packets, not counted in pktsSent
+  uint64_t fecRecovered;    // Lost packets rebuilt from parity
+  uint64_t zIn;             // Input bytes sent compressed...
+  uint64_t zOut;            // ...and what they compressed to
+  uint64_t resumed;         // Bytes of the file skipped by resuming
+  int cwndMax;
+} relStats;
+
 struct reliable_state {
 
   conn_t *c;			/* This is the connection object */
@@ -50,11 +122,11 @@ struct reliable_state {
   int timeout;
 
   // Sending side
-  int LAST_PACKET_ACKED;
-  int LAST_PACKET_SENT;
+  uint32_t LAST_PACKET_ACKED;
+  uint32_t LAST_PACKET_SENT;
 
   // Receiving side
-  int NEXT_PACKET_EXPECTED;
+  uint32_t NEXT_PACKET_EXPECTED;
 
   int eofSent, eofRecv;
   /* Client */
@@ -66,19 +138,202 @@ struct reliable_state {
 
   int w;
 
-  int LAST_ACK_RECVD;
+  uint32_t LAST_ACK_RECVD;
   int LAST_ACK_COUNT;
 
   int slowStart;
 
   int ssThresh;
 
-  uint32_t startTime;
-  uint32_t endTime;
+  uint64_t startTime;
+  uint64_t endTime;
+
+  // RTT estimate (RFC 6298), nanoseconds
+  uint64_t srtt;
+  uint64_t rttvar;
+  uint64_t minRtt;
+
+  int timerArmed;
+
+  // Delayed acks (receiving side)
+  int ackEvery;      // Most in-order packets covered by one ack...
+  uint64_t ackDelay; // ...or once the first unacked one is this old, ns
+  int ackLimit;      // Current batch, <= ackEvery, see sendAck
+  int ackStreak;     // Acks in a row sent because ackLimit was reached
+  int acksOwed;      // Packets delivered since the last ack
+  uint64_t ackDue;   // Deadline for the held-back ack, 0 if none
+
+  // Input coalescing (sending side), see pendInput
+  relStream *streams;
+  int numStreams;    // At least 1...
+  int streamed;      // ...and with PKT_STREAM headers, see streamRead
+  int *active;       // Streams being sent, at most concurrency of them...
+  int numActive;
+  int nextStream;    // ...and the next one to start
+  int streamTurn;    // Index in active of the one to send from next
+  int noDelay;       // Send partial packets at once
+  uint64_t flushDelay; // Longest a partial packet is held back, ns
+  uint64_t flushDue; // Deadline for the pending bytes, 0 if none
+  int flushNow;      // Deadline passed: send them at the next chance
+
+  // Payload compression (sending side), see sendInput
+  int compress;
+  char *zBuf;        // Compressed payload, maxPayload bytes
+  int zSkip;         // Packets left to send raw after a poor ratio...
+  int zBackoff;      // ...doubling each time it is still poor
+
+  // Byte-sequence mode, see byteRead
+  int byteSeq;
+  segment *segs;     // Unacked segments, oldest first
+  int numSegs;
+  char *sndBuf;      // Ring holding bytes sndUna..sndNxt
+  packet_t *txBuf;   // Where packets are put together to send
+  uint32_t sndCap;
+  uint32_t sndUna, sndNxt;
+  uint32_t eofSeq;   // Seqno our EOF went out with
+  char *rcvBuf;      // Ring holding bytes from rcvNxt on...
+  char *rcvHave;     // ...and which of them have arrived
+  uint32_t rcvCap;
+  uint32_t rcvNxt;
+  uint32_t peerEof;  // Seqno of the peer's EOF, if peerEofSeen
+  int peerEofSeen;
+  int rcvMss;        // Largest payload the peer has sent us
+
+  // Packetization layer path MTU discovery (RFC 8899), sending side
+  int payloadSize;   // Largest payload we send now
+  int maxPayload;    // Largest we may probe for, or accept
+  int probeHigh;     // Smallest payload known not to fit, less one
+  int probeSize;     // Payload of the probe in flight, 0 if none
+  int probeCount;    // Times a probe of probeSize has been sent
+  uint32_t probeSeq; // Seqno of the latest probe
+  uint64_t probeDue; // Next probe or probe timeout, 0 when not searching
+  int rtxStreak;     // Timer expiries in a row that had to resend
+
+  // Forward error correction, see fecAdd (sending) and fecAccept
+  int fecMax;        // Largest group we send, 0 if no parity
+  int fecK;          // Size of the group being sent
+  int fecHave;       // Packets sent in it so far...
+  uint32_t fecFirst; // ...starting at this seqno
+  packet_t *fecOut;  // Its parity packet, built up as they go out
+  int fecLen;        // Parity payload bytes so far
+  uint16_t fecLenXor;
+  uint32_t fecHdrXor;
+  int fecSent;       // New packets since fecK was last picked...
+  int fecHoles;      // ...and holes the peer reported meanwhile
+  uint32_t fecHoleAck; // Seqno of the last hole counted
+  uint32_t fecLoss;  // Smoothed loss rate, in 1/65536ths
+  fecGroup *fecGroups; // FEC_GROUPS of them, allocated on first use
+  int fecVictim;     // The one to reuse next
+  packet_t *fecPkt;  // Where a lost packet is rebuilt
+
+  // Resuming a transfer (-R), see resumeRecv
+  int resumeWait;    // Until settled, neither end sends data and a
+                     // receiver drops it
+  uint64_t resumeOffset; // Where the output/input continues...
+  uint64_t resumeHash;   // ...and the hash of the bytes before that
+  uint64_t resumeDue;    // When a receiver asks again; 0 once answered
+
+  relStats stats;
 
   // int eofToSender;
 };
-rel_t *rel_list;
+
+/* Server-mode connections, keyed by peer address.  Open addressing
+ * with linear probing; the table is kept at most half full and
+ * deletion shifts later entries back, so there are no tombstones.
+ * Each loop has its own table, hung off loop->rel_state. */
+typedef struct relSlot {
+  unsigned int hash;
+  rel_t *r;
+} relSlot;
+
+typedef struct relTable {
+  relSlot *slots;
+  unsigned int size;  // Always a power of two
+  unsigned int count;
+} relTable;
+
+relTable *
+getRelTable (loop_t *l) {
+  if (!l->rel_state) {
+    relTable *t = xmalloc(sizeof(*t));
+    memset(t, 0, sizeof(*t));
+    l->rel_state = t;
+  }
+  return l->rel_state;
+}
+
+rel_t *
+relTableLookup (relTable *t, const struct sockaddr_storage *ss) {
+  if (t->count == 0) {
+    return NULL;
+  }
+  unsigned int mask = t->size - 1;
+  unsigned int hash = addrhash(ss);
+  unsigned int i;
+  for (i = hash & mask; t->slots[i].r; i = (i + 1) & mask) {
+    if (t->slots[i].hash == hash && addreq(&t->slots[i].r->c->peer, ss)) {
+      return t->slots[i].r;
+    }
+  }
+  return NULL;
+}
+
+void
+relTableInsertSlot (relSlot *slots, unsigned int size, unsigned int hash, rel_t *r) {
+  unsigned int i;
+  for (i = hash & (size - 1); slots[i].r; i = (i + 1) & (size - 1))
+    ;
+  slots[i].hash = hash;
+  slots[i].r = r;
+}
+
+void
+relTableInsert (relTable *t, rel_t *r) {
+  if (2 * (t->count + 1) > t->size) {
+    unsigned int newSize = t->size ? 2 * t->size : 64;
+    relSlot *newSlots = xmalloc(newSize * sizeof(*newSlots));
+    memset(newSlots, 0, newSize * sizeof(*newSlots));
+    unsigned int i;
+    for (i = 0; i < t->size; i++) {
+      if (t->slots[i].r) {
+        relTableInsertSlot(newSlots, newSize, t->slots[i].hash, t->slots[i].r);
+      }
+    }
+    free(t->slots);
+    t->slots = newSlots;
+    t->size = newSize;
+  }
+  relTableInsertSlot(t->slots, t->size, addrhash(&r->c->peer), r);
+  t->count++;
+}
+
+void
+relTableRemove (relTable *t, rel_t *r) {
+  if (t->count == 0) {
+    return;
+  }
+  unsigned int mask = t->size - 1;
+  unsigned int i;
+  for (i = addrhash(&r->c->peer) & mask; t->slots[i].r != r; i = (i + 1) & mask) {
+    if (!t->slots[i].r) {
+      return;  // not a server-mode connection
+    }
+  }
+  t->slots[i].r = NULL;
+  t->count--;
+
+  // Shift back any entry whose probe sequence passed through slot i
+  unsigned int j;
+  for (j = (i + 1) & mask; t->slots[j].r; j = (j + 1) & mask) {
+    unsigned int home = t->slots[j].hash & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      t->slots[i] = t->slots[j];
+      t->slots[j].r = NULL;
+      i = j;
+    }
+  }
+}
 
 int
 verifyChecksum (rel_t *r, packet_t *pkt, size_t n) {
@@ -95,23 +350,94 @@ verifyChecksum (rel_t *r, packet_t *pkt, size_t n) {
 }
 
 struct ack_packet *
-createAckPacket (rel_t *r, int ackno) {
+createAckPacket (rel_t *r, uint32_t ackno) {
   struct ack_packet *ack;
   ack = malloc(sizeof(*ack));
 
   ack->cksum = 0;
   ack->len = htons(ACK_PACKET_SIZE);
   ack->ackno = htonl(ackno);
+  ack->rwnd = 0;
+  ack->flags = 0;
+  ack->spare = 0;
   ack->cksum = cksum(ack, ACK_PACKET_SIZE);
   return ack;
 }
 
-uint32_t
-getCurrentTime () { // Returns time in ms since epoch
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  uint32_t ms = (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
-  return ms;
+uint64_t
+getCurrentTime (rel_t *r) { // Returns cached monotonic time in ns
+  return conn_clock(r->c);
+}
+
+void
+sampleRtt (rel_t *r, uint64_t rtt) {
+  if (r->srtt == 0) {
+    r->srtt = rtt;
+    r->rttvar = rtt / 2;
+  }
+  else {
+    uint64_t err = rtt > r->srtt ? rtt - r->srtt : r->srtt - rtt;
+    r->rttvar = (3 * r->rttvar + err) / 4;
+    r->srtt = (7 * r->srtt + rtt) / 8;
+  }
+  if (r->minRtt == 0 || rtt < r->minRtt) {
+    r->minRtt = rtt;
+  }
+}
+
+// Print the connection's counters as one JSON line on stderr
+void
+printStats (rel_t *r, const char *event) {
+  relStats *st = &r->stats;
+  uint64_t elapsed = getCurrentTime(r) - r->startTime;
+  uint64_t goodput = 0;
+  if (elapsed > 0) {
+    // In double: bytes * 8e9 overflows 64 bits past ~2.3 GB
+    goodput = (double) (st->bytesAcked + st->bytesDelivered) * 8e9 / elapsed;
+  }
+
+  char addr[NI_MAXHOST] = "unknown";
+  char port[NI_MAXSERV] = "0";
+  getnameinfo((const struct sockaddr *) &r->c->peer, sizeof(r->c->peer),
+              addr, sizeof(addr), port, sizeof(port),
+              NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV);
+
+  fprintf(stderr, "{\"event\":\"%s\",\"peer\":\"%s:%s\",\"role\":\"%s\","
+          "\"elapsed_ms\":%llu,\"pkts_sent\":%llu,\"bytes_sent\":%llu,"
+          "\"pkts_recv\":%llu,\"acks_sent\":%llu,\"bytes_acked\":%llu,"
+          "\"bytes_delivered\":%llu,\"rtx_timeout\":%llu,\"rtx_fast\":%llu,"
+          "\"dup_acks\":%llu,\"dup_data\":%llu,\"out_of_window\":%llu,"
+          "\"bad_checksum\":%llu,\"bad_length\":%llu,\"srtt_us\":%llu,"
+          "\"min_rtt_us\":%llu,\"cwnd_max\":%d,\"plpmtu\":%d,"
+          "\"parity_sent\":%llu,\"fec_recovered\":%llu,"
+          "\"z_in\":%llu,\"z_out\":%llu,\"resumed\":%llu,"
+          "\"goodput_bps\":%llu}\n",
+          event, addr, port,
+          r->c->sender_receiver == RECEIVER ? "receiver" : "sender",
+          (unsigned long long) (elapsed / 1000000),
+          (unsigned long long) st->pktsSent,
+          (unsigned long long) st->bytesSent,
+          (unsigned long long) st->pktsRecv,
+          (unsigned long long) st->acksSent,
+          (unsigned long long) st->bytesAcked,
+          (unsigned long long) st->bytesDelivered,
+          (unsigned long long) st->rtxTimeout,
+          (unsigned long long) st->rtxFast,
+          (unsigned long long) st->dupAcks,
+          (unsigned long long) st->dupData,
+          (unsigned long long) st->outOfWindow,
+          (unsigned long long) st->badChecksum,
+          (unsigned long long) st->badLength,
+          (unsigned long long) (r->srtt / 1000),
+          (unsigned long long) (r->minRtt / 1000),
+          st->cwndMax,
+          HEADER_SIZE + r->payloadSize,
+          (unsigned long long) st->paritySent,
+          (unsigned long long) st->fecRecovered,
+          (unsigned long long) st->zIn,
+          (unsigned long long) st->zOut,
+          (unsigned long long) st->resumed,
+          (unsigned long long) goodput);
 }
 
 void
@@ -119,26 +445,709 @@ retransmitPacket (wrapper *pW) {
   return;
 }
 
-packet_t *
-createDataPacket (rel_t *r, char *payload, int bytesReceived) {
-  packet_t *packet;
-  packet = malloc(sizeof(*packet));
+// Arm the connection timer for the earliest retransmission, delayed
+// ack, input flush or path MTU probe deadline
+void
+armTimer (rel_t *r, uint64_t curTime) {
+  int numPacketsInWindow = r->LAST_PACKET_SENT - r->LAST_PACKET_ACKED;
+  uint64_t timeout = (uint64_t) r->timeout * 1000000;
+  uint64_t deadline = r->ackDue;
+
+  if (r->flushDue && (deadline == 0 || r->flushDue < deadline)) {
+    deadline = r->flushDue;
+  }
+  if (r->probeDue && (deadline == 0 || r->probeDue < deadline)) {
+    deadline = r->probeDue;
+  }
+  if (r->resumeDue && (deadline == 0 || r->resumeDue < deadline)) {
+    deadline = r->resumeDue;
+  }
+
+  int i;
+  for (i = 0; i < numPacketsInWindow; i++) {
+    uint64_t due = r->sentPackets[i]->sentTime + timeout;
+    if (deadline == 0 || due < deadline) {
+      deadline = due;
+    }
+  }
+  for (i = 0; i < r->numSegs; i++) {
+    uint64_t due = r->segs[i].sentTime + timeout;
+    if (deadline == 0 || due < deadline) {
+      deadline = due;
+    }
+  }
+  if (deadline == 0) {
+    r->timerArmed = 0;
+    conn_settimer(r->c, -1);
+    return;
+  }
+  // Packets are resent once strictly more than timeout old; round up to ms
+  long delay = deadline >= curTime ? (deadline - curTime) / 1000000 + 1 : 0;
+  r->timerArmed = 1;
+  conn_settimer(r->c, delay);
+}
+
+// Send a cumulative ack for everything delivered so far.
+//
+// When the delayed-ack timer has to send it, the sender most likely
+// has no more than acksOwed packets in flight, so later acks cover
+// that many.  After ACK_STREAK acks in a row fill their batch, the
+// batch grows by one again, up to ackEvery.
+#define ACK_STREAK 16
+
+void
+sendAck (rel_t *r, int timedOut) {
+  if (timedOut) {
+    r->ackLimit = r->acksOwed > 1 ? r->acksOwed : 1;
+    r->ackStreak = 0;
+  }
+  else if (r->acksOwed >= r->ackLimit && ++r->ackStreak >= ACK_STREAK) {
+    if (r->ackLimit < r->ackEvery) {
+      r->ackLimit++;
+    }
+    r->ackStreak = 0;
+  }
+
+  struct ack_packet *ack = createAckPacket(r, r->byteSeq ? r->rcvNxt
+                                           : r->NEXT_PACKET_EXPECTED);
+  conn_sendpkt(r->c, (packet_t *)ack, ACK_PACKET_SIZE);
+  r->stats.acksSent++;
+  free(ack);
+  r->acksOwed = 0;
+  r->ackDue = 0;
+}
+
+// All congestion window changes go through here
+void
+setWindowSize (rel_t *r, int windowSize) {
+  trace_event(TR_CWND, r->c->id, 0, r->windowSize, windowSize);
+  r->windowSize = windowSize;
+  if (windowSize > r->stats.cwndMax) {
+    r->stats.cwndMax = windowSize;
+  }
+}
+
+// Bytes of payload a packet of stream sid spends on its stream header
+int
+streamHeaderSize (rel_t *r, int sid) {
+  return r->streamed && sid != NO_STREAM ? STREAM_HEADER_SIZE : 0;
+}
 
-  memset(packet->data, 0, MAX_PAYLOAD_SIZE);
-  memcpy(packet->data, payload, bytesReceived);
+// rawLen is the input the payload carries: bytesReceived, unless the
+// payload is an lz block, which rwnd then gives the length of.  With
+// streams the payload goes after the stream header for sid.
+void
+createDataPacket (rel_t *r, packet_t *packet, int sid, char *payload,
+                  int bytesReceived, int rawLen) {
+  int hdr = streamHeaderSize(r, sid);
+  int len = HEADER_SIZE + hdr + bytesReceived;
+  if (bytesReceived > 0) {
+    memcpy(packet->data + hdr, payload, bytesReceived);
+  }
   packet->cksum = 0;
-  packet->len = htons(HEADER_SIZE + bytesReceived);
+  packet->len = htons(len);
   packet->ackno = htonl(r->NEXT_PACKET_EXPECTED);
+  packet->rwnd = rawLen != bytesReceived ? htons(rawLen) : 0;
+  packet->flags = rawLen != bytesReceived ? PKT_COMPRESSED : 0;
+  packet->spare = r->fecK ? r->fecHave + 1 : 0;  // Index in its FEC group
   packet->seqno = htonl(r->LAST_PACKET_SENT + 1);
-  packet->cksum = cksum(packet, HEADER_SIZE + bytesReceived);
+  if (hdr) {
+    struct stream_header sh;
+    sh.sid = htons(sid);
+    sh.spare = 0;
+    sh.seqno = htonl(r->streams[sid].seqno++);
+    memcpy(packet->data, &sh, sizeof(sh));
+    packet->flags |= PKT_STREAM;
+  }
+  packet->cksum = cksum(packet, len);
+}
+
+// Input bytes a data packet carries, once expanded
+int
+payloadBytes (packet_t *pkt) {
+  int hdr = pkt->flags & PKT_STREAM ? STREAM_HEADER_SIZE : 0;
+  if (pkt->flags & PKT_COMPRESSED) {
+    return ntohs(pkt->rwnd);
+  }
+  return ntohs(pkt->len) - HEADER_SIZE - hdr;
+}
+
+// Make sure w->packet can hold len bytes.  Window slots start out
+// BASE_DATAGRAM long and only grow once bigger packets are in use.
+void
+wrapperFit (wrapper *w, int len) {
+  if (w->size < len) {
+    w->packet = realloc(w->packet, len);
+    w->size = len;
+  }
+}
+
+// Nagle-style input coalescing.  Reads stream sid's input into its
+// pending buffer, up to a packet's worth or, when compressing, as
+// much as a packet could carry compressed.  The bytes are ready to go
+// as a packet once a packet's worth is pending, nothing is in flight,
+// input hits EOF, or they have waited flushDelay; with noDelay they go
+// at once.  Returns how many are ready at pending + pendingOff, 0 if
+// none are yet, or -1 at EOF.  dropInput then consumes those that
+// were sent.
+int
+pendInput (rel_t *s, int sid, int inFlight) {
+  relStream *st = &s->streams[sid];
+  int room = s->payloadSize - streamHeaderSize(s, sid);
+  int want = s->compress && !s->zSkip ? MAX_PAYLOAD_SIZE : room;
+  if (!st->pending) {
+    // Compressed packets read ahead up to MAX_PAYLOAD_SIZE, with as
+    // much again so the unsent bytes seldom have to be moved up front
+    st->pendingCap = s->compress ? 2 * MAX_PAYLOAD_SIZE : s->maxPayload;
+    st->pending = xmalloc(st->pendingCap);
+  }
+  if (st->pendingOff + want > st->pendingCap) {
+    memmove(st->pending, st->pending + st->pendingOff, st->pendingLen);
+    st->pendingOff = 0;
+  }
+  while (!st->inputEof && st->pendingLen < want) {
+    int n = conn_stream_input(s->c, sid,
+                              st->pending + st->pendingOff + st->pendingLen,
+                              want - st->pendingLen);
+    if (n == 0) {
+      break;
+    }
+    if (n < 0) {
+      st->inputEof = 1;
+      break;
+    }
+    st->pendingLen += n;
+  }
+  if (st->pendingLen == 0) {
+    return st->inputEof ? -1 : 0;
+  }
+
+  if (st->pendingLen < room && inFlight > 0
+      && !st->inputEof && !s->noDelay && !s->flushNow) {
+    if (!s->flushDue) {
+      uint64_t curTime = getCurrentTime(s);
+      s->flushDue = curTime + s->flushDelay;
+      armTimer(s, curTime);
+    }
+    return 0;
+  }
+  return st->pendingLen;
+}
+
+void
+dropInput (rel_t *s, int sid, int n) {
+  relStream *st = &s->streams[sid];
+  st->pendingOff += n;
+  st->pendingLen -= n;
+  if (st->pendingLen == 0) {
+    st->pendingOff = 0;
+    s->flushDue = 0;
+    s->flushNow = 0;
+  }
+}
+
+// Like conn_input, but through pendInput: copies out at most
+// payloadSize of the ready bytes
+int
+takeInput (rel_t *s, char *buf, int inFlight) {
+  int n = pendInput(s, 0, inFlight);
+  if (n > s->payloadSize) {
+    n = s->payloadSize;  // More is pending only if it just shrank
+  }
+  if (n > 0) {
+    memcpy(buf, s->streams[0].pending + s->streams[0].pendingOff, n);
+    dropInput(s, 0, n);
+  }
+  return n;
+}
+
+/* Path MTU discovery, after RFC 8899.  Every connection starts out
+ * sending BASE_PAYLOAD_SIZE payloads.  A sender then probes with
+ * padding-only PKT_PROBE packets: first at maxPayload, which settles
+ * it at once on loopback, then by bisecting between the largest size
+ * that got an answer and the smallest that did not.  A peer that
+ * accepts less than we offer simply never answers, so the search
+ * also negotiates the size.  Packets already in the packet-numbered
+ * window keep their size if payloadSize later shrinks; with -b they
+ * are recut on retransmission. */
+#define MAX_PROBES 3      // Unanswered probes before a size counts as too big
+#define PROBE_STEP 64     // Stop bisecting once the bounds are this close
+#define BLACK_HOLE_RTX 3  // Timeouts in a row that mean big packets vanish
+
+// Send a probe carrying len bytes of padding
+int
+sendProbe (rel_t *r, int len) {
+  packet_t *pkt = calloc(1, HEADER_SIZE + len);
+  pkt->len = htons(HEADER_SIZE + len);
+  pkt->ackno = htonl(r->byteSeq ? r->rcvNxt : r->NEXT_PACKET_EXPECTED);
+  pkt->flags = PKT_PROBE;
+  pkt->seqno = htonl(++r->probeSeq);
+  pkt->cksum = cksum(pkt, HEADER_SIZE + len);
+  int n = conn_sendpkt(r->c, pkt, HEADER_SIZE + len);
+  free(pkt);
+  return n;
+}
+
+void
+sendProbeAck (rel_t *r, uint32_t seqno) {
+  struct ack_packet ack;
+  memset(&ack, 0, sizeof(ack));
+  ack.len = htons(ACK_PACKET_SIZE);
+  ack.ackno = htonl(seqno);
+  ack.flags = PKT_PROBE;
+  ack.cksum = cksum(&ack, ACK_PACKET_SIZE);
+  conn_sendpkt(r->c, (packet_t *) &ack, ACK_PACKET_SIZE);
+}
+
+// Restart the search from the top, e.g. after a black hole
+void
+probeStart (rel_t *r, uint64_t curTime) {
+  r->probeHigh = r->maxPayload;
+  r->probeSize = 0;
+  r->probeDue = r->maxPayload > r->payloadSize ? curTime : 0;
+}
+
+void
+probeTimer (rel_t *r, uint64_t curTime) {
+  if (!r->probeDue || curTime < r->probeDue) {
+    return;
+  }
+  if (r->probeSize && r->probeCount >= MAX_PROBES) {
+    r->probeHigh = r->probeSize - 1;
+    r->probeSize = 0;
+  }
+  for (;;) {
+    if (!r->probeSize) {
+      if (r->probeHigh - r->payloadSize < PROBE_STEP) {
+        r->probeDue = 0;  // Search complete
+        return;
+      }
+      r->probeSize = r->probeHigh == r->maxPayload ? r->maxPayload
+                     : (r->payloadSize + r->probeHigh + 1) / 2;
+      r->probeCount = 0;
+    }
+    if (sendProbe(r, r->probeSize) >= 0 || errno != EMSGSIZE) {
+      break;
+    }
+    // Bigger than our own interface takes; no need to wait for that
+    r->probeHigh = r->probeSize - 1;
+    r->probeSize = 0;
+  }
+  r->probeCount++;
+
+  // A probe only tells us about its size, so it can be given up on
+  // sooner than the retransmission timeout
+  uint64_t wait = r->srtt ? 2 * r->srtt + 4 * r->rttvar
+                  : (uint64_t) r->timeout * 1000000;
+  if (wait < 1000000) {
+    wait = 1000000;
+  }
+  r->probeDue = curTime + wait;
+}
+
+void
+probeAcked (rel_t *r, uint32_t seqno) {
+  // Any of the probes sent at the current size will do
+  if (!r->probeSize || r->probeSeq - seqno >= (uint32_t) r->probeCount) {
+    return;
+  }
+  r->payloadSize = r->probeSize;
+  r->probeSize = 0;
+  r->probeDue = getCurrentTime(r);  // On to the next size
+  armTimer(r, r->probeDue);
+}
+
+// Called for each timer expiry that resent something, and with
+// resent == 0 whenever an ack makes progress
+void
+blackHoleCheck (rel_t *r, int resent, uint64_t curTime) {
+  if (!resent) {
+    r->rtxStreak = 0;
+    return;
+  }
+  if (++r->rtxStreak >= BLACK_HOLE_RTX && r->payloadSize > BASE_PAYLOAD_SIZE) {
+    r->payloadSize = BASE_PAYLOAD_SIZE;
+    r->rtxStreak = 0;
+    probeStart(r, curTime);
+  }
+}
+
+/* Resuming a transfer (-R), see PKT_RESUME in rlib.h.  The receiver
+ * asks with its output's checkpoint and the sender answers with
+ * where it will send from.  The sender settles that once, so a
+ * repeated request gets the same answer; one run without -R always
+ * answers 0, and a file starts over.  Until answered the receiver
+ * sends nothing else, not even its EOF, so a sender that hears
+ * anything else first knows its peer runs without -R and starts at
+ * 0 too.  It never gives up on a timer: a receiver started late
+ * would then have its checkpoint thrown away. */
+
+void
+sendResume (rel_t *r, uint64_t offset, uint64_t hash) {
+  uint64_t buf[(HEADER_SIZE + sizeof(struct resume_point)) / sizeof(uint64_t)];
+  packet_t *pkt = (packet_t *) buf;
+  struct resume_point *rp = (struct resume_point *) pkt->data;
+
+  memset(buf, 0, sizeof(buf));
+  pkt->len = htons(sizeof(buf));
+  pkt->ackno = htonl(r->byteSeq ? r->rcvNxt : r->NEXT_PACKET_EXPECTED);
+  pkt->flags = PKT_RESUME;
+  rp->offset = htobe64(offset);
+  rp->hash = htobe64(hash);
+  pkt->cksum = cksum(pkt, sizeof(buf));
+  conn_sendpkt(r->c, pkt, sizeof(buf));
+}
+
+// A sender that knows where its input starts sends it, and only now
+// looks for the path MTU: probes sent before the receiver was up
+// would have been lost and the search settled too low
+void
+resumeStart (rel_t *r) {
+  uint64_t curTime = getCurrentTime(r);
+  r->resumeWait = 0;
+  probeStart(r, curTime);
+  armTimer(r, curTime);
+  rel_read(r);
+}
+
+void
+resumeRecv (rel_t *r, const struct resume_point *rp) {
+  uint64_t offset = be64toh(rp->offset);
+  uint64_t hash = be64toh(rp->hash);
+
+  if (r->c->sender_receiver == SENDER) {
+    int first = r->resumeWait;
+    if (first) {
+      if (offset > 0 && conn_input_resume(r->c, offset, hash) == 0) {
+        r->resumeOffset = offset;
+        r->resumeHash = hash;
+        r->stats.resumed = offset;
+      }
+    }
+    sendResume(r, r->resumeOffset, r->resumeHash);
+    if (first) {
+      resumeStart(r);
+    }
+    return;
+  }
+
+  if (!r->resumeWait) {
+    return;  // Answered already
+  }
+  if (offset != r->resumeOffset) {
+    conn_output_restart(r->c);
+    r->resumeOffset = 0;
+  }
+  r->stats.resumed = r->resumeOffset;
+  r->resumeWait = 0;
+  r->resumeDue = 0;
+  rel_read(r);  // Our EOF, held back till now
+  armTimer(r, getCurrentTime(r));
+}
+
+void
+resumeTimer (rel_t *r, uint64_t curTime) {
+  sendResume(r, r->resumeOffset, r->resumeHash);
+  r->resumeDue = curTime + (uint64_t) r->timeout * 1000000;
+}
+
+/* Forward error correction (-f), packet-numbered mode only.  See
+ * PKT_PARITY in rlib.h for the wire format.  The sender sizes its
+ * groups by the loss it sees: one parity packet repairs one loss per
+ * group, so fecK is kept near a fifth of the packets between losses.
+ * Losses are counted as holes, the first duplicate ack for an ackno
+ * or a retransmission timeout, which show up whether or not the
+ * receiver managed to rebuild the packet. */
+#define FEC_GROUPS 16     // Groups a receiver keeps running XORs for
+#define FEC_ADAPT 64      // New packets between adjustments of fecK
+
+// dst ^= src, extending dst with zeroes to n bytes first
+void
+xorInto (char *dst, int *dstLen, const char *src, int n) {
+  if (n > *dstLen) {
+    memset(dst + *dstLen, 0, n - *dstLen);
+    *dstLen = n;
+  }
+  int i = 0;
+  if ((((uintptr_t) dst | (uintptr_t) src) & (sizeof(uint64_t) - 1)) == 0) {
+    for (; i + (int) sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+      *(uint64_t *) (dst + i) ^= *(const uint64_t *) (src + i);
+    }
+  }
+  for (; i < n; i++) {
+    dst[i] ^= src[i];
+  }
+}
+
+// Pick the size of the next group from the smoothed loss rate
+void
+fecAdapt (rel_t *s) {
+  if (s->fecSent >= FEC_ADAPT) {
+    uint32_t sample = (uint64_t) s->fecHoles * 65536 / s->fecSent;
+    s->fecLoss = (3 * (uint64_t) s->fecLoss + sample) / 4;
+    s->fecSent = 0;
+    s->fecHoles = 0;
+  }
+  int k = s->fecLoss ? 13107 / s->fecLoss : s->fecMax;  // 0.2 / loss
+  if (k > s->fecMax) {
+    k = s->fecMax;
+  }
+  if (k < 2) {
+    k = s->fecMax < 2 ? s->fecMax : 2;
+  }
+  s->fecK = k;
+}
+
+// Close the group being sent, however many packets it has so far
+void
+sendParity (rel_t *s) {
+  packet_t *pkt = s->fecOut;
+  int len = HEADER_SIZE + s->fecLen;
+  pkt->cksum = 0;
+  pkt->len = htons(len);
+  pkt->ackno = htonl(s->fecHdrXor);
+  pkt->rwnd = htons(s->fecLenXor);
+  pkt->flags = PKT_PARITY;
+  pkt->spare = s->fecHave;
+  pkt->seqno = htonl(s->fecFirst);
+  pkt->cksum = cksum(pkt, len);
+  conn_sendpkt(s->c, pkt, len);
+  s->stats.paritySent++;
+
+  s->fecHave = 0;
+  s->fecLen = 0;
+  s->fecLenXor = 0;
+  s->fecHdrXor = 0;
+  fecAdapt(s);
+}
+
+// Fold a newly sent data packet into the current group's parity
+void
+fecAdd (rel_t *s, packet_t *pkt, int n) {
+  if (s->fecHave == 0) {
+    s->fecFirst = ntohl(pkt->seqno);
+  }
+  xorInto(s->fecOut->data, &s->fecLen, pkt->data, n);
+  s->fecLenXor ^= n;
+  s->fecHdrXor ^= pkt->flags << 16 | ntohs(pkt->rwnd);
+  s->fecSent++;
+  if (++s->fecHave == s->fecK || n == 0) {  // Full, or our EOF
+    sendParity(s);
+  }
+}
+
+// The peer has reported a hole at seqno
+void
+fecNoteHole (rel_t *s, uint32_t seqno) {
+  if (s->fecMax && seqno != s->fecHoleAck) {
+    s->fecHoleAck = seqno;
+    s->fecHoles++;
+  }
+}
+
+// The receiving side's running XOR for the group starting at first
+fecGroup *
+fecGroupFor (rel_t *r, uint32_t first) {
+  if (!r->fecGroups) {
+    r->fecGroups = calloc(FEC_GROUPS, sizeof(fecGroup));
+  }
+  int i;
+  for (i = 0; i < FEC_GROUPS; i++) {
+    if (r->fecGroups[i].buf && r->fecGroups[i].first == first) {
+      return &r->fecGroups[i];
+    }
+  }
+  // Groups arrive in order, so the one started longest ago goes
+  fecGroup *g = &r->fecGroups[r->fecVictim];
+  r->fecVictim = (r->fecVictim + 1) % FEC_GROUPS;
+  if (!g->buf) {
+    g->buf = xmalloc(r->maxPayload);
+  }
+  g->first = first;
+  g->k = 0;
+  g->have = 0;
+  g->parity = 0;
+  g->lenXor = 0;
+  g->hdrXor = 0;
+  g->len = 0;
+  return g;
+}
+
+int
+storeDataPacket (rel_t *r, packet_t *pkt, int len);
+
+// Rebuild the one packet g is missing, once its parity is in.
+// Returns 1 if a packet was put in the receive window.
+int
+fecRecover (rel_t *r, fecGroup *g) {
+  if (!g->parity || __builtin_popcount(g->have) != g->k - 1) {
+    return 0;
+  }
+  int m = __builtin_ctz(~g->have);
+  int n = g->lenXor;
+  if (m >= g->k || n > g->len) {  // Inconsistent; give up on it
+    return 0;
+  }
+  if (!r->fecPkt) {
+    r->fecPkt = xmalloc(HEADER_SIZE + r->maxPayload);
+  }
+  packet_t *pkt = r->fecPkt;
+  memcpy(pkt->data, g->buf, n);
+  pkt->cksum = 0;
+  pkt->len = htons(HEADER_SIZE + n);
+  pkt->ackno = 0;
+  pkt->rwnd = htons(g->hdrXor & 0xffff);
+  pkt->flags = g->hdrXor >> 16;
+  pkt->spare = m + 1;
+  pkt->seqno = htonl(g->first + m);
+  if (!storeDataPacket(r, pkt, HEADER_SIZE + n)) {
+    return 0;
+  }
+  r->stats.fecRecovered++;
+  return 1;
+}
+
+// Fold a newly received data packet into its group's XOR
+void
+fecAccept (rel_t *r, packet_t *pkt, int n) {
+  int idx = pkt->spare;
+  if (idx == 0 || idx > FEC_MAX_GROUP) {
+    return;
+  }
+  fecGroup *g = fecGroupFor(r, ntohl(pkt->seqno) - (idx - 1));
+  uint32_t bit = 1u << (idx - 1);
+  if (g->have & bit) {
+    return;
+  }
+  g->have |= bit;
+  xorInto(g->buf, &g->len, pkt->data, n);
+  g->lenXor ^= n;
+  g->hdrXor ^= pkt->flags << 16 | ntohs(pkt->rwnd);
+  fecRecover(r, g);
+}
+
+// Returns 1 if the parity packet let us rebuild a lost one
+int
+fecRecvParity (rel_t *r, packet_t *pkt, int n) {
+  int k = pkt->spare;
+  uint32_t first = ntohl(pkt->seqno);
+  if (k == 0 || k > FEC_MAX_GROUP || n > r->maxPayload
+      || SEQ_LEQ(first + k, r->NEXT_PACKET_EXPECTED)) {  // All delivered
+    return 0;
+  }
+  fecGroup *g = fecGroupFor(r, first);
+  if (g->parity) {
+    return 0;
+  }
+  g->k = k;
+  g->parity = 1;
+  xorInto(g->buf, &g->len, pkt->data, n);
+  g->lenXor ^= ntohs(pkt->rwnd);
+  g->hdrXor ^= ntohl(pkt->ackno);
+  return fecRecover(r, g);
+}
+
+// Put a data packet in its receive window slot, unless it is already
+// there or outside the window.  Returns 1 if it was new.
+int
+storeDataPacket (rel_t *r, packet_t *pkt, int len) {
+  uint32_t seqno = ntohl(pkt->seqno);
+  int slot = SEQ_DIFF(seqno, r->NEXT_PACKET_EXPECTED);
+  if (slot < 0 || slot >= r->windowSize || r->recvPackets[slot]->acked) {
+    return 0;
+  }
+  // Streams and plain data don't mix; a plain EOF ends either
+  int hdr = 0;
+  if (pkt->flags & PKT_STREAM) {
+    struct stream_header sh;
+    hdr = STREAM_HEADER_SIZE;
+    if (!r->streamed || len < HEADER_SIZE + hdr) {
+      r->stats.badLength++;
+      return 0;
+    }
+    memcpy(&sh, pkt->data, sizeof(sh));
+    if (ntohs(sh.sid) >= r->numStreams) {
+      r->stats.badLength++;
+      return 0;
+    }
+  }
+  else if (r->streamed && len > HEADER_SIZE) {
+    r->stats.badLength++;
+    return 0;
+  }
+
+  wrapper *w = r->recvPackets[slot];
+  if (pkt->flags & PKT_COMPRESSED) {
+    // Keep it expanded, ready for conn_output
+    int rawLen = ntohs(pkt->rwnd);
+    wrapperFit(w, HEADER_SIZE + hdr + rawLen);
+    if (rawLen > MAX_PAYLOAD_SIZE
+        || lz_decompress(pkt->data + hdr, len - HEADER_SIZE - hdr,
+                         w->packet->data + hdr, rawLen) < 0) {
+      r->stats.badLength++;
+      return 0;
+    }
+    memcpy(w->packet, pkt, HEADER_SIZE + hdr);
+    w->packet->len = htons(HEADER_SIZE + hdr + rawLen);
+    w->packet->flags &= ~PKT_COMPRESSED;
+  }
+  else {
+    wrapperFit(w, len);
+    memcpy(w->packet, pkt, len);
+  }
+  r->recvPackets[slot]->sentTime = getCurrentTime(r);
+  r->recvPackets[slot]->acked = 1;
+  fecAccept(r, pkt, len - HEADER_SIZE);
+  return 1;
+}
+
+/* Byte-sequence mode (-b).  seqno and ackno count payload bytes
+ * instead of packets, with an EOF taking up one seqno of its own
+ * like a TCP FIN.  Unacked data is kept as a byte stream in sndBuf
+ * next to the list of segments it went out in, so a resend can cut
+ * the stream into full payloadSize segments however small the
+ * originals were, or however big, if payloadSize has shrunk.  Both
+ * ends must be run with the same mode. */
+
+// Rings are a power of two long, so a seqno maps to the same offset
+// across wraparound
+uint32_t
+ringSize (uint32_t bytes) {
+  uint32_t cap = 1;
+  while (cap < bytes) {
+    cap <<= 1;
+  }
+  return cap;
+}
+
+void
+ringCopyIn (char *ring, uint32_t cap, uint32_t seqno, const char *src, uint32_t n) {
+  uint32_t off = seqno & (cap - 1);
+  uint32_t first = n < cap - off ? n : cap - off;
+  memcpy(ring + off, src, first);
+  memcpy(ring, src + first, n - first);
+}
+
+void
+ringCopyOut (const char *ring, uint32_t cap, uint32_t seqno, char *dst, uint32_t n) {
+  uint32_t off = seqno & (cap - 1);
+  uint32_t first = n < cap - off ? n : cap - off;
+  memcpy(dst, ring + off, first);
+  memcpy(dst + first, ring, n - first);
+}
 
-  return packet;
+void
+ringFill (char *ring, uint32_t cap, uint32_t seqno, int c, uint32_t n) {
+  uint32_t off = seqno & (cap - 1);
+  uint32_t first = n < cap - off ? n : cap - off;
+  memset(ring + off, c, first);
+  memset(ring, c, n - first);
 }
 
 /* Creates a new reliable protocol session, returns NULL on failure.
- * Exactly one of c and ss should be NULL.  (ss is NULL when called
- * from rlib.c, while c is NULL when this function is called from
- * rel_demux.) */
+ * c is never NULL: rlib.c passes the connection it set up, and
+ * rel_demux creates the server connection with conn_create first.
+ * ss is unused. */
 rel_t *
 rel_create (conn_t *c, const struct sockaddr_storage *ss,
 	    const struct config_common *cc)
@@ -149,168 +1158,593 @@ rel_create (conn_t *c, const struct sockaddr_storage *ss,
   r = xmalloc (sizeof (*r));
   memset (r, 0, sizeof (*r));
 
-  if (!c) {
-    c = conn_create (r, ss);
-    if (!c) {
-      free (r);
-      return NULL;
+  r->c = c;
+  r->startTime = getCurrentTime(r);
+  r->endTime = 0;
+
+  /* Do any other initialization you need here */
+
+  if(r->c->sender_receiver == RECEIVER) {
+    r->windowSize = cc->window;
+  }
+  else {
+    r->windowSize = 1;
+  }
+
+  r->ssThresh = cc->window;
+  r->stats.cwndMax = r->windowSize;
+
+  r->slowStart = 1;
+
+  r->timeout = cc->timeout;
+
+  r->ackEvery = cc->ack_every > 1 ? cc->ack_every : 1;
+  if (r->ackEvery > cc->window) {
+    r->ackEvery = cc->window;  // More can't be in flight to us
+  }
+  r->ackLimit = 1;
+  // Default to half the retransmission timeout, so a held-back ack
+  // never makes the peer resend
+  r->ackDelay = (uint64_t) (cc->ack_delay > 0 ? cc->ack_delay
+                            : (cc->timeout + 1) / 2) * 1000000;
+
+  r->noDelay = cc->nodelay;
+  r->flushDelay = (uint64_t) (cc->flush_delay > 0 ? cc->flush_delay
+                              : (cc->timeout + 1) / 2) * 1000000;
+
+  r->payloadSize = BASE_PAYLOAD_SIZE;
+  r->maxPayload = cc->max_datagram - HEADER_SIZE;
+  if (r->maxPayload < BASE_PAYLOAD_SIZE) {
+    r->maxPayload = BASE_PAYLOAD_SIZE;
+  }
+  // Compressed packets are only sent packet-numbered
+  r->compress = cc->compress && !cc->byte_seq;
+  r->streamed = c->nstreams > 0 && !cc->byte_seq;
+  r->numStreams = r->streamed ? c->nstreams : 1;
+  r->streams = calloc(r->numStreams, sizeof(relStream));
+  int i;
+  if (r->streamed && c->sender_receiver == SENDER) {
+    // The first streams start at once, the rest as those end
+    r->numActive = cc->concurrency > 0 && cc->concurrency < r->numStreams
+                   ? cc->concurrency : r->numStreams;
+    r->active = malloc(r->numActive * sizeof(int));
+    for (i = 0; i < r->numActive; i++) {
+      r->active[i] = i;
     }
+    r->nextStream = r->numActive;
+  }
+  if (r->compress) {
+    r->zBuf = xmalloc(r->maxPayload);
+    r->zBackoff = 1;
   }
 
-  r->startTime = getCurrentTime();
-  r->endTime = 0;
+  if (cc->fec_group > 0 && !cc->byte_seq) {
+    r->fecMax = cc->fec_group < FEC_MAX_GROUP ? cc->fec_group : FEC_MAX_GROUP;
+    r->fecK = r->fecMax;
+    r->fecOut = xmalloc(HEADER_SIZE + r->maxPayload);
+    r->fecHoleAck = cc->isn - 1;
+  }
 
-  r->c = c;
-  rel_list = r;
+  r->sentListSize = 0;
+  r->recvListSize = 0;
 
-  /* Do any other initialization you need here */
+  if (cc->byte_seq) {
+    // Room for a full window of full segments either way
+    r->byteSeq = 1;
+    r->segs = xmalloc(r->ssThresh * sizeof(segment));
+    // (pages stay untouched until the window actually fills them)
+    r->sndCap = ringSize(r->ssThresh * r->maxPayload);
+    r->sndBuf = xmalloc(r->sndCap);
+    r->txBuf = xmalloc(HEADER_SIZE + r->maxPayload);
+    r->rcvCap = ringSize(cc->window * r->maxPayload);
+    r->rcvBuf = xmalloc(r->rcvCap);
+    r->rcvHave = calloc(1, r->rcvCap);
+    r->rcvMss = BASE_PAYLOAD_SIZE;
+    r->sndUna = r->sndNxt = r->rcvNxt = cc->isn;
+  }
+
+  // The packet window is unused in byte-sequence mode
+  int slots = r->byteSeq ? 0 : r->ssThresh;
+  r->sentPackets = malloc(sizeof(wrapper *) * slots);
+  r->recvPackets = malloc(sizeof(wrapper *) * slots);
+
+  for (i = 0; i < slots; i++) {
+    r->sentPackets[i] = malloc(sizeof(wrapper));
+    r->sentPackets[i]->packet = malloc(BASE_DATAGRAM);
+    r->sentPackets[i]->size = BASE_DATAGRAM;
+    r->sentPackets[i]->acked = 0;
+    r->recvPackets[i] = malloc(sizeof(wrapper));
+    r->recvPackets[i]->packet = malloc(BASE_DATAGRAM);
+    r->recvPackets[i]->size = BASE_DATAGRAM;
+    r->recvPackets[i]->acked = 0;
+    r->recvPackets[i]->delivered = 0;
+  }
+
+  // Both ends start at the same seqno, 1 unless -I says otherwise
+  r->LAST_PACKET_ACKED = cc->isn - 1;
+  r->LAST_PACKET_SENT = cc->isn - 1;
+
+  r->NEXT_PACKET_EXPECTED = cc->isn;
+
+  r->eofSent = 0;
+  r->eofRecv = 0;
+
+  // initialize w to 1?
+  r->w = 1;
+
+  r->resumeHash = FNV_BASIS;
+  if (cc->resume) {
+    r->resumeWait = 1;
+    if (r->c->sender_receiver == RECEIVER) {
+      conn_output_resume(c, &r->resumeOffset, &r->resumeHash);
+      sendResume(r, r->resumeOffset, r->resumeHash);
+      r->resumeDue = r->startTime + (uint64_t) r->timeout * 1000000;
+      armTimer(r, r->startTime);  // rel_read sends nothing yet
+    }
+  }
 
   if(r->c->sender_receiver == RECEIVER) {
-    r->windowSize = cc->window;
+    rel_read(r);
+  }
+  else {
+    if (!r->resumeWait) {
+      probeStart(r, r->startTime);  // Else once resumeStart is called
+    }
+    armTimer(r, r->startTime);
+  }
+
+  return r;
+}
+
+void
+rel_destroy (rel_t *r)
+{
+  // printf("rel_destroy\n");
+  printStats(r, "destroy");
+  if (r->c->server) {
+    relTableRemove(getRelTable(r->c->loop), r);
+  }
+  conn_destroy (r->c);
+
+  /* Free any other allocated memory here */
+  int slots = r->byteSeq ? 0 : r->ssThresh;
+  int i;
+  for (i = 0; i < slots; i++) {
+    free(r->sentPackets[i]->packet);
+    free(r->sentPackets[i]);
+    free(r->recvPackets[i]->packet);
+    free(r->recvPackets[i]);
+  }
+  free(r->sentPackets);
+  free(r->recvPackets);
+  free(r->segs);
+  free(r->sndBuf);
+  free(r->txBuf);
+  free(r->rcvBuf);
+  free(r->rcvHave);
+  for (i = 0; i < r->numStreams; i++) {
+    free(r->streams[i].pending);
+  }
+  free(r->streams);
+  free(r->active);
+  free(r->zBuf);
+  free(r->fecOut);
+  free(r->fecPkt);
+  if (r->fecGroups) {
+    for (i = 0; i < FEC_GROUPS; i++) {
+      free(r->fecGroups[i].buf);
+    }
+    free(r->fecGroups);
+  }
+  free(r);
+}
+
+
+void
+rel_demux (loop_t *l, const struct config_common *cc,
+	   const struct sockaddr_storage *ss,
+	   packet_t *pkt, size_t len)
+{
+  relTable *t = getRelTable(l);
+  rel_t *r = relTableLookup(t, ss);
+
+  if (!r) {
+    // A new connection shows up as a valid data packet with the
+    // initial seqno, which may be compressed or on a stream, but is
+    // not a probe, parity or resume request
+    if (len < HEADER_SIZE || ntohs(pkt->len) != len
+        || (pkt->flags & (PKT_PROBE | PKT_PARITY | PKT_RESUME))
+        || ntohl(pkt->seqno) != cc->isn || !verifyChecksum(NULL, pkt, len)) {
+      return;
+    }
+    conn_t *c = conn_create(l, NULL, ss);
+    if (!c) {
+      return;
+    }
+    r = rel_create(c, NULL, cc);
+    c->rel = r;
+    relTableInsert(t, r);
+  }
+  rel_recvpkt(r, pkt, len);
+}
+
+void
+rel_stats (rel_t *r)
+{
+  printStats(r, "signal");
+}
+
+void
+rel_sample (rel_t *r, struct rel_sample *rs)
+{
+  int numPacketsInWindow = r->LAST_PACKET_SENT - r->LAST_PACKET_ACKED;
+  int i;
+
+  rs->cwnd = r->windowSize;
+  rs->inflight = numPacketsInWindow + r->numSegs;
+  for (i = 0; i < numPacketsInWindow; i++) {
+    rs->inflight_bytes += ntohs(r->sentPackets[i]->packet->len) - HEADER_SIZE;
+  }
+  for (i = 0; i < r->numSegs; i++) {
+    rs->inflight_bytes += r->segs[i].len;
+  }
+  rs->srtt = r->srtt;
+  rs->rttvar = r->rttvar;
+  rs->min_rtt = r->minRtt;
+  rs->delivered = r->stats.bytesAcked + r->stats.bytesDelivered;
+}
+
+void
+reverseWrappers (wrapper **list, int n) {
+  int i;
+  for (i = 0; i < n / 2; i++) {
+    wrapper *tmp = list[i];
+    list[i] = list[n - 1 - i];
+    list[n - 1 - i] = tmp;
+  }
+}
+
+// Move the first n of a window's size slots to its end, emptied.
+// Only the pointers move, so every slot keeps its packet buffer.
+void
+rotateWrappers (wrapper **list, int size, int n) {
+  reverseWrappers(list, n);
+  reverseWrappers(list + n, size - n);
+  reverseWrappers(list, size);
+
+  int i;
+  for (i = size - n; i < size; i++) {
+    list[i]->acked = 0;
+    list[i]->sentTime = 0;
+    list[i]->retransmitted = 0;
+    list[i]->delivered = 0;
+  }
+}
+
+// Drop the first n packets of the receive window, which have been
+// output, keeping any that arrived out of order in their slots
+void
+shiftRecvPacketList (rel_t *r, int n) {
+  rotateWrappers(r->recvPackets, r->ssThresh, n);
+}
+
+void
+shiftSentPacketList (rel_t *r, uint32_t ackno) {
+  rotateWrappers(r->sentPackets, r->ssThresh,
+                 SEQ_DIFF(ackno, r->LAST_PACKET_ACKED) - 1);
+}
+
+// One ack's worth of window growth
+void
+growWindow (rel_t *r) {
+  if (r->slowStart) {
+    // fprintf(stderr, "window size: %d\n", r->windowSize);
+    if (r->windowSize * 2 > r->ssThresh) {
+      // START AIMD
+      // return;
+    } else {
+      setWindowSize(r, r->windowSize * 2);
+    }
+    // fprintf(stderr, "success? %d\n", r->windowSize);
   }
   else {
-    r->windowSize = 1;
-  }
-
-  r->ssThresh = cc->window;
-
-  r->slowStart = 1;
+    if (r->windowSize + 1 == r->ssThresh) {
 
-  r->timeout = cc->timeout;
+    } else {
+      setWindowSize(r, r->windowSize + 1);
+    }
+  }
+}
 
-  r->sentListSize = 0;
-  r->recvListSize = 0;
+// Put bytes [seqno, seqno + len) of sndBuf on the wire; len 0 is our EOF
+void
+byteSendSegment (rel_t *r, uint32_t seqno, int len) {
+  packet_t *pkt = r->txBuf;
 
-  r->sentPackets = malloc(sizeof(wrapper *) * r->ssThresh);
-  r->recvPackets = malloc(sizeof(wrapper *) * r->ssThresh);
+  ringCopyOut(r->sndBuf, r->sndCap, seqno, pkt->data, len);
+  pkt->cksum = 0;
+  pkt->len = htons(HEADER_SIZE + len);
+  pkt->ackno = htonl(r->rcvNxt);
+  pkt->rwnd = 0;
+  pkt->flags = 0;
+  pkt->spare = 0;
+  pkt->seqno = htonl(seqno);
+  pkt->cksum = cksum(pkt, HEADER_SIZE + len);
+  conn_sendpkt(r->c, pkt, HEADER_SIZE + len);
+  r->stats.pktsSent++;
+  r->stats.bytesSent += len;
+}
 
-  int i;
-  for (i = 0; i < r->ssThresh; i++) {
-    r->sentPackets[i] = malloc(sizeof(wrapper));
-    r->sentPackets[i]->packet = malloc(sizeof(packet_t));
-    r->sentPackets[i]->acked = 0;
-    r->recvPackets[i] = malloc(sizeof(wrapper));
-    r->recvPackets[i]->packet = malloc(sizeof(packet_t));
-    r->recvPackets[i]->acked = 0;
+// Append n bytes (0 for EOF) to the stream as a new segment and send it
+void
+byteSendNew (rel_t *s, const char *payload, int n) {
+  segment *seg = &s->segs[s->numSegs++];
+  seg->seqno = s->sndNxt;
+  seg->len = n;
+  seg->sentTime = getCurrentTime(s);
+  seg->retransmitted = 0;
+
+  if (n == 0) {
+    s->eofSeq = s->sndNxt++;
+  }
+  else {
+    ringCopyIn(s->sndBuf, s->sndCap, s->sndNxt, payload, n);
+    s->sndNxt += n;
   }
+  byteSendSegment(s, seg->seqno, n);
 
-  r->LAST_PACKET_ACKED = 0;
-  r->LAST_PACKET_SENT = 0;
+  if (!s->timerArmed) {
+    conn_settimer(s->c, s->timeout + 1);
+    s->timerArmed = 1;
+  }
+}
 
-  r->NEXT_PACKET_EXPECTED = 1;
+// Resend segs[first..last) as few full-size segments as their bytes
+// make, replacing them in the list.  An EOF is only ever resent on its
+// own.  Returns the index just past the resent segments.
+int
+byteResend (rel_t *r, int first, int last, int why) {
+  uint64_t curTime = getCurrentTime(r);
+  uint32_t seqno = r->segs[first].seqno;
+  uint32_t end = r->segs[last - 1].seqno + r->segs[last - 1].len;
+  int n = first;
+
+  do {
+    int len = end - seqno > r->payloadSize ? r->payloadSize : end - seqno;
+    segment *seg = &r->segs[n++];
+    seg->seqno = seqno;
+    seg->len = len;
+    seg->sentTime = curTime;
+    seg->retransmitted = 1;
+    trace_event(TR_RETRANSMIT, r->c->id, HEADER_SIZE + len, seqno, why);
+    byteSendSegment(r, seqno, len);
+    if (why == TR_RTX_FAST) {
+      r->stats.rtxFast++;
+    }
+    else {
+      r->stats.rtxTimeout++;
+    }
+    seqno += len;
+  } while (seqno != end);
 
-  r->eofSent = 0;
-  r->eofRecv = 0;
+  memmove(&r->segs[n], &r->segs[last], (r->numSegs - last) * sizeof(segment));
+  r->numSegs -= last - n;
+  return n;
+}
 
-  // initialize w to 1?
-  r->w = 1;
+void
+byteRead (rel_t *s) {
+  if (s->c->sender_receiver == RECEIVER) {
+    // Same as packet mode: our EOF goes out on the first call
+    if (s->eofSent) {
+      if (s->numSegs == 0 && s->eofRecv) {
+        rel_destroy(s);
+      }
+      return;
+    }
+    s->eofSent = 1;
+    byteSendNew(s, NULL, 0);
+    return;
+  }
 
-  if(r->c->sender_receiver == RECEIVER) {
-    rel_read(r);
+  if (s->numSegs == 0 && s->eofSent && s->eofRecv) {
+    rel_destroy(s);
+    return;
+  }
+  if (s->numSegs >= s->windowSize || s->eofSent
+      || s->sndNxt - s->sndUna + s->payloadSize > s->sndCap) {
+    return;
   }
 
-  return r;
+  char payloadBuffer[MAX_PAYLOAD_SIZE];
+  int bytesReceived = takeInput(s, payloadBuffer, s->numSegs);
+  if (bytesReceived == 0) {
+    return;
+  }
+  if (bytesReceived == -1) {
+    s->eofSent = 1;
+    bytesReceived = 0;
+  }
+  byteSendNew(s, payloadBuffer, bytesReceived);
 }
 
 void
-rel_destroy (rel_t *r)
-{
-  // printf("rel_destroy\n");
-  uint32_t curTime = getCurrentTime();
-  fprintf(stderr, "RECEIVED TIME: %u SENT TIME: %u\n", curTime, r->startTime);
-  conn_destroy (r->c);
+byteRecvAck (rel_t *r, uint32_t ackno) {
+  if (!SEQ_LT(r->sndUna, ackno) || SEQ_LT(r->sndNxt, ackno)) {
+    r->stats.dupAcks++;
+    if (ackno != r->sndUna || r->numSegs == 0 || ++r->LAST_ACK_COUNT != 3) {
+      return;
+    }
+    // Triple duplicate: resend from the hole, merging the segments
+    // after it into the same packet while they fit
+    r->slowStart = 0;
+    setWindowSize(r, r->windowSize > 1 ? r->windowSize / 2 : 1);
+    int bytes = r->segs[0].len;
+    int j = 1;
+    while (bytes > 0 && j < r->numSegs && r->segs[j].len > 0
+           && bytes + r->segs[j].len <= r->payloadSize) {
+      bytes += r->segs[j++].len;
+    }
+    byteResend(r, 0, j, TR_RTX_FAST);
+    armTimer(r, getCurrentTime(r));
+    return;
+  }
+  r->LAST_ACK_COUNT = 0;
+  blackHoleCheck(r, 0, 0);
 
-  /* Free any other allocated memory here */
-  int i;
-  for (i = 0; i < r->ssThresh; i++) {
-    free(r->sentPackets[i]->packet);
-    free(r->sentPackets[i]);
-    free(r->recvPackets[i]->packet);
-    free(r->recvPackets[i]);
+  int eofAcked = r->eofSent && ackno == r->eofSeq + 1;
+  r->stats.bytesAcked += ackno - r->sndUna - eofAcked;
+
+  int k = 0;
+  while (k < r->numSegs
+         && !SEQ_LT(ackno, r->segs[k].seqno + (r->segs[k].len ? r->segs[k].len : 1))) {
+    k++;
   }
-  free(r->sentPackets);
-  free(r->recvPackets);
-  free(r);
-}
+  if (k > 0 && !r->segs[k - 1].retransmitted) {
+    sampleRtt(r, getCurrentTime(r) - r->segs[k - 1].sentTime);
+  }
+  memmove(r->segs, r->segs + k, (r->numSegs - k) * sizeof(segment));
+  r->numSegs -= k;
+  if (r->numSegs > 0 && SEQ_LT(r->segs[0].seqno, ackno)) {
+    // The peer got this part in a packet cut differently from ours
+    r->segs[0].len -= ackno - r->segs[0].seqno;
+    r->segs[0].seqno = ackno;
+  }
+  r->sndUna = ackno;
 
+  int i;
+  for (i = 0; i < k; i++) {
+    growWindow(r);
+  }
+  trace_event(TR_ACK, r->c->id, 0, ackno, r->windowSize);
 
-void
-rel_demux (const struct config_common *cc,
-	   const struct sockaddr_storage *ss,
-	   packet_t *pkt, size_t len)
-{
-  //leave it blank here!!!
+  if (r->numSegs == 0 && r->timerArmed) {
+    armTimer(r, getCurrentTime(r));
+  }
+  rel_read(r);
 }
 
+// Hand the bytes that are in order to conn_output and ack them, with
+// the same rules for holding back the ack as deliverPackets.  A
+// segment's worth of bytes (rcvMss) counts as one packet towards
+// ackEvery.
 void
-shiftRecvPacketList(rel_t *r) {
-  int i, shift;
-  // int numPacketsInWindow = r->LAST_PACKET_SENT - r->LAST_PACKET_ACKED;
-
-  // fprintf(stderr, "Shift recv numpackets: %d\n", numPacketsInWindow);
+byteDeliver (rel_t *r, int ackNow) {
+  uint32_t off = r->rcvNxt & (r->rcvCap - 1);
+  uint32_t avail;
+  char *hole = memchr(r->rcvHave + off, 0, r->rcvCap - off);
+  if (hole) {
+    avail = hole - (r->rcvHave + off);
+  }
+  else {
+    hole = memchr(r->rcvHave, 0, off);
+    avail = r->rcvCap - off + (hole ? (uint32_t) (hole - r->rcvHave) : off);
+  }
+  size_t space = conn_bufspace(r->c);
+  if (avail > space) {
+    avail = space;
+  }
 
-  for (shift = 0; shift < r->windowSize; shift++) {
-    if (r->recvPackets[shift]->acked != 0) {
-      break;
+  if (avail > 0) {
+    uint32_t first = avail < r->rcvCap - off ? avail : r->rcvCap - off;
+    conn_output(r->c, r->rcvBuf + off, first);
+    if (avail > first) {
+      conn_output(r->c, r->rcvBuf, avail - first);
     }
+    ringFill(r->rcvHave, r->rcvCap, r->rcvNxt, 0, avail);
+    r->rcvNxt += avail;
+    r->stats.bytesDelivered += avail;
   }
 
-  // fprintf(stderr, "shift recv shift offset: %d\n", shift);
-
-  for (i = 0; i < r->windowSize - shift; i++) {
+  int delivered = (avail + r->rcvMss - 1) / r->rcvMss;
+  if (r->peerEofSeen && !r->eofRecv && r->rcvNxt == r->peerEof) {
+    conn_output(r->c, r->rcvBuf, 0);
+    r->eofRecv = 1;
+    r->rcvNxt++;
+    delivered++;
+  }
+  r->acksOwed += delivered;
 
-    wrapper *prev_wrap = r->recvPackets[i];
-    if (prev_wrap->acked == 0) {
-      break;
-    }
-    wrapper *new_wrap = r->recvPackets[i+shift];
-    memcpy(prev_wrap->packet, new_wrap->packet, sizeof(packet_t));
-    prev_wrap->acked = 1;
+  if (ackNow || delivered != 1 || r->eofRecv || r->acksOwed >= r->ackLimit) {
+    sendAck(r, 0);
+  }
+  else if (!r->ackDue) {
+    uint64_t curTime = getCurrentTime(r);
+    r->ackDue = curTime + r->ackDelay;
+    armTimer(r, curTime);
   }
 
-  int j;
-  for (j = r->windowSize - shift; j < r->windowSize; j++) {
-    free(r->recvPackets[j]->packet);
-    free(r->recvPackets[j]);
-    r->recvPackets[j] = malloc(sizeof(wrapper));
-    r->recvPackets[j]->packet = malloc(sizeof(packet_t));
-    r->recvPackets[j]->acked = 0;
-    r->recvPackets[j]->sentTime = 0;
+  if (r->numSegs == 0 && r->eofRecv && r->eofSent) {
+    rel_destroy(r);
   }
 }
 
 void
-shiftSentPacketList (rel_t *r, int ackno) {
-  int shift = ackno - r->LAST_PACKET_ACKED - 1;
-  int numPacketsInWindow = r->LAST_PACKET_SENT - r->LAST_PACKET_ACKED;
+byteRecvData (rel_t *r, packet_t *pkt, uint32_t n) {
+  uint32_t seqno = ntohl(pkt->seqno);
 
-  int i;
-  for (i = 0; i < numPacketsInWindow - shift; i++) {
-    wrapper *prev_wrap = r->sentPackets[i];
-    wrapper *new_wrap = r->sentPackets[i+shift];
+  if (!SEQ_LT(r->rcvNxt, seqno + (n ? n : 1))) {
+    r->stats.dupData++;
+    sendAck(r, 0);
+    return;
+  }
+  if (!SEQ_LT(seqno, r->rcvNxt + r->rcvCap)) {
+    r->stats.outOfWindow++;
+    return;
+  }
 
-    if(new_wrap->acked == 0) {
-      prev_wrap->acked = 0;
-      break;
+  // Out of order: ack at once, so the sender sees the gap
+  int ackNow = SEQ_LT(r->rcvNxt, seqno);
+  if (n == 0) {
+    r->peerEof = seqno;
+    r->peerEofSeen = 1;
+  }
+  else {
+    if (n > r->rcvMss) {
+      r->rcvMss = n;
+    }
+    // Keep only the part that is new and inside the window
+    const char *data = pkt->data;
+    if (SEQ_LT(seqno, r->rcvNxt)) {
+      data += r->rcvNxt - seqno;
+      n -= r->rcvNxt - seqno;
+      seqno = r->rcvNxt;
     }
-    memcpy(prev_wrap->packet, new_wrap->packet, sizeof(packet_t));
-    prev_wrap->acked = new_wrap->acked;
-    prev_wrap->sentTime = new_wrap->sentTime;
+    if (SEQ_LT(r->rcvNxt + r->rcvCap, seqno + n)) {
+      n = r->rcvNxt + r->rcvCap - seqno;
+    }
+    ringCopyIn(r->rcvBuf, r->rcvCap, seqno, data, n);
+    ringFill(r->rcvHave, r->rcvCap, seqno, 1, n);
   }
+  byteDeliver(r, ackNow);
+}
 
-  // Clear values for shifted entries of at end of array
-  int j;
-  for (j = numPacketsInWindow - shift; j < numPacketsInWindow; j++) {
-    free(r->sentPackets[j]->packet);
-    free(r->sentPackets[j]);
-    r->sentPackets[j] = malloc(sizeof(wrapper));
-    r->sentPackets[j]->packet = malloc(sizeof(packet_t));
-    r->sentPackets[j]->acked = 0;
-    r->sentPackets[j]->sentTime = 0;
+// Resend every run of expired segments, coalesced.  Returns how many
+// packets went out.
+int
+byteTimer (rel_t *r, uint64_t curTime) {
+  uint64_t timeout = (uint64_t) r->timeout * 1000000;
+  uint64_t before = r->stats.rtxTimeout;
+  int i = 0;
+
+  while (i < r->numSegs) {
+    if (curTime - r->segs[i].sentTime <= timeout) {
+      i++;
+      continue;
+    }
+    int j = i + 1;
+    while (r->segs[i].len > 0 && j < r->numSegs && r->segs[j].len > 0
+           && curTime - r->segs[j].sentTime > timeout) {
+      j++;
+    }
+    i = byteResend(r, i, j, TR_RTX_TIMEOUT);
   }
-  return;
+  return r->stats.rtxTimeout - before;
 }
 
+void
+deliverPackets (rel_t *r, int ackNow);
+
 void
 rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
 {
@@ -319,19 +1753,100 @@ rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
   uint16_t len = ntohs(pkt->len);
   uint32_t ackno = ntohl(pkt->ackno);
 
-  int verified = verifyChecksum(r, pkt, n);
-  if (!verified || (len != n)) { // Drop packets with bad length
+  r->stats.pktsRecv++;
+  trace_event(TR_RECV, r->c->id, n,
+              n >= HEADER_SIZE ? ntohl(pkt->seqno) : 0, ntohl(pkt->ackno));
+
+  if (len != n) { // Drop packets with bad length
+    r->stats.badLength++;
+    return;
+  }
+  if (!verifyChecksum(r, pkt, n)) {
     // fprintf(stderr, "Packet w/ sequence number %d dropped\n", ntohl(pkt->seqno));
+    r->stats.badChecksum++;
+    return;
+  }
+
+  if (pkt->flags & PKT_PROBE) {
+    if (len == ACK_PACKET_SIZE) {
+      probeAcked(r, ackno);
+    }
+    else if (len >= HEADER_SIZE) {
+      sendProbeAck(r, ntohl(pkt->seqno));
+    }
+    return;
+  }
+
+  if (pkt->flags & PKT_RESUME) {
+    if (len == HEADER_SIZE + sizeof(struct resume_point)) {
+      resumeRecv(r, (struct resume_point *) pkt->data);
+    }
+    else {
+      r->stats.badLength++;
+    }
+    return;
+  }
+
+  if (r->resumeWait) {
+    if (r->c->sender_receiver == RECEIVER) {
+      if (len >= HEADER_SIZE) {
+        return;  // Can't tell where this goes yet; it will be resent
+      }
+    }
+    else {
+      resumeStart(r);  // A receiver without -R: start at 0
+    }
+  }
+
+  if (pkt->flags & PKT_PARITY) {
+    if (!r->byteSeq && len >= HEADER_SIZE
+        && fecRecvParity(r, pkt, len - HEADER_SIZE)) {
+      deliverPackets(r, 0);
+    }
+    return;
+  }
+
+  if (r->byteSeq) {
+    if (len == ACK_PACKET_SIZE) {
+      byteRecvAck(r, ackno);
+    }
+    else if (len >= HEADER_SIZE) {
+      byteRecvData(r, pkt, len - HEADER_SIZE);
+    }
+    else {
+      r->stats.badLength++;
+    }
     return;
   }
 
   if (len == ACK_PACKET_SIZE) { // Received packet is an ack packet
     // fprintf(stderr, "Received ack number: %d\n", ackno);
     // fprintf(stderr, "%s\n", "======================RECEIVED ACK  PACKET=========================");
-    if (ackno <= r->LAST_PACKET_ACKED + 1) { // Drop duplicate acks
+    if (SEQ_LEQ(ackno, r->LAST_PACKET_ACKED + 1)) { // Drop duplicate acks
       // fprintf(stderr, "Duplicate ack: %d received\n", ackno);
+      r->stats.dupAcks++;
+      if (ackno == r->LAST_PACKET_ACKED + 1
+          && r->LAST_PACKET_SENT != r->LAST_PACKET_ACKED) {
+        fecNoteHole(r, ackno);
+      }
+      return;
+    }
+    if (SEQ_LT(r->LAST_PACKET_SENT, ackno - 1)) { // Acks something never sent
+      r->stats.outOfWindow++;
       return;
     }
+    blackHoleCheck(r, 0, 0);
+
+    // Sample RTT off the newest packet this ack covers
+    int newlyAcked = SEQ_DIFF(ackno, r->LAST_PACKET_ACKED) - 1;
+    wrapper *newest = r->sentPackets[newlyAcked - 1];
+    if (!newest->retransmitted) {
+      sampleRtt(r, getCurrentTime(r) - newest->sentTime);
+    }
+    int k;
+    for (k = 0; k < newlyAcked; k++) {
+      r->stats.bytesAcked += payloadBytes(r->sentPackets[k]->packet);
+    }
 
     if (ackno == r->LAST_ACK_RECVD) {
       r->LAST_ACK_COUNT++;
@@ -341,27 +1856,21 @@ rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
       r->LAST_ACK_COUNT = 1;
     }
 
-    if (r->slowStart) {
-      // fprintf(stderr, "window size: %d\n", r->windowSize);
-      if (r->windowSize * 2 > r->ssThresh) {
-        // START AIMD
-        // return;
-      } else {
-        r->windowSize = r->windowSize * 2;
-      }
-      // fprintf(stderr, "success? %d\n", r->windowSize);
-    } 
-    else {
-      if (r->windowSize + 1 == r->ssThresh) {
-
-      } else {
-        r->windowSize = r->windowSize + 1;
-      }
+    // A delayed or stretch ack covers several packets; grow the
+    // window as if each had been acked on its own
+    for (k = 0; k < newlyAcked; k++) {
+      growWindow(r);
     }
 
     shiftSentPacketList(r, ackno);
 
     r->LAST_PACKET_ACKED = ackno - 1;
+    trace_event(TR_ACK, r->c->id, 0, ackno, r->windowSize);
+
+    if (r->LAST_PACKET_SENT == r->LAST_PACKET_ACKED && r->timerArmed) {
+      // Nothing left in flight; keep only a pending delayed ack
+      armTimer(r, getCurrentTime(r));
+    }
 
     rel_read(r);
   }
@@ -379,27 +1888,24 @@ rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
     //   return;
     // }
 
-    if (seqno < r->NEXT_PACKET_EXPECTED) { // duplicate packet
+    if (SEQ_LT(seqno, r->NEXT_PACKET_EXPECTED)) { // duplicate packet
       // fprintf(stderr, "Received duplicate packet w/ sequence number: %d\n", seqno);
-      struct ack_packet *ack = createAckPacket(r, r->NEXT_PACKET_EXPECTED);
-      conn_sendpkt(r->c, (packet_t *)ack, ACK_PACKET_SIZE);
-      free(ack);
+      r->stats.dupData++;
+      sendAck(r, 0);
       return;
     }
 
-    if (seqno - r->NEXT_PACKET_EXPECTED > r->windowSize) {  // Packet outside window
+    if (SEQ_DIFF(seqno, r->NEXT_PACKET_EXPECTED) >= r->windowSize) {  // Packet outside window
+      r->stats.outOfWindow++;
       return;
     }
 
     // fprintf(stderr, "Received sequence number: %d\n", seqno);
 
-    int slot = seqno - r->NEXT_PACKET_EXPECTED;
-    // fprintf(stderr, "RecvPacket slot number: %d\n", slot);
-    memcpy(r->recvPackets[slot]->packet, pkt, sizeof(packet_t));
-    r->recvPackets[slot]->sentTime = getCurrentTime();
-    r->recvPackets[slot]->acked = 1;
+    storeDataPacket(r, pkt, len);
 
-    rel_output(r);
+    // Out of order: ack at once, so the sender sees the gap
+    deliverPackets(r, seqno != r->NEXT_PACKET_EXPECTED);
 
     // if (seqno == r->NEXT_PACKET_EXPECTED) {
     //   struct ack_packet *ack = createAckPacket(r, r->NEXT_PACKET_EXPECTED + 1);
@@ -414,6 +1920,131 @@ rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
   }
 }
 
+// Send a new data packet of stream sid, or NO_STREAM, and keep it in
+// the window until acked
+void
+sendDataPacket (rel_t *s, int sid, char *payload, int bytesReceived,
+                int rawLen) {
+  // Build the packet in its window slot, where it stays until it's
+  // acked/in case it needs to be retransmitted
+  wrapper *w = s->sentPackets[s->LAST_PACKET_SENT - s->LAST_PACKET_ACKED];
+  int n = streamHeaderSize(s, sid) + bytesReceived;
+  wrapperFit(w, HEADER_SIZE + n);
+  createDataPacket(s, w->packet, sid, payload, bytesReceived, rawLen);
+  s->LAST_PACKET_SENT++;
+  // fprintf(stderr, "Sent sequence number: %d\n", ntohl(w->packet->seqno));
+  conn_sendpkt(s->c, w->packet, HEADER_SIZE + n);
+  s->stats.pktsSent++;
+  s->stats.bytesSent += n;
+  if (s->fecK) {
+    fecAdd(s, w->packet, n);
+  }
+
+  w->sentTime = getCurrentTime(s);
+  w->acked = 1;
+  w->retransmitted = 0;
+
+  if (!s->timerArmed) {
+    conn_settimer(s->c, s->timeout + 1);
+    s->timerArmed = 1;
+  }
+}
+
+// Send one packet from the n input bytes pendInput has ready for
+// stream sid: an lz block if compression is on and it saves at least
+// an eighth, raw bytes otherwise.  After a poor ratio the next
+// zBackoff packets go raw without trying, so incompressible input
+// costs little CPU.
+#define Z_MAX_BACKOFF 64
+
+void
+sendInput (rel_t *s, int sid, int n) {
+  relStream *st = &s->streams[sid];
+  char *in = st->pending + st->pendingOff;
+  int room = s->payloadSize - streamHeaderSize(s, sid);
+  if (s->compress && s->zSkip == 0) {
+    int used;
+    int zlen = lz_compress(in, n, s->zBuf, room, &used);
+    if (used > 0 && zlen < used - used / 8) {
+      s->zBackoff = 1;
+      s->stats.zIn += used;
+      s->stats.zOut += zlen;
+      sendDataPacket(s, sid, s->zBuf, zlen, used);
+      dropInput(s, sid, used);
+      return;
+    }
+    s->zSkip = s->zBackoff;
+    if (s->zBackoff < Z_MAX_BACKOFF) {
+      s->zBackoff *= 2;
+    }
+  }
+  else if (s->zSkip > 0) {
+    s->zSkip--;
+  }
+  // More is ready when reading ahead to compress, or if payloadSize
+  // just shrank
+  if (n > room) {
+    n = room;
+  }
+  sendDataPacket(s, sid, in, n, n);
+  dropInput(s, sid, n);
+}
+
+// The sending side of a connection with streams.  While the window
+// has room, each active stream with input ready sends a packet in
+// turn, so they share the window evenly and one that has nothing to
+// send holds up none of the others.  When a stream's input ends its
+// EOF goes out and the next stream takes its place; the connection's
+// EOF goes out once every stream's has.
+void
+streamRead (rel_t *s) {
+  int idle = 0;  // Streams in a row that had nothing ready
+  for (;;) {
+    int inFlight = s->LAST_PACKET_SENT - s->LAST_PACKET_ACKED;
+    if (inFlight >= s->windowSize) {
+      return;
+    }
+    if (s->numActive == 0) {
+      s->eofSent = 1;
+      sendDataPacket(s, NO_STREAM, NULL, 0, 0);
+      return;
+    }
+    if (idle >= s->numActive) {
+      if (s->fecHave) {
+        sendParity(s);  // Input ran dry; protect what went out so far
+      }
+      return;
+    }
+
+    if (s->streamTurn >= s->numActive) {
+      s->streamTurn = 0;
+    }
+    int sid = s->active[s->streamTurn];
+    int n = pendInput(s, sid, inFlight);
+    if (n >= 0) {
+      if (n > 0) {
+        sendInput(s, sid, n);
+      }
+      idle = n > 0 ? 0 : idle + 1;
+      s->streamTurn++;
+      continue;
+    }
+
+    relStream *st = &s->streams[sid];
+    st->eof = 1;
+    sendDataPacket(s, sid, NULL, 0, 0);
+    free(st->pending);
+    st->pending = NULL;
+    if (s->nextStream < s->numStreams) {
+      s->active[s->streamTurn++] = s->nextStream++;
+    }
+    else {
+      s->active[s->streamTurn] = s->active[--s->numActive];
+    }
+    idle = 0;
+  }
+}
+
 /*
 If the reliable program is running in the receiver mode 
 (see c.sender_receiver in rlib.c, you can get its value in 
@@ -430,6 +2061,13 @@ void
 rel_read (rel_t *s)
 {
   // printf("rel_read\n");
+  if (s->resumeWait) {
+    return;  // Not before resumeRecv settles where the input starts
+  }
+  if (s->byteSeq) {
+    byteRead(s);
+    return;
+  }
   if(s->c->sender_receiver == RECEIVER)
   {
     // if already sent eof to the sender/not first call
@@ -438,6 +2076,10 @@ rel_read (rel_t *s)
     if(s->eofSent == 1) {
       // fprintf(stderr, "%s\n", "EOF already sent in rel_read");
       // s->eofSent = 0;
+      // Called again once our EOF is acked
+      if (s->LAST_PACKET_SENT == s->LAST_PACKET_ACKED && s->eofRecv == 1) {
+        rel_destroy(s);
+      }
       return;
     }
     else {
@@ -445,15 +2087,11 @@ rel_read (rel_t *s)
       // set eofSent to 1
       s->eofSent = 1;
 
-      // send eof
+      // send eof, retransmitted from the window like any data packet
 
       char payloadBuffer[MAX_PAYLOAD_SIZE];
 
-      int bytesReceived = 0;
-
-      packet_t *packet = createDataPacket(s, payloadBuffer, bytesReceived);
-      conn_sendpkt(s->c, packet, HEADER_SIZE + bytesReceived);
-      free(packet);
+      sendDataPacket(s, NO_STREAM, payloadBuffer, 0, 0);
       // printf("Sending EOF to sender in rel_read\n");
     }
 
@@ -480,19 +2118,24 @@ rel_read (rel_t *s)
       return;
     }
 
-    // can send packet
-    char payloadBuffer[MAX_PAYLOAD_SIZE];
-
-    memset(payloadBuffer, 0, MAX_PAYLOAD_SIZE);
+    if (s->streamed) {
+      streamRead(s);
+      return;
+    }
 
-    int bytesReceived = conn_input(s->c, payloadBuffer, MAX_PAYLOAD_SIZE);
+    // can send packet
+    int bytesReceived = pendInput(s, 0, numPacketsInWindow);
     // fprintf(stderr, "Bytes received: %d\n", bytesReceived );
     if (bytesReceived == 0) {
+      if (s->fecHave) {
+        sendParity(s);  // Input ran dry; protect what went out so far
+      }
       return; // no data is available at the moment, just return
     }
     else if (bytesReceived == -1) { // eof or error
       s->eofSent = 1;
-      bytesReceived = 0;
+      sendDataPacket(s, NO_STREAM, NULL, 0, 0);
+      return;
 
       // Why do we need to create and send a packet here?
 
@@ -503,40 +2146,94 @@ rel_read (rel_t *s)
       // return;
     }
 
-    // TODO: Need to handle overflow bytes here as well
-
-    packet_t *packet = createDataPacket(s, payloadBuffer, bytesReceived);
-    s->LAST_PACKET_SENT++;
-    // fprintf(stderr, "Sent sequence number: %d\n", ntohl(packet->seqno));
-
-    // fprintf(stderr, "PACKET INFO: %s\n", packet->data);
-
-    // fprintf(stderr, "PACKET INFO: %s\n", strdup(payloadBuffer));
-    // fprintf(stderr, "String Compare Value: %d\n", strcmp(packet->data, ""));
-    conn_sendpkt(s->c, packet, HEADER_SIZE + bytesReceived);
-
-    // Save packet until it's acked/in case it needs to be retransmitted
-    int slot = s->LAST_PACKET_SENT - s->LAST_PACKET_ACKED - 1;
-    // fprintf(stderr, "Slot: %d\n", slot);
-    memcpy(s->sentPackets[slot]->packet, packet, HEADER_SIZE + bytesReceived);
-    s->sentPackets[slot]->sentTime = getCurrentTime();
-    s->sentPackets[slot]->acked = 1;
+    sendInput(s, 0, bytesReceived);
+    if (s->streams[0].pendingLen > 0) {
+      // Input read ahead to compress may already hold the next packets,
+      // and no input event comes for those
+      rel_read(s);
+    }
 
     // fprintf(stderr, "%s\n", "====================SENDING PACKET================");
-    // fprintf(stderr, "Packet data: %s\n", packet->data);
+  }
+}
 
-    free(packet);
+// With streams, hand each stream the packets that are next in it,
+// wherever they are in the receive window, marking them delivered.
+// A stream's packets are in the window in the order they were sent
+// in, so one pass finds all there are, unless a stream had no room
+// for its output until a later packet of another stream was out (a
+// directory transfer's manifest naming its file); then that pass
+// returns 1 to have the window gone over again.  *done is how many
+// slots at the front of the window are done with, which is how far
+// the ack moves on.
+int
+deliverStreamsPass (rel_t *r, int *done) {
+  int blocked = 0, progress = 0;
+  int i;
+  *done = 0;
+  for (i = 0; i < r->windowSize; i++) {
+    wrapper *w = r->recvPackets[i];
+    if (!w->acked || w->delivered) {
+      if (w->delivered && i == *done) {
+        (*done)++;
+      }
+      continue;
+    }
+    packet_t *pkt = w->packet;
+    int len = ntohs(pkt->len) - HEADER_SIZE;
+    if (!(pkt->flags & PKT_STREAM)) {
+      // The connection's EOF, after all of every stream
+      if (i != *done) {
+        break;
+      }
+      r->eofRecv = 1;
+    }
+    else {
+      struct stream_header sh;
+      memcpy(&sh, pkt->data, sizeof(sh));
+      int sid = ntohs(sh.sid);
+      relStream *st = &r->streams[sid];
+      len -= STREAM_HEADER_SIZE;
+      if (ntohl(sh.seqno) != st->seqno || st->eof) {
+        continue;
+      }
+      if (conn_stream_bufspace(r->c, sid) < (size_t) len) {
+        blocked = 1;
+        continue;
+      }
+      conn_stream_output(r->c, sid, pkt->data + STREAM_HEADER_SIZE, len);
+      r->stats.bytesDelivered += len;
+      st->seqno++;
+      st->eof = len == 0;
+      progress = 1;
+    }
+    w->delivered = 1;
+    if (i == *done) {
+      (*done)++;
+    }
   }
+  return blocked && progress;
+}
+
+int
+deliverStreams (rel_t *r) {
+  int done;
+  while (deliverStreamsPass(r, &done))
+    ;
+  return done;
 }
 
+// Hand in-order packets to conn_output and ack them.  Unless ackNow
+// is set the ack may be held back: it goes out once ackEvery packets
+// are owed or after ackDelay, but right away when a packet fills a
+// hole, nothing could be delivered, or EOF arrives.
 void
-rel_output (rel_t *r)
+deliverPackets (rel_t *r, int ackNow)
 {
-  // printf("rel_output\n");
   int numPacketsInWindow = r->LAST_PACKET_SENT - r->LAST_PACKET_ACKED;
   int i;
   // fprintf(stderr, "lastpacksent: %d, lackPackacked: %d\n", r->LAST_PACKET_SENT, r->LAST_PACKET_ACKED);
-  for (i = 0; i < r->windowSize; i++) {
+  for (i = 0; i < r->windowSize && !r->streamed; i++) {
     // fprintf(stderr, "Recvpacket of %d has ack %d\n", i, r->recvPackets[i]->acked);
     if(r->recvPackets[i]->acked == 0) {
       break;
@@ -553,6 +2250,7 @@ rel_output (rel_t *r)
       }
       // fprintf(stderr, "Outputting packet %d from recvPackets \n", i);
       conn_output(r->c, pkt->data, packet_len - HEADER_SIZE);
+      r->stats.bytesDelivered += packet_len - HEADER_SIZE;
       r->recvPackets[i]->acked = 0;
     } 
     else {
@@ -560,59 +2258,128 @@ rel_output (rel_t *r)
     }
   }
 
+  if (r->streamed) {
+    i = deliverStreams(r);
+  }
+
   // fprintf(stderr, "value of i: %d\n", i);
   // fprintf(stderr, "Next Packet Expected Before: %d\n", r->NEXT_PACKET_EXPECTED );
 
   r->NEXT_PACKET_EXPECTED += i;
-  struct ack_packet *ack = createAckPacket(r, r->NEXT_PACKET_EXPECTED);
+  r->acksOwed += i;
 
   // fprintf(stderr, "Next Packet Expected: %d\n", r->NEXT_PACKET_EXPECTED);
 
-  conn_sendpkt(r->c, (packet_t *)ack, ACK_PACKET_SIZE);
-  free(ack);
+  if (ackNow || i != 1 || r->eofRecv || r->acksOwed >= r->ackLimit) {
+    sendAck(r, 0);
+  }
+  else if (!r->ackDue) {
+    uint64_t curTime = getCurrentTime(r);
+    r->ackDue = curTime + r->ackDelay;
+    armTimer(r, curTime);
+  }
 
   // fprintf(stderr, "reloutput -- numPackets: %d, eofRecv: %d, eofSend: %d\n", numPacketsInWindow, r->eofRecv, r->eofSent);
   if(numPacketsInWindow == 0 && r->eofRecv == 1 && r->eofSent == 1) {
     rel_destroy(r);
     return;
   }
-  shiftRecvPacketList(r);
+  shiftRecvPacketList(r, i);
+}
+
+void
+rel_output (rel_t *r)
+{
+  // printf("rel_output\n");
+  // Output drained: ack now, the sender may be stalled on our window
+  if (r->byteSeq) {
+    byteDeliver(r, 1);
+  }
+  else {
+    deliverPackets(r, 1);
+  }
 }
 
 void
-rel_timer ()
+rel_timer (rel_t *r)
 {
   /* Retransmit any packets that need to be retransmitted */
   // check timeout
   // check acks...3 of same? congestion control
 
   /* Retransmit any packets that need to be retransmitted */
-  rel_t *r = rel_list;
-  uint32_t curTime = getCurrentTime();
+  uint64_t curTime = getCurrentTime(r);
+  uint64_t timeout = (uint64_t) r->timeout * 1000000;
+
+  r->timerArmed = 0;
+
+  if (r->ackDue && curTime >= r->ackDue) {
+    sendAck(r, 1);
+  }
+
+  if (r->flushDue && curTime >= r->flushDue) {
+    // Pending input waited long enough; it goes out as soon as the
+    // window allows
+    r->flushDue = 0;
+    r->flushNow = 1;
+    rel_read(r);
+  }
+
+  probeTimer(r, curTime);
+
+  if (r->resumeDue && curTime >= r->resumeDue) {
+    resumeTimer(r, curTime);
+  }
+
+  if (r->byteSeq) {
+    blackHoleCheck(r, byteTimer(r, curTime), curTime);
+    armTimer(r, curTime);
+    return;
+  }
 
   if (r->LAST_ACK_COUNT >= 3) {
     r->slowStart = 0;
-    r->windowSize /= 2;
+    setWindowSize(r, r->windowSize / 2);
     int j;
     for (j = 0; j < r->LAST_PACKET_SENT - r->LAST_PACKET_ACKED; j++) {
       wrapper *curPacketNode = r->sentPackets[j];
       if (ntohl(curPacketNode->packet->seqno) ==  r->LAST_ACK_RECVD) {
         curPacketNode->sentTime = curTime;
+        curPacketNode->retransmitted = 1;
+        trace_event(TR_RETRANSMIT, r->c->id, ntohs(curPacketNode->packet->len),
+                    r->LAST_ACK_RECVD, TR_RTX_FAST);
         conn_sendpkt(r->c, curPacketNode->packet, ntohs(curPacketNode->packet->len));
+        r->stats.rtxFast++;
+        r->stats.pktsSent++;
+        r->stats.bytesSent += ntohs(curPacketNode->packet->len) - HEADER_SIZE;
+        armTimer(r, curTime);
         return;
       }
     }
   }
   
   int numPacketsInWindow = r->LAST_PACKET_SENT - r->LAST_PACKET_ACKED;
+  int resent = 0;
   int i;
   for (i = 0; i < numPacketsInWindow; i++) {
     wrapper *curPacketNode = r->sentPackets[i];
-    // uint32_t timediff = curTime - curPacketNode->sentTime;
-    if (curTime - curPacketNode->sentTime > r->timeout) {
+    // uint64_t timediff = curTime - curPacketNode->sentTime;
+    if (curTime - curPacketNode->sentTime > timeout) {
       // fprintf(stderr, "Retransmitted packet w/ sequence number: %d\n", ntohl(curPacketNode->packet->seqno));
       // retransmit package
+      curPacketNode->sentTime = curTime;
+      curPacketNode->retransmitted = 1;
+      trace_event(TR_RETRANSMIT, r->c->id, ntohs(curPacketNode->packet->len),
+                  ntohl(curPacketNode->packet->seqno), TR_RTX_TIMEOUT);
+      fecNoteHole(r, ntohl(curPacketNode->packet->seqno));
       conn_sendpkt(r->c, curPacketNode->packet, ntohs(curPacketNode->packet->len));
+      r->stats.rtxTimeout++;
+      r->stats.pktsSent++;
+      r->stats.bytesSent += ntohs(curPacketNode->packet->len) - HEADER_SIZE;
+      resent++;
     }
   }
+  blackHoleCheck(r, resent, curTime);
+
+  armTimer(r, curTime);
 }
@@ -0,0 +1,204 @@
+-- Wireshark dissector for captures written by reliable -P (see pcap.h).
+--
+-- Install by copying into your Wireshark personal plugins directory,
+-- or run:  wireshark -X lua_script:reliable.lua capture.pcap
+--
+-- Each frame is a pcap_pseudo header followed by a packet_t or
+-- ack_packet from rlib.h.  Acks are 12 bytes, data packets 16 bytes
+-- plus payload; a data packet with no payload is EOF.  The flags
+-- byte marks the other kinds, see the PKT_* definitions in rlib.h.
+
+local p = Proto("reliable", "Reliable Transport")
+
+local dirs = { [0] = "sent", [1] = "received" }
+
+local f = p.fields
+f.dir   = ProtoField.uint8("reliable.dir", "Direction", base.DEC, dirs)
+f.port  = ProtoField.uint16("reliable.port", "Peer port")
+f.conn  = ProtoField.uint32("reliable.conn", "Connection")
+f.cksum = ProtoField.uint16("reliable.cksum", "Checksum", base.HEX)
+f.len   = ProtoField.uint16("reliable.len", "Length")
+f.ackno = ProtoField.uint32("reliable.ackno", "Ack number")
+f.rwnd  = ProtoField.uint16("reliable.rwnd", "Receive window")
+f.flags = ProtoField.uint8("reliable.flags", "Flags", base.HEX)
+f.probe = ProtoField.bool("reliable.flags.probe", "Probe", 8, nil, 0x01)
+f.parity = ProtoField.bool("reliable.flags.parity", "Parity", 8, nil, 0x02)
+f.compressed = ProtoField.bool("reliable.flags.compressed", "Compressed", 8,
+                               nil, 0x04)
+f.stream = ProtoField.bool("reliable.flags.stream", "Stream", 8, nil, 0x08)
+f.resume = ProtoField.bool("reliable.flags.resume", "Resume", 8, nil, 0x10)
+f.spare = ProtoField.uint8("reliable.spare", "Spare")
+f.seqno = ProtoField.uint32("reliable.seqno", "Sequence number")
+f.data  = ProtoField.bytes("reliable.data", "Payload")
+f.rawlen = ProtoField.uint16("reliable.raw_len", "Uncompressed length")
+f.lz    = ProtoField.bytes("reliable.lz", "Compressed payload (lz.h)")
+
+-- struct stream_header, see PKT_STREAM
+f.stream_hdr   = ProtoField.bytes("reliable.stream", "Stream header")
+f.stream_id    = ProtoField.uint16("reliable.stream.id", "Stream")
+f.stream_spare = ProtoField.uint16("reliable.stream.spare", "Spare")
+f.stream_seqno = ProtoField.uint32("reliable.stream.seqno",
+                                   "Packets of the stream before this one")
+
+-- struct resume_point, see PKT_RESUME
+f.resume_pt     = ProtoField.bytes("reliable.resume", "Resume point")
+f.resume_offset = ProtoField.uint64("reliable.resume.offset", "Offset")
+f.resume_hash   = ProtoField.uint64("reliable.resume.hash",
+                                    "FNV-1a hash of the bytes before it",
+                                    base.HEX)
+
+-- Forward error correction, see PKT_PARITY
+f.fec_index = ProtoField.uint8("reliable.fec.index", "Index in FEC group")
+f.fec_k     = ProtoField.uint8("reliable.fec.k", "FEC group size")
+f.fec_first = ProtoField.uint32("reliable.fec.first", "First seqno of group")
+f.fec_hdr   = ProtoField.uint32("reliable.fec.hdr_xor",
+                                "XOR of flags << 16 | rwnd", base.HEX)
+f.fec_len   = ProtoField.uint16("reliable.fec.len_xor",
+                                "XOR of payload lengths", base.HEX)
+f.fec_data  = ProtoField.bytes("reliable.fec.data", "XOR of payloads")
+f.pad   = ProtoField.bytes("reliable.padding", "Padding")
+f.eof   = ProtoField.bool("reliable.eof", "EOF")
+
+local PSEUDO = 8
+local ACK_SIZE = 12
+local HEADER_SIZE = 16
+
+local PKT_PROBE = 0x01
+local PKT_PARITY = 0x02
+local PKT_COMPRESSED = 0x04
+local PKT_STREAM = 0x08
+local STREAM_HEADER = 8
+local PKT_RESUME = 0x10
+local RESUME_POINT = 16
+
+-- No bit operators before Lua 5.3
+local function has(flags, bit)
+  return math.floor(flags / bit) % 2 == 1
+end
+
+function p.dissector(buf, pinfo, root)
+  if buf:len() < PSEUDO + ACK_SIZE then return 0 end
+  pinfo.cols.protocol = "RELIABLE"
+
+  local t = root:add(p, buf())
+  local dir = buf(0, 1):uint()
+  t:add(f.dir, buf(0, 1))
+  t:add(f.port, buf(2, 2))
+  t:add(f.conn, buf(4, 4))
+
+  local pkt = buf(PSEUDO)
+  local len = pkt(2, 2):uint()
+  t:add(f.cksum, pkt(0, 2))
+  local lt = t:add(f.len, pkt(2, 2))
+  if len ~= pkt:len() then
+    lt:add_expert_info(PI_MALFORMED, PI_WARN,
+                       "length field disagrees with datagram size")
+  end
+  local flags = pkt(10, 1):uint()
+  local parity = has(flags, PKT_PARITY) and pkt:len() >= HEADER_SIZE
+  local compressed = has(flags, PKT_COMPRESSED) and not parity
+                     and pkt:len() > HEADER_SIZE
+  local spare = pkt(11, 1):uint()
+  if parity then
+    t:add(f.fec_hdr, pkt(4, 4))
+    t:add(f.fec_len, pkt(8, 2))
+  elseif compressed then
+    t:add(f.ackno, pkt(4, 4))
+    t:add(f.rawlen, pkt(8, 2))
+  else
+    t:add(f.ackno, pkt(4, 4))
+    t:add(f.rwnd, pkt(8, 2))
+  end
+  local ft = t:add(f.flags, pkt(10, 1))
+  ft:add(f.probe, pkt(10, 1))
+  ft:add(f.parity, pkt(10, 1))
+  ft:add(f.compressed, pkt(10, 1))
+  ft:add(f.stream, pkt(10, 1))
+  ft:add(f.resume, pkt(10, 1))
+  if parity then
+    t:add(f.fec_k, pkt(11, 1))
+  elseif spare > 0 and pkt:len() >= HEADER_SIZE then
+    t:add(f.fec_index, pkt(11, 1))
+  else
+    t:add(f.spare, pkt(11, 1))
+  end
+
+  local arrow = dir == 0 and "->" or "<-"
+  local port = buf(2, 2):uint()
+  if pkt:len() < HEADER_SIZE then
+    pinfo.cols.info = string.format("%s %d  %s ackno=%d", arrow, port,
+                                    has(flags, PKT_PROBE) and "PROBE-ACK"
+                                    or "ACK", pkt(4, 4):uint())
+    return buf:len()
+  end
+
+  local seqno = pkt(12, 4):uint()
+  if parity then
+    t:add(f.fec_first, pkt(12, 4))
+    if pkt:len() > HEADER_SIZE then
+      t:add(f.fec_data, pkt(HEADER_SIZE))
+    end
+    pinfo.cols.info = string.format("%s %d  PARITY seqno=%d-%d", arrow, port,
+                                    seqno, (seqno + spare - 1) % 4294967296)
+    return buf:len()
+  end
+
+  if has(flags, PKT_RESUME) then
+    -- Uses up no seqno
+    if pkt:len() >= HEADER_SIZE + RESUME_POINT then
+      local rt = t:add(f.resume_pt, pkt(HEADER_SIZE, RESUME_POINT))
+      rt:add(f.resume_offset, pkt(HEADER_SIZE, 8))
+      rt:add(f.resume_hash, pkt(HEADER_SIZE + 8, 8))
+      pinfo.cols.info = string.format("%s %d  RESUME offset=%s hash=%s",
+                                      arrow, port,
+                                      tostring(pkt(HEADER_SIZE, 8):uint64()),
+                                      pkt(HEADER_SIZE + 8, 8):uint64():tohex())
+    else
+      pinfo.cols.info = string.format("%s %d  RESUME", arrow, port)
+    end
+    return buf:len()
+  end
+
+  t:add(f.seqno, pkt(12, 4))
+  if has(flags, PKT_PROBE) then
+    -- Probe seqnos are a space of their own
+    if pkt:len() > HEADER_SIZE then
+      t:add(f.pad, pkt(HEADER_SIZE))
+    end
+    pinfo.cols.info = string.format("%s %d  PROBE seqno=%d size=%d", arrow,
+                                    port, seqno, pkt:len())
+    return buf:len()
+  end
+
+  -- A stream's own data follows its stream_header
+  local off, sinfo = HEADER_SIZE, ""
+  if has(flags, PKT_STREAM) and pkt:len() >= HEADER_SIZE + STREAM_HEADER then
+    local st = t:add(f.stream_hdr, pkt(HEADER_SIZE, STREAM_HEADER))
+    st:add(f.stream_id, pkt(HEADER_SIZE, 2))
+    st:add(f.stream_spare, pkt(HEADER_SIZE + 2, 2))
+    st:add(f.stream_seqno, pkt(HEADER_SIZE + 4, 4))
+    off = HEADER_SIZE + STREAM_HEADER
+    sinfo = string.format(" stream=%d:%d", pkt(HEADER_SIZE, 2):uint(),
+                          pkt(HEADER_SIZE + 4, 4):uint())
+  end
+
+  if compressed and pkt:len() > off then
+    t:add(f.lz, pkt(off))
+    pinfo.cols.info = string.format("%s %d  DATA seqno=%d%s ackno=%d len=%d"
+                                    .. " lz=%d", arrow, port, seqno, sinfo,
+                                    pkt(4, 4):uint(), pkt(8, 2):uint(),
+                                    pkt:len() - off)
+  elseif pkt:len() > off then
+    t:add(f.data, pkt(off))
+    pinfo.cols.info = string.format("%s %d  DATA seqno=%d%s ackno=%d len=%d",
+                                    arrow, port, seqno, sinfo,
+                                    pkt(4, 4):uint(), pkt:len() - off)
+  else
+    t:add(f.eof, true)
+    pinfo.cols.info = string.format("%s %d  EOF seqno=%d%s", arrow, port,
+                                    seqno, sinfo)
+  end
+  return buf:len()
+end
+
+DissectorTable.get("wtap_encap"):add(wtap.USER0, p)
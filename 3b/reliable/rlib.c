@@ -17,18 +17,29 @@
 #include <poll.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #include "rlib.h"
+#include "trace.h"
+#include "pcap.h"
+#include "dirxfer.h"
 
 char *progname;
 int opt_debug;
 int log_in = -1;
 int log_out = -1;
 
-/*******add by xin*******/
-int infile = 0;
-int outfile = 0;
-/************************/
+/* Bumped by SIGUSR1; each loop dumps stats when it sees a new value. */
+static volatile sig_atomic_t stats_generation;
+
+/* Source of conn_t ids, shared by all loops */
+static uint32_t conn_ids;
+
+/* Time-series sampler, off while sample_interval is 0 */
+static uint64_t sample_interval; /* Nanoseconds */
+static FILE *sample_fp;
+static int sample_csv;		/* CSV rather than JSON lines */
+static uint64_t sample_t0;	/* Clock at startup, for relative times */
 
 struct config_client {
   struct config_common c;
@@ -42,23 +53,16 @@ struct config_server {
   struct sockaddr_storage dest;	/* Demultiplex traffic and relay it to
 				   individual TCP connections to this
 				   address */
+  char *outdir;			/* If non-NULL, receive each connection
+				   into its own file in this directory
+				   instead of relaying to dest */
 };
 
-static struct config_server *serverconf;
-
-static void conn_mkevents (void);
+static void conn_mkevents (loop_t *l);
+static void timer_unlink (conn_t *c);
 static int debug_recv (int s, packet_t *buf, size_t len, int flags,
-		       struct sockaddr_storage *from);
-
-int cevents_generation;
-static struct pollfd *cevents;
-static int ncevents;
-static conn_t **evreaders;
-static conn_t **evwriters;
-
-
-static conn_t *conn_list;
-struct timespec last_timeout;
+		       struct sockaddr_storage *from, conn_t *c);
+static uint16_t addrport (const struct sockaddr_storage *ss);
 
 #if !DMALLOC
 void *
@@ -95,6 +99,28 @@ clock_gettime (int id, struct timespec *tp)
 }
 #endif /* NEED_CLOCK_GETTIME */
 
+loop_t *
+loop_create (void)
+{
+  loop_t *l = xmalloc (sizeof (*l));
+  memset (l, 0, sizeof (*l));
+  l->infile = -1;
+  l->outfile = -1;
+  return l;
+}
+
+void
+loop_destroy (loop_t *l)
+{
+  assert (!l->conn_list);
+  free (l->rxbuf);
+  free (l->cevents);
+  free (l->evreaders);
+  free (l->evwriters);
+  free (l->resume_file);
+  free (l);
+}
+
 void
 print_pkt (const packet_t *buf, const char *op, int n)
 {
@@ -107,13 +133,16 @@ print_pkt (const packet_t *buf, const char *op, int n)
       fprintf (stderr, "%5d %s(%3d): %s\n", pid, op, n, strerror (errno));
   }
   else if (n == 12)
-    fprintf (stderr, "%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x, rwnd = %d\n",
-	     pid, op, n, buf->cksum, ntohs (buf->len), ntohl (buf->ackno), ntohl(buf->rwnd));
+    fprintf (stderr, "%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x, rwnd = %d,"
+	     " flags = %02x\n",
+	     pid, op, n, buf->cksum, ntohs (buf->len), ntohl (buf->ackno),
+	     ntohs (buf->rwnd), buf->flags);
   else if (n >= 16)
     fprintf (stderr,
-	     "%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x, seq = %08x, rwnd = %d\n",
+	     "%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x, seq = %08x, rwnd = %d,"
+	     " flags = %02x\n",
 	     pid, op, n, buf->cksum, ntohs (buf->len), ntohl (buf->ackno),
-	     ntohl (buf->seqno), ntohl(buf->rwnd));
+	     ntohl (buf->seqno), ntohs (buf->rwnd), buf->flags);
   else
     fprintf (stderr, "%5d %s(%3d):\n", pid, op, n);
   errno = saved_errno;
@@ -129,6 +158,12 @@ conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
 		(const struct sockaddr *) &c->peer, addrsize (&c->peer));
   else
     n = send (c->nfd, pkt, len, 0);
+  c->loop->counters.sends++;
+  trace_event (TR_SEND, c->id, len,
+	       len >= offsetof (packet_t, data) ? ntohl (pkt->seqno) : 0,
+	       ntohl (pkt->ackno));
+  if (pcap_fd >= 0 && n >= 0)
+    pcap_record (PCAP_SENT, c->id, addrport (&c->peer), pkt, len);
   if (opt_debug)
     print_pkt (pkt, "send", n);
   return n;
@@ -139,7 +174,7 @@ conn_bufspace (conn_t *c)
 {
   chunk_t *ch;
   size_t used = 0;
-  const size_t bufsize = 8192;
+  const size_t bufsize = 2 * MAX_DATAGRAM; /* Room for the largest packets */
 
 
   for (ch = c->outq; ch; ch = ch->next)
@@ -147,6 +182,129 @@ conn_bufspace (conn_t *c)
   return used > bufsize ? 0 : bufsize - used;
 }
 
+/* 64-bit FNV-1a, continuing from hash h */
+static uint64_t
+fnv1a (uint64_t h, const void *_buf, size_t n)
+{
+  const unsigned char *buf = _buf;
+
+  while (n-- > 0)
+    h = (h ^ *buf++) * 0x100000001b3ULL;
+  return h;
+}
+
+/* Make what wfd has taken so far durable and say so in the sidecar,
+ * written aside and renamed into place so a crash leaves the old one
+ * or the new one. */
+static void
+resume_checkpoint (conn_t *c)
+{
+  const char *path = c->loop->resume_file;
+  char *tmp = xmalloc (strlen (path) + 2);
+  FILE *f;
+
+  c->checkpoint = c->written;
+  sprintf (tmp, "%s~", path);
+  if (fdatasync (c->wfd) < 0)
+    perror ("fdatasync");
+  else if (!(f = fopen (tmp, "w")))
+    perror (tmp);
+  else {
+    fprintf (f, "%llu %016llx\n", (unsigned long long) c->written,
+	     (unsigned long long) c->written_hash);
+    if (fflush (f) || fsync (fileno (f)) < 0 || fclose (f)
+	|| rename (tmp, path) < 0)
+      perror (path);
+  }
+  free (tmp);
+}
+
+/* wfd took n more bytes, from buf */
+static void
+conn_wrote (conn_t *c, const void *buf, size_t n)
+{
+  if (!c->resume)
+    return;
+  c->written += n;
+  c->written_hash = fnv1a (c->written_hash, buf, n);
+  if (c->written - c->checkpoint >= RESUME_INTERVAL)
+    resume_checkpoint (c);
+}
+
+/* The output is complete, so there is nothing left to resume */
+static void
+resume_done (conn_t *c)
+{
+  if (c->resume && unlink (c->loop->resume_file) < 0 && errno != ENOENT)
+    perror (c->loop->resume_file);
+  c->resume = 0;
+}
+
+/* Pick the output up at its last checkpoint */
+static void
+resume_load (conn_t *c)
+{
+  unsigned long long off = 0, hash = FNV_BASIS;
+  struct stat sb;
+  FILE *f;
+
+  if ((f = fopen (c->loop->resume_file, "r"))) {
+    if (fscanf (f, "%llu %llx", &off, &hash) != 2)
+      off = 0;
+    fclose (f);
+  }
+  if (off > 0 && (fstat (c->wfd, &sb) < 0 || sb.st_size < off)) {
+    fprintf (stderr, "%s: shorter than its checkpoint, starting over\n",
+	     c->loop->resume_file);
+    off = 0;
+  }
+  if (off == 0)
+    hash = FNV_BASIS;
+  if (ftruncate (c->wfd, off) < 0 || lseek (c->wfd, off, SEEK_SET) < 0)
+    perror ("resume_load");
+  c->resume = 1;
+  c->written = c->checkpoint = off;
+  c->written_hash = hash;
+}
+
+void
+conn_output_resume (conn_t *c, uint64_t *off, uint64_t *hash)
+{
+  *off = c->resume ? c->written : 0;
+  *hash = c->resume ? c->written_hash : FNV_BASIS;
+}
+
+void
+conn_output_restart (conn_t *c)
+{
+  assert (!c->outq);
+  if (ftruncate (c->wfd, 0) < 0 || lseek (c->wfd, 0, SEEK_SET) < 0)
+    perror ("conn_output_restart");
+  if (c->resume && unlink (c->loop->resume_file) < 0 && errno != ENOENT)
+    perror (c->loop->resume_file);
+  c->written = c->checkpoint = 0;
+  c->written_hash = FNV_BASIS;
+}
+
+int
+conn_input_resume (conn_t *c, uint64_t off, uint64_t hash)
+{
+  char buf[65536];
+  uint64_t h = FNV_BASIS, pos = 0;
+
+  while (pos < off) {
+    size_t want = off - pos < sizeof (buf) ? off - pos : sizeof (buf);
+    ssize_t n = pread (c->rfd, buf, want, pos);
+    if (n <= 0)
+      return -1;
+    h = fnv1a (h, buf, n);
+    pos += n;
+  }
+  if (h != hash || lseek (c->rfd, off, SEEK_SET) < 0)
+    return -1;
+  return 0;
+}
+
 int
 conn_output (conn_t *c, const void *_buf, size_t _n)
 {
@@ -159,7 +317,9 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
     c->write_eof = 1;
     if (!c->outq)
     {
-      close(outfile);
+      resume_done (c);
+      if (!c->server)
+        close(c->loop->outfile);
       shutdown (c->wfd, SHUT_WR);
     }
     return 0;
@@ -180,6 +340,7 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
 
   if (!c->outq) {
     int r = write (c->wfd, buf, n);
+    c->loop->counters.writes++;
     if (r < 0) {
       if (errno != EAGAIN) {
 	perror ("write");
@@ -188,6 +349,7 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
       }
     }
     else {
+      conn_wrote (c, buf, r);
       buf += r;
       n -= r;
     }
@@ -204,7 +366,7 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
   }
 
   if (c->wpoll && c->outq)
-    cevents[c->wpoll].events |= POLLOUT;
+    c->loop->cevents[c->wpoll].events |= POLLOUT;
   return _n;
 }
 
@@ -217,6 +379,7 @@ conn_input (conn_t *c, void *buf, size_t n)
   if (c->read_eof)
     return -1;
   r = read (c->rfd, buf, n);
+  c->loop->counters.reads++;
   if (r == 0 || (r < 0 && errno != EAGAIN)) {
     if (r == 0)
       errno = EIO;
@@ -231,46 +394,163 @@ conn_input (conn_t *c, void *buf, size_t n)
     write (log_in, buf, r);
 
   c->xoff = 0;
-  cevents[c->rpoll].events |= POLLIN;
+  c->loop->cevents[c->rpoll].events |= POLLIN;
   if(r < 0)
-    close(infile);
+    close(c->loop->infile);
+  return r;
+}
+
+int
+conn_stream_input (conn_t *c, int sid, void *buf, size_t n)
+{
+  int r;
+
+  if (sid == 0)
+    return conn_input (c, buf, n);
+  assert (!c->delete_me && sid < c->nstreams);
+  if (c->dir) {
+    c->loop->counters.reads++;
+    return dir_read (c->dir, sid - 1, buf, n);
+  }
+  if (c->sfd[sid - 1] < 0)
+    return -1;
+  r = read (c->sfd[sid - 1], buf, n);
+  c->loop->counters.reads++;
+  if (r < 0 && errno == EAGAIN)
+    return 0;
+  if (r <= 0) {
+    if (r < 0)
+      perror ("read");
+    close (c->sfd[sid - 1]);
+    c->sfd[sid - 1] = -1;
+    return -1;
+  }
   return r;
 }
 
+int
+conn_stream_output (conn_t *c, int sid, const void *_buf, size_t _n)
+{
+  const char *buf = _buf;
+  size_t n = _n;
+  int fd;
+
+  if (c->dir && sid == 0) {
+    dir_manifest (c->dir, _buf, _n);
+    return _n;
+  }
+  if (sid == 0)
+    return conn_output (c, _buf, _n);
+  assert (!c->delete_me && sid < c->nstreams);
+  if (c->dir) {
+    c->loop->counters.writes++;
+    return dir_write (c->dir, sid - 1, _buf, _n);
+  }
+  if ((fd = c->sfd[sid - 1]) < 0)
+    return -1;
+  if (n == 0) {
+    close (fd);
+    c->sfd[sid - 1] = -1;
+    return 0;
+  }
+  while (n > 0) {
+    int r = write (fd, buf, n);
+    c->loop->counters.writes++;
+    if (r < 0) {
+      perror ("write");
+      return -1;
+    }
+    buf += r;
+    n -= r;
+  }
+  return _n;
+}
+
+size_t
+conn_stream_bufspace (conn_t *c, int sid)
+{
+  if (sid == 0 && !c->dir)
+    return conn_bufspace (c);
+  if (c->dir && sid > 0 && !dir_known (c->dir, sid - 1))
+    return 0;
+  return 2 * MAX_DATAGRAM;
+}
+
 static conn_t *
-conn_alloc (void)
+conn_alloc (loop_t *l)
 {
   conn_t *c = xmalloc (sizeof (*c));
   memset (c, 0, sizeof (*c));
-  c->prev = &conn_list;
-  c->next = conn_list;
+  c->loop = l;
+  c->id = __atomic_add_fetch (&conn_ids, 1, __ATOMIC_RELAXED);
+  c->prev = &l->conn_list;
+  c->next = l->conn_list;
   c->outqtail = &c->outq;
-  if (conn_list)
-    conn_list->prev = &c->next;
-  conn_list = c;
+  if (l->conn_list)
+    l->conn_list->prev = &c->next;
+  l->conn_list = c;
 
-  cevents_generation++;
+  l->cevents_generation++;
 
   return c;
 }
 
+/* Open the file a server-mode transfer from ss is written to, named
+ * after the peer's address and port.  Refuses to overwrite, so a
+ * stray retransmission of seqno 1 after a transfer has finished
+ * cannot truncate its output. */
+static int
+server_openfile (const char *dir, const struct sockaddr_storage *ss)
+{
+  char addr[NI_MAXHOST] = "unknown";
+  char port[NI_MAXSERV] = "unknown";
+  char *path;
+  int fd;
+
+  getnameinfo ((const struct sockaddr *) ss, addrsize (ss),
+	       addr, sizeof (addr), port, sizeof (port),
+	       NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV);
+  path = xmalloc (strlen (dir) + strlen (addr) + strlen (port) + 3);
+  sprintf (path, "%s/%s_%s", dir, addr, port);
+  fd = open (path, O_WRONLY|O_CREAT|O_EXCL, S_IWRITE|S_IREAD);
+  if (fd < 0)
+    fprintf (stderr, "%s: %s\n", path, strerror (errno));
+  free (path);
+  return fd;
+}
+
 conn_t *
-conn_create (rel_t *rel, const struct sockaddr_storage *ss)
+conn_create (loop_t *l, rel_t *rel, const struct sockaddr_storage *ss)
 {
   int n;
   conn_t *c;
 
   /* conn_create is only when the program is running as a server (and
-   * rel_recvpkt is called with NULL packets.  If you call conn_create
-   * in the client, you will see this assertion fail. */
-  assert (serverconf);
+   * rel_demux sees a new peer).  If you call conn_create in the
+   * client, you will see this assertion fail. */
+  assert (l->serverconf);
+
+  if (l->serverconf->outdir) {
+    if ((n = server_openfile (l->serverconf->outdir, ss)) < 0)
+      return NULL;
+    c = conn_alloc (l);
+    c->peer = *ss;
+    c->rel = rel;
+    c->nfd = l->serverconf->udp_socket;
+    c->rfd = -1;
+    c->wfd = n;
+    c->read_eof = 1;		/* Server only receives */
+    c->sender_receiver = RECEIVER;
+    c->server = 1;
+    return c;
+  }
 
-  if ((n = connect_to (0, &serverconf->dest)) < 0) {
+  if ((n = connect_to (0, &l->serverconf->dest)) < 0) {
     char addr[NI_MAXHOST] = "unknown";
     char port[NI_MAXSERV] = "unknown";
     int saved_errno = errno;
-    getnameinfo ((const struct sockaddr *) &serverconf->dest,
-		 sizeof (serverconf->dest),
+    getnameinfo ((const struct sockaddr *) &l->serverconf->dest,
+		 sizeof (l->serverconf->dest),
 		 addr, sizeof (addr), port, sizeof (port),
 		 NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV);
     fprintf (stderr, "%s:%s: connect: %s\n",
@@ -278,10 +558,10 @@ conn_create (rel_t *rel, const struct sockaddr_storage *ss)
     return NULL;
   }
 
-  c = conn_alloc ();
+  c = conn_alloc (l);
   c->peer = *ss;
   c->rel = rel;
-  c->nfd = serverconf->udp_socket;
+  c->nfd = l->serverconf->udp_socket;
   c->rfd = c->wfd = n;
   c->server = 1;
 
@@ -292,6 +572,7 @@ static void
 conn_free (conn_t *c)
 {
   chunk_t *ch, *nch;
+  int i;
 
   for (ch = c->outq; ch; ch = nch) {
     nch = ch->next;
@@ -301,15 +582,23 @@ conn_free (conn_t *c)
   if (c->next)
     c->next->prev = c->prev;
   *c->prev = c->next;
+  timer_unlink (c);
 
   close (c->rfd);
   if (c->wfd != c->rfd)
     close (c->wfd);
-  if (!c->server)
+  for (i = 1; i < c->nstreams && c->sfd; i++)
+    if (c->sfd[i - 1] >= 0)
+      close (c->sfd[i - 1]);
+  free (c->sfd);
+  if (c->dir)
+    dir_close (c->dir);
+  if (!c->server) {
     close (c->nfd);
-  close(infile);
-  close(outfile);
-  cevents_generation++;
+    close(c->loop->infile);
+    close(c->loop->outfile);
+  }
+  c->loop->cevents_generation++;
 
   /* to help catch errors */
   memset (c, 0xc5, sizeof (*c));
@@ -319,6 +608,7 @@ conn_free (conn_t *c)
 void
 conn_destroy (conn_t *c)
 {
+  timer_unlink (c);
   c->delete_me = 1;
 }
 
@@ -329,7 +619,7 @@ conn_drain (conn_t *c)
   int didsome = 0;
 
   if (c->wpoll)
-    cevents[c->wpoll].events &= ~POLLOUT;
+    c->loop->cevents[c->wpoll].events &= ~POLLOUT;
 
   if (c->write_err)
     return;
@@ -337,16 +627,18 @@ conn_drain (conn_t *c)
   while ((ch = c->outq)) {
     int n = write (c->wfd, ch->buf + ch->used,
 		   ch->size - ch->used);
+    c->loop->counters.writes++;
     if (n < 0) {
       if (errno != EAGAIN)
 	c->write_err = 1;
       break;
     }
     didsome = 1;
+    conn_wrote (c, ch->buf + ch->used, n);
     ch->used += n;
     if (ch->used < ch->size) {
       if (c->wpoll)
-	cevents[c->wpoll].events |= POLLOUT;
+	c->loop->cevents[c->wpoll].events |= POLLOUT;
       break;
     }
     c->outq = ch->next;
@@ -355,6 +647,7 @@ conn_drain (conn_t *c)
     free (ch);
   }
   if (c->write_eof && !c->write_err && !c->outq) {
+    resume_done (c);
     c->write_err = 1;
     shutdown (c->wfd, SHUT_WR);
   }
@@ -363,14 +656,14 @@ conn_drain (conn_t *c)
 }
 
 static void
-conn_mkevents (void)
+conn_mkevents (loop_t *l)
 {
   struct pollfd *e;
   conn_t **r, **w;
   size_t n = 2;
   conn_t *c;
 
-  for (c = conn_list; c; c = c->next) {
+  for (c = l->conn_list; c; c = c->next) {
     if (c->read_eof) {
       c->rpoll = 0;
       if (c->write_err)
@@ -395,13 +688,13 @@ conn_mkevents (void)
 
   e = xmalloc (n * sizeof (*e));
   memset (e, 0, n * sizeof (*e));
-  if (cevents)
-    e[0] = cevents[0];
+  if (l->cevents)
+    e[0] = l->cevents[0];
   else
     e[0].fd = -1;
   e[1].fd = 2;			/* Do catch errors on stderr */
     
-  for (c = conn_list; c; c = c->next) {
+  for (c = l->conn_list; c; c = c->next) {
     if (c->rpoll) {
       e[c->rpoll].fd = c->rfd;
       if (!c->xoff)
@@ -422,7 +715,7 @@ conn_mkevents (void)
   memset (r, 0, n * sizeof (*r));
   w = xmalloc (n * sizeof (*w));
   memset (w, 0, n * sizeof (*w));
-  for (c = conn_list; c; c = c->next) {
+  for (c = l->conn_list; c; c = c->next) {
     if (c->rpoll > 0)
       r[c->rpoll] = c;
     if (c->npoll > 0)
@@ -431,81 +724,304 @@ conn_mkevents (void)
       w[c->wpoll] = c;
   }
 
-  free (cevents);
-  cevents = e;
-  ncevents = n;
-  free (evreaders);
-  evreaders = r;
-  free (evwriters);
-  evwriters = w;
+  free (l->cevents);
+  l->cevents = e;
+  l->ncevents = n;
+  free (l->evreaders);
+  l->evreaders = r;
+  free (l->evwriters);
+  l->evwriters = w;
+}
+
+/* The receive buffer is sized for the largest datagram this process
+ * accepts; anything longer is truncated, fails its length check, and
+ * so looks lost to a peer probing the path MTU. */
+static packet_t *
+loop_rxbuf (loop_t *l, const struct config_common *cc)
+{
+  if (!l->rxbuf) {
+    l->rxsize = cc->max_datagram;
+    l->rxbuf = xmalloc (l->rxsize);
+  }
+  return l->rxbuf;
 }
 
 static void
-conn_demux (const struct config_server *cs)
+conn_demux (loop_t *l, const struct config_server *cs)
 {
-  packet_t pkt;
+  packet_t *pkt = loop_rxbuf (l, &cs->c);
   struct sockaddr_storage ss;
   int n;
 
   memset (&ss, 0, sizeof (ss));
-  while ((n = debug_recv (cs->udp_socket, &pkt, sizeof (pkt), 0, &ss)) >= 0) {
-    rel_demux (&cs->c, &ss, &pkt, n);
-    memset (&pkt, 0xc7, n);	     /* to help debugging */
+  while ((n = debug_recv (cs->udp_socket, pkt, l->rxsize, 0, &ss, NULL)) >= 0) {
+    l->counters.recvs++;
+    rel_demux (l, &cs->c, &ss, pkt, n);
+    memset (pkt, 0xc7, n);	     /* to help debugging */
     memset (&ss, 0x7c, sizeof (ss)); /* to help debugging */
   }
+  l->counters.recvs++;
   if (errno != EAGAIN)
     perror ("UDP recv");
 }
 
-long
-need_timer_in (const struct timespec *last, long timer)
+/* The loop's clock is read once per conn_poll iteration, so
+ * per-packet code never makes a clock syscall. */
+static void
+clock_refresh (loop_t *l)
 {
-  long to;
   struct timespec ts;
 
-  clock_gettime (CLOCK_MONOTONIC, &ts);
-  to = ts.tv_sec - last->tv_sec;
-  if (to > timer / 1000)
-    return 0;
-  to = to * 1000 + (ts.tv_nsec - last->tv_nsec) / 1000000;
-  if (to >= timer)
-    return 0;
-  return
-    timer - to;
+  clock_gettime (RLIB_CLOCK, &ts);
+  l->now = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t
+conn_clock (conn_t *c)
+{
+  if (!c->loop->now)
+    clock_refresh (c->loop);
+  return c->loop->now;
+}
+
+/* Timer wheel ticks are milliseconds of the cached clock. */
+static uint64_t
+wheel_now (loop_t *l)
+{
+  if (!l->now)
+    clock_refresh (l);
+  return l->now / 1000000;
+}
+
+#define WHEEL_BIT(slot) (1ULL << ((slot) % 64))
+
+static void
+timer_unlink (conn_t *c)
+{
+  loop_t *l = c->loop;
+  unsigned slot = c->texpire & WHEEL_MASK;
+
+  if (!c->tprev)
+    return;
+  if (c->tnext)
+    c->tnext->tprev = c->tprev;
+  *c->tprev = c->tnext;
+  c->tnext = NULL;
+  c->tprev = NULL;
+  l->wheel_count--;
+  if (!l->wheel[slot])
+    l->wheel_bits[slot / 64] &= ~WHEEL_BIT (slot);
+}
+
+/* Arm c in the bucket of its texpire */
+static void
+timer_link (loop_t *l, conn_t *c)
+{
+  unsigned slot = c->texpire & WHEEL_MASK;
+  conn_t **head = &l->wheel[slot];
+
+  l->wheel_bits[slot / 64] |= WHEEL_BIT (slot);
+  c->tprev = head;
+  c->tnext = *head;
+  if (*head)
+    (*head)->tprev = &c->tnext;
+  *head = c;
+  l->wheel_count++;
+}
+
+void
+conn_settimer (conn_t *c, long delay)
+{
+  loop_t *l = c->loop;
+  uint64_t now;
+
+  timer_unlink (c);
+  if (delay < 0 || c->delete_me)
+    return;
+  now = wheel_now (l);
+  if (!l->wheel_count || now < l->wheel_tick)
+    l->wheel_tick = now;
+  c->texpire = now + (delay > 0 ? delay : 1);
+  timer_link (l, c);
+}
+
+/* Milliseconds until the earliest armed timer, 0 if one is already
+ * due, or -1 if no timer is armed.  wheel_bits lets it skip empty
+ * buckets 64 at a time. */
+static long
+timer_next (loop_t *l)
+{
+  uint64_t now, tick, soonest, bits;
+  unsigned slot;
+  conn_t *c;
+  int i;
+
+  if (!l->wheel_count)
+    return -1;
+  now = wheel_now (l);
+  if (now < l->wheel_tick)
+    now = l->wheel_tick;
+  soonest = UINT64_MAX;
+  for (i = 1; i <= WHEEL_SIZE; i++) {
+    slot = (l->wheel_tick + i) & WHEEL_MASK;
+    bits = l->wheel_bits[slot / 64] >> (slot % 64);
+    if (!bits) {
+      i += 63 - slot % 64;	/* On to the next word */
+      continue;
+    }
+    i += __builtin_ctzll (bits);
+    if (i > WHEEL_SIZE)
+      break;
+    tick = l->wheel_tick + i;
+    for (c = l->wheel[tick & WHEEL_MASK]; c; c = c->tnext) {
+      if (c->texpire <= tick)
+	return tick > now ? (long) (tick - now) : 0;
+      if (c->texpire < soonest)
+	soonest = c->texpire;
+    }
+  }
+  /* Everything armed is at least a full revolution away. */
+  return soonest > now ? (long) (soonest - now) : 0;
+}
+
+/* Milliseconds poll may sleep: until the next timer or sample. */
+static long
+poll_timeout (loop_t *l)
+{
+  long t = timer_next (l);
+  uint64_t now;
+  long s;
+
+  if (!sample_interval)
+    return t;
+  now = l->now;
+  s = l->sample_next > now ? (l->sample_next - now + 999999) / 1000000 : 0;
+  return t < 0 || s < t ? s : t;
+}
+
+/* Write one time-series record per connection if a sampling
+ * interval has elapsed. */
+static void
+sample_run (loop_t *l)
+{
+  struct rel_sample rs;
+  uint64_t rate;
+  conn_t *c;
+
+  if (!sample_interval || l->now < l->sample_next)
+    return;
+  l->sample_next = l->now + sample_interval;
+
+  for (c = l->conn_list; c; c = c->next) {
+    if (c->delete_me)
+      continue;
+    memset (&rs, 0, sizeof (rs));
+    rel_sample (c->rel, &rs);
+    rate = 0;
+    if (c->sample_time && l->now > c->sample_time)
+      rate = (double) (rs.delivered - c->sample_delivered) * 8e9
+	/ (l->now - c->sample_time);
+    c->sample_time = l->now;
+    c->sample_delivered = rs.delivered;
+
+    if (sample_csv)
+      fprintf (sample_fp, "%.3f,%u,%u,%u,%llu,%.3f,%.3f,%.3f,%llu,%llu\n",
+	       (l->now - sample_t0) / 1e6, c->id, rs.cwnd, rs.inflight,
+	       (unsigned long long) rs.inflight_bytes, rs.srtt / 1e6,
+	       rs.rttvar / 1e6, rs.min_rtt / 1e6,
+	       (unsigned long long) rs.delivered, (unsigned long long) rate);
+    else
+      fprintf (sample_fp, "{\"time_ms\":%.3f,\"conn\":%u,\"cwnd\":%u,"
+	       "\"inflight\":%u,\"bytes_in_flight\":%llu,\"srtt_ms\":%.3f,"
+	       "\"rttvar_ms\":%.3f,\"min_rtt_ms\":%.3f,\"delivered\":%llu,"
+	       "\"delivery_rate_bps\":%llu}\n",
+	       (l->now - sample_t0) / 1e6, c->id, rs.cwnd, rs.inflight,
+	       (unsigned long long) rs.inflight_bytes, rs.srtt / 1e6,
+	       rs.rttvar / 1e6, rs.min_rtt / 1e6,
+	       (unsigned long long) rs.delivered, (unsigned long long) rate);
+  }
+  fflush (sample_fp);
+}
+
+/* Fire every timer due at or before the current tick. */
+static void
+timer_run (loop_t *l)
+{
+  uint64_t now, tick;
+  conn_t *pending, *c;
+
+  if (!l->wheel_count)
+    return;
+  now = wheel_now (l);
+  tick = l->wheel_tick + 1;
+  /* After a long stall, one revolution visits every bucket. */
+  if (now - l->wheel_tick > WHEEL_SIZE)
+    tick = now - WHEEL_SIZE + 1;
+  /* Timers re-armed by rel_timer land beyond now, so they cannot
+   * fire again during this pass. */
+  l->wheel_tick = now;
+
+  for (; tick <= now; tick++) {
+    unsigned slot = tick & WHEEL_MASK;
+    conn_t **head = &l->wheel[slot];
+
+    /* Move the bucket onto a private list, so callbacks re-arming
+     * into this same bucket are not visited again. */
+    pending = *head;
+    *head = NULL;
+    l->wheel_bits[slot / 64] &= ~WHEEL_BIT (slot);
+    if (pending)
+      pending->tprev = &pending;
+    while ((c = pending)) {
+      pending = c->tnext;
+      if (pending)
+	pending->tprev = &pending;
+      c->tnext = NULL;
+      c->tprev = NULL;
+      l->wheel_count--;
+      if (c->texpire > now)
+	timer_link (l, c);
+      else if (!c->delete_me) {
+	trace_event (TR_TIMER, c->id, 0, 0, 0);
+	rel_timer (c->rel);
+      }
+    }
+  }
 }
 
 void
-conn_poll (const struct config_common *cc)
+conn_poll (loop_t *l, const struct config_common *cc)
 {
   // int n, i;
   int i;
   conn_t *c, *nc;
-  static int last_cg;
 
-  if (last_cg != cevents_generation) {
-    conn_mkevents ();
-    cevents_generation = last_cg;
+  if (l->last_cg != l->cevents_generation) {
+    conn_mkevents (l);
+    l->cevents_generation = l->last_cg;
   }
 
-  if (cevents[0].fd >= 0){
-    // n = poll (cevents, ncevents, need_timer_in (&last_timeout, cc->timer));
-    poll (cevents, ncevents, need_timer_in (&last_timeout, cc->timer));
+  if (l->cevents[0].fd >= 0){
+    // n = poll (l->cevents, l->ncevents, timer_next (l));
+    poll (l->cevents, l->ncevents, poll_timeout (l));
   }
   else{
-    // n = poll (cevents+1, ncevents-1, need_timer_in (&last_timeout, cc->timer));
-    poll (cevents+1, ncevents-1, need_timer_in (&last_timeout, cc->timer));
+    // n = poll (l->cevents+1, l->ncevents-1, timer_next (l));
+    poll (l->cevents+1, l->ncevents-1, poll_timeout (l));
   }
+  l->counters.polls++;
+  clock_refresh (l);
 
-  for (i = 1; i < ncevents; i++) {
-    if (cevents[i].revents & (POLLIN|POLLERR|POLLHUP)) {
-      if ((c = evreaders[i]) && !c->delete_me) {
-	if (cevents[i].fd == c->rfd) {
+  for (i = 1; i < l->ncevents; i++) {
+    if (l->cevents[i].revents & (POLLIN|POLLERR|POLLHUP)) {
+      if ((c = l->evreaders[i]) && !c->delete_me) {
+	if (l->cevents[i].fd == c->rfd) {
 	  c->xoff = 1;
-	  cevents[i].events &= ~POLLIN;
+	  l->cevents[i].events &= ~POLLIN;
 	  rel_read (c->rel);
 	}
-	else if (cevents[i].fd == c->nfd
-		 && (cevents[i].revents & (POLLERR|POLLHUP))) {
+	else if (l->cevents[i].fd == c->nfd
+		 && (l->cevents[i].revents & (POLLERR|POLLHUP))) {
 	  char addr[NI_MAXHOST] = "unknown";
 	  char port[NI_MAXSERV] = "unknown";
 	  getnameinfo ((const struct sockaddr *) &c->peer, sizeof (c->peer),
@@ -517,43 +1033,49 @@ conn_poll (const struct config_common *cc)
 	    exit (1);
 	  rel_destroy (c->rel);
 	}
-	else if (cevents[i].fd == c->nfd && !c->server) {
-	  packet_t pkt;
-	  int len = debug_recv (c->nfd, &pkt, sizeof (pkt), 0, NULL);
+	else if (l->cevents[i].fd == c->nfd && !c->server) {
+	  packet_t *pkt = loop_rxbuf (l, cc);
+	  int len = debug_recv (c->nfd, pkt, l->rxsize, 0, NULL, c);
+	  l->counters.recvs++;
 	  if (len < 0) {
 	    if (errno != EAGAIN)
 	      perror ("recv");
 	  }
 	  else {
-	    rel_recvpkt (c->rel, &pkt, len);
-	    memset (&pkt, 0xc9, len); /* for debugging */
+	    rel_recvpkt (c->rel, pkt, len);
+	    memset (pkt, 0xc9, len); /* for debugging */
 	  }
 	}
       }
     }
-    if ((cevents[i].revents & (POLLOUT|POLLHUP|POLLERR))
-	&& evwriters[i])
-      conn_drain (evwriters[i]);
-    if (cevents[i].revents & (POLLHUP|POLLERR)) {
+    if ((l->cevents[i].revents & (POLLOUT|POLLHUP|POLLERR))
+	&& l->evwriters[i])
+      conn_drain (l->evwriters[i]);
+    if (l->cevents[i].revents & (POLLHUP|POLLERR)) {
 #if 0
       fprintf (stderr, "%5d Error on fd %d (0x%x)\n",
-	       getpid (), cevents[i].fd, cevents[i].revents);
+	       getpid (), l->cevents[i].fd, l->cevents[i].revents);
 #endif
       /* If stderr has an error, the tester has probably died, so exit
        * immediately. */
-      if (cevents[i].fd == 2)
+      if (l->cevents[i].fd == 2)
 	exit (1);
-      cevents[i].fd = -1;
+      l->cevents[i].fd = -1;
     }
-    cevents[i].revents = 0;
+    l->cevents[i].revents = 0;
   }
 
-  if (need_timer_in (&last_timeout, cc->timer) == 0) {
-    rel_timer ();
-    clock_gettime (CLOCK_MONOTONIC, &last_timeout);
+  timer_run (l);
+  sample_run (l);
+
+  if (l->stats_seen != stats_generation) {
+    l->stats_seen = stats_generation;
+    for (c = l->conn_list; c; c = c->next)
+      if (!c->delete_me)
+	rel_stats (c->rel);
   }
 
-  for (c = conn_list; c; c = nc) {
+  for (c = l->conn_list; c; c = nc) {
     nc = c->next;
     if (c->delete_me && (c->write_err || !c->outq))
       conn_free (c);
@@ -644,6 +1166,19 @@ hash_bytes (const void *_key, int len, unsigned int seed)
     seed = ((seed << 5) + seed) ^ *key;
   return seed;
 }
+/* UDP port of an address in host order, 0 for unix sockets. */
+static uint16_t
+addrport (const struct sockaddr_storage *ss)
+{
+  switch (ss->ss_family) {
+  case AF_INET:
+    return ntohs (((const struct sockaddr_in *) ss)->sin_port);
+  case AF_INET6:
+    return ntohs (((const struct sockaddr_in6 *) ss)->sin6_port);
+  }
+  return 0;
+}
+
 unsigned int
 addrhash (const struct sockaddr_storage *ss)
 {
@@ -733,8 +1268,30 @@ get_address (struct sockaddr_storage *ss, int local,
   return 0;
 }
 
-int
-listen_on (int dgram, struct sockaddr_storage *ss)
+/* Path MTU probes must be dropped rather than fragmented when too big,
+ * so datagram sockets set DF and leave discovery to reliable.c.  The
+ * default socket buffers hold only a few MAX_DATAGRAM packets, so ask
+ * for room for a window of them (the kernel caps this at rmem_max). */
+#define UDP_BUFSIZE (4 << 20)
+
+static void
+dgram_options (int s, int family)
+{
+  int v = UDP_BUFSIZE;
+  setsockopt (s, SOL_SOCKET, SO_RCVBUF, &v, sizeof (v));
+  setsockopt (s, SOL_SOCKET, SO_SNDBUF, &v, sizeof (v));
+  if (family == AF_INET) {
+    v = IP_PMTUDISC_PROBE;
+    setsockopt (s, IPPROTO_IP, IP_MTU_DISCOVER, &v, sizeof (v));
+  }
+  else if (family == AF_INET6) {
+    v = IPV6_PMTUDISC_PROBE;
+    setsockopt (s, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &v, sizeof (v));
+  }
+}
+
+static int
+listen_on_opt (int dgram, struct sockaddr_storage *ss, int reuseport)
 {
   int type = dgram ? SOCK_DGRAM : SOCK_STREAM;
   int s = socket (ss->ss_family, type, 0);
@@ -749,6 +1306,14 @@ listen_on (int dgram, struct sockaddr_storage *ss)
   }
   if (!dgram)
     setsockopt (s, SOL_SOCKET, SO_REUSEADDR, (char *) &n, sizeof (n));
+  else
+    dgram_options (s, ss->ss_family);
+  if (reuseport
+      && setsockopt (s, SOL_SOCKET, SO_REUSEPORT, (char *) &n, sizeof (n)) < 0) {
+    perror ("SO_REUSEPORT");
+    close (s);
+    return -1;
+  }
   if (bind (s, (const struct sockaddr *) ss, addrsize (ss)) < 0) {
     perror ("bind");
     close (s);
@@ -787,6 +1352,18 @@ listen_on (int dgram, struct sockaddr_storage *ss)
   return s;
 }
 
+int
+listen_on (int dgram, struct sockaddr_storage *ss)
+{
+  return listen_on_opt (dgram, ss, 0);
+}
+
+int
+listen_on_shared (int dgram, struct sockaddr_storage *ss)
+{
+  return listen_on_opt (dgram, ss, 1);
+}
+
 int
 connect_to (int dgram, const struct sockaddr_storage *ss)
 {
@@ -796,6 +1373,8 @@ connect_to (int dgram, const struct sockaddr_storage *ss)
     perror ("socket");
     return -1;
   }
+  if (dgram)
+    dgram_options (s, ss->ss_family);
   make_async (s);
   if (connect (s, (struct sockaddr *) ss, addrsize (ss)) < 0
       && errno != EINPROGRESS) {
@@ -809,7 +1388,7 @@ connect_to (int dgram, const struct sockaddr_storage *ss)
 
 static int
 debug_recv (int s, packet_t *buf, size_t len, int flags,
-	    struct sockaddr_storage *from)
+	    struct sockaddr_storage *from, conn_t *c)
 {
   socklen_t socklen = sizeof (*from);
   int n;
@@ -817,6 +1396,9 @@ debug_recv (int s, packet_t *buf, size_t len, int flags,
     n = recvfrom (s, buf, len, flags, (struct sockaddr *) from, &socklen);
   else
     n = recv (s, buf, len, flags);
+  if (pcap_fd >= 0 && n >= 0)
+    pcap_record (PCAP_RECEIVED, c ? c->id : 0,
+		 addrport (from ? from : &c->peer), buf, n);
   if (opt_debug)
     print_pkt (buf, "recv", n);
   return n;
@@ -824,15 +1406,15 @@ debug_recv (int s, packet_t *buf, size_t len, int flags,
 
 
 void
-do_client (struct config_client *cc)
+do_client (loop_t *l, struct config_client *cc)
 {
-  conn_mkevents ();
+  conn_mkevents (l);
   make_async (cc->listen_socket);
-  cevents[0].fd = cc->listen_socket;
-  cevents[0].events = POLLIN;
+  l->cevents[0].fd = cc->listen_socket;
+  l->cevents[0].events = POLLIN;
   for (;;) {
-    conn_poll (&cc->c);
-    if (cevents[0].revents) {
+    conn_poll (l, &cc->c);
+    if (l->cevents[0].revents) {
       struct sockaddr_storage ss;
       socklen_t len = sizeof (ss);
       int s, u;
@@ -845,13 +1427,13 @@ do_client (struct config_client *cc)
 	continue;
       make_async (s);
       if ((u = connect_to (1, &cc->server)) >= 0) {
-	c = conn_alloc ();
+	c = conn_alloc (l);
 	c->rfd = s;
 	c->wfd = s;
 	c->nfd = u;
 	c->peer = cc->server;
 	c->rel = rel_create (c, NULL, &cc->c);
-	conn_mkevents ();
+	conn_mkevents (l);
       }
       else
 	close (s);
@@ -859,19 +1441,161 @@ do_client (struct config_client *cc)
   }
 }
 
-void
-do_server (struct config_server *cs)
+static void
+server_attach (loop_t *l, struct config_server *cs)
 {
-  serverconf = cs;
-  conn_mkevents ();
+  l->serverconf = cs;
+  conn_mkevents (l);
   make_async (cs->udp_socket);
-  cevents[0].fd = cs->udp_socket;
-  cevents[0].events = POLLIN;
-  for (;;) {
-    conn_poll (&cs->c);
-    if (cevents[0].revents)
-      conn_demux (cs);
+  l->cevents[0].fd = cs->udp_socket;
+  l->cevents[0].events = POLLIN;
+}
+
+void
+server_poll (loop_t *l, struct config_server *cs)
+{
+  conn_poll (l, &cs->c);
+  if (l->cevents[0].revents)
+    conn_demux (l, cs);
+}
+
+void
+do_server (loop_t *l, struct config_server *cs)
+{
+  server_attach (l, cs);
+  for (;;)
+    server_poll (l, cs);
+}
+
+struct config_server *
+server_start (loop_t *l, const struct config_common *cc, char *local,
+	      char *outdir)
+{
+  struct config_server *cs;
+  struct sockaddr_storage ss;
+  int fd;
+
+  if (get_address (&ss, 1, 1, AF_INET, local) < 0
+      || (fd = listen_on (1, &ss)) < 0)
+    return NULL;
+  cs = xmalloc (sizeof (*cs));
+  memset (cs, 0, sizeof (*cs));
+  cs->c = *cc;
+  cs->udp_socket = fd;
+  cs->outdir = outdir;
+  server_attach (l, cs);
+  return cs;
+}
+
+void
+server_stop (loop_t *l, struct config_server *cs)
+{
+  assert (!l->conn_list);
+  close (cs->udp_socket);
+  l->serverconf = NULL;
+  free (cs);
+}
+
+static conn_t *
+conn_start_common (loop_t *l, const struct config_common *cc,
+		   int rfd, int wfd, const int *fds, int n,
+		   struct dir_xfer *d, char *local, char *remote)
+{
+  struct sockaddr_storage sl, sr;
+  conn_t *c;
+  int nfd;
+
+  if (get_address (&sr, 0, 1, AF_INET, remote) < 0
+      || get_address (&sl, 1, 1, sr.ss_family, local) < 0
+      || (nfd = listen_on (1, &sl)) < 0)
+    return NULL;
+  if (connect (nfd, (struct sockaddr *) &sr, addrsize (&sr)) < 0) {
+    perror ("connect error");
+    close (nfd);
+    return NULL;
   }
+  c = conn_alloc (l);
+  c->rfd = rfd;
+  c->wfd = wfd;
+  c->nfd = nfd;
+  c->sender_receiver = cc->sender_receiver;
+  c->server = 0;
+  c->peer = sr;
+  if (n > 0 || d) {
+    c->nstreams = n + 1;
+    if (fds) {
+      c->sfd = xmalloc (n * sizeof (*c->sfd));
+      memcpy (c->sfd, fds, n * sizeof (*c->sfd));
+    }
+  }
+  c->dir = d;
+  if (cc->resume && c->sender_receiver == RECEIVER && l->resume_file)
+    resume_load (c);
+  make_async (c->rfd);
+  make_async (c->wfd);
+  make_async (c->nfd);
+  c->rel = rel_create (c, NULL, cc);
+  conn_mkevents (l);
+  return c;
+}
+
+conn_t *
+conn_start (loop_t *l, const struct config_common *cc, int rfd, int wfd,
+	    char *local, char *remote)
+{
+  return conn_start_common (l, cc, rfd, wfd, NULL, 0, NULL, local, remote);
+}
+
+conn_t *
+conn_start_streams (loop_t *l, const struct config_common *cc,
+		    int rfd, int wfd, const int *fds, int n,
+		    char *local, char *remote)
+{
+  return conn_start_common (l, cc, rfd, wfd, fds, n, NULL, local, remote);
+}
+
+conn_t *
+conn_start_dir (loop_t *l, const struct config_common *cc, int rfd, int wfd,
+		struct dir_xfer *d, char *local, char *remote)
+{
+  return conn_start_common (l, cc, rfd, wfd, NULL, dir_nfiles (d), d,
+			    local, remote);
+}
+
+/* Everything below is the reliable program itself; bench.c builds
+ * rlib.c with -DRLIB_NO_MAIN and drives loops on its own. */
+#ifndef RLIB_NO_MAIN
+
+static void
+stats_handler (int sig)
+{
+  stats_generation++;
+}
+
+/* SIGUSR2 snapshots the trace ring to disk */
+static void
+trace_handler (int sig)
+{
+  trace_flush ();
+}
+
+/* SIGINT and SIGTERM flush the trace and capture, then die as
+ * before */
+static void
+fatal_handler (int sig)
+{
+  trace_flush ();
+  if (pcap_fd >= 0)
+    pcap_flush_unlocked ();
+  signal (sig, SIG_DFL);
+  raise (sig);
+}
+
+static void *
+server_worker (void *arg)
+{
+  do_server (loop_create (), arg);
+  return NULL;
 }
 
 static void
@@ -880,8 +1604,47 @@ usage (void)
   fprintf (stderr,
 	   "usage: %s -s inputfile udp-port [relayer:]udp-port\n"
            "       %s -r outputfile udp-port [relayer:]udp-port\n"
+           "       %s -S outputdir udp-port\n"
+           "       -s/-r: more than once, send or receive each file as a"
+	   " stream of its\n"
+           "           own over the one connection (up to 256; both ends"
+	   " must agree);\n"
+           "           naming a directory, every regular file in it\n"
+           "       -c: most streams sent at once (default 8)\n"
            "       -w: RECEIVER's maximum receiving window size, in number of packets\n"
-	   ,progname, progname);
+           "       -t: retransmission timeout in milliseconds (default 10)\n"
+           "       -a: ack every N in-order packets (default 1)\n"
+           "       -A: longest an ack is delayed, in milliseconds"
+	   " (default half of -t)\n"
+           "       -b: number bytes rather than packets, so retransmissions"
+	   " can merge\n"
+           "           small packets (both ends must agree)\n"
+           "       -N: send short reads at once instead of coalescing them\n"
+           "       -F: longest a short read is held back, in milliseconds"
+	   " (default half of -t)\n"
+           "       -m: largest datagram to probe for and accept, in bytes"
+	   " (default 65507;\n"
+           "           1016 turns path MTU discovery off)\n"
+           "       -f: send a parity packet per at most this many data"
+	   " packets (1-32),\n"
+           "           fewer as loss grows; the receiver rebuilds a lost"
+	   " one from it\n"
+           "       -z: compress payloads, unless they turn out not to"
+	   " shrink\n"
+           "       -R: resume where an earlier transfer of the file left"
+	   " off (both ends;\n"
+           "           the receiver keeps outputfile" RESUME_SUFFIX
+	   " meanwhile)\n"
+           "       -I: initial sequence number (default 1; both ends must"
+	   " agree)\n"
+           "       -j: number of server worker threads sharing udp-port\n"
+           "       -T: record a binary packet trace to this file\n"
+           "       -q: write a cwnd/RTT time series to this file"
+	   " (CSV if it ends in .csv)\n"
+           "       -i: time-series sampling interval in milliseconds"
+	   " (default 10)\n"
+           "       -P: capture every datagram to this pcap file\n"
+	   ,progname, progname, progname);
   exit (1);
 }
 
@@ -891,15 +1654,38 @@ main (int argc, char **argv)
   struct option o[] = {
     { "debug", no_argument, NULL, 'd' },
     { "window", required_argument, NULL, 'w' },
+    { "timeout", required_argument, NULL, 't' },
+    { "ack-every", required_argument, NULL, 'a' },
+    { "ack-delay", required_argument, NULL, 'A' },
+    { "bytes", no_argument, NULL, 'b' },
+    { "nodelay", no_argument, NULL, 'N' },
+    { "flush-delay", required_argument, NULL, 'F' },
+    { "max-datagram", required_argument, NULL, 'm' },
+    { "isn", required_argument, NULL, 'I' },
+    { "fec", required_argument, NULL, 'f' },
+    { "compress", no_argument, NULL, 'z' },
+    { "concurrency", required_argument, NULL, 'c' },
+    { "resume", no_argument, NULL, 'R' },
     { "sender", required_argument, NULL, 's'},
     { "receiver", required_argument, NULL, 'r'},
+    { "server", required_argument, NULL, 'S'},
+    { "workers", required_argument, NULL, 'j'},
+    { "trace", required_argument, NULL, 'T'},
+    { "sample", required_argument, NULL, 'q'},
+    { "sample-interval", required_argument, NULL, 'i'},
+    { "pcap", required_argument, NULL, 'P'},
     { NULL, 0, NULL, 0 }
   };
   int opt;
-  char *local = NULL;
-  char *remote = NULL;
-  char *input = NULL;
-  char *output = NULL;
+  char *files[MAX_STREAMS];
+  int nfiles = 0;
+  int fds[MAX_STREAMS];
+  char *outdir = NULL;
+  int workers = 1;
+  char *tracefile = NULL;
+  char *samplefile = NULL;
+  char *pcapfile = NULL;
+  int interval = 10;
   struct config_common c;
   struct sigaction sa;
 
@@ -908,8 +1694,17 @@ main (int argc, char **argv)
   sa.sa_handler = SIG_IGN;
   sigaction (SIGPIPE, &sa, NULL);
 
+  /* SIGUSR1 asks every connection to print its statistics */
+  sa.sa_handler = stats_handler;
+  sigaction (SIGUSR1, &sa, NULL);
+
   memset (&c, 0, sizeof (c));
   c.window = 1;
+  c.timeout = 10;
+  c.ack_every = 1;
+  c.max_datagram = MAX_DATAGRAM;
+  c.isn = 1;
+  c.concurrency = 8;
   c.sender_receiver = RECEIVER; /* default, it is receiver*/
 
   progname = strrchr (argv[0], '/');
@@ -919,83 +1714,220 @@ main (int argc, char **argv)
     progname = argv[0];
 
 
-  while ((opt = getopt_long (argc, argv, "ds:r:w:", o, NULL)) != -1)
+  while ((opt = getopt_long (argc, argv, "ds:r:S:j:w:t:a:A:bNF:m:I:f:zc:RT:q:i:P:", o, NULL)) != -1)
     switch (opt) {
     case 'd':
       opt_debug = 1;
       break;
     case 's':
-      c.sender_receiver = SENDER;
-      input = optarg;
-      break;
     case 'r':
+      if (nfiles > 0 && c.sender_receiver != (opt == 's' ? SENDER : RECEIVER))
+	usage ();
+      c.sender_receiver = opt == 's' ? SENDER : RECEIVER;
+      if (nfiles == MAX_STREAMS)
+	usage ();
+      files[nfiles++] = optarg;
+      break;
+    case 'S':
       c.sender_receiver = RECEIVER;
-      output = optarg;
+      outdir = optarg;
       break;
     case 'w': //receiver's largest receiving window size, the sender does not need this parameter.
       c.window = atoi (optarg);
       break;
+    case 't':
+      c.timeout = atoi (optarg);
+      break;
+    case 'a':
+      c.ack_every = atoi (optarg);
+      break;
+    case 'A':
+      c.ack_delay = atoi (optarg);
+      break;
+    case 'b':
+      c.byte_seq = 1;
+      break;
+    case 'N':
+      c.nodelay = 1;
+      break;
+    case 'F':
+      c.flush_delay = atoi (optarg);
+      break;
+    case 'm':
+      c.max_datagram = atoi (optarg);
+      break;
+    case 'I':
+      c.isn = strtoul (optarg, NULL, 0);
+      break;
+    case 'f':
+      c.fec_group = atoi (optarg);
+      break;
+    case 'z':
+      c.compress = 1;
+      break;
+    case 'c':
+      c.concurrency = atoi (optarg);
+      break;
+    case 'R':
+      c.resume = 1;
+      break;
+    case 'j':
+      workers = atoi (optarg);
+      break;
+    case 'T':
+      tracefile = optarg;
+      break;
+    case 'q':
+      samplefile = optarg;
+      break;
+    case 'i':
+      interval = atoi (optarg);
+      break;
+    case 'P':
+      pcapfile = optarg;
+      break;
     default:
       usage ();
       break;
     }
 
 
-  if(optind + 2 != argc || c.window < 1)
+  if(optind + (outdir ? 1 : 2) != argc || c.window < 1 || c.timeout < 1
+     || c.ack_every < 1 || c.ack_delay < 0 || c.flush_delay < 0
+     || c.max_datagram < BASE_DATAGRAM || c.max_datagram > MAX_DATAGRAM
+     || c.fec_group < 0 || c.fec_group > FEC_MAX_GROUP || c.concurrency < 1
+     || (outdir ? nfiles > 0 : nfiles == 0) || (nfiles > 1 && c.byte_seq)
+     || (c.resume && (outdir || nfiles > 1))
+     || workers < 1 || interval < 1)
     usage ();
 
-  c.timer = 10; //wake up rel_timer every 10ms
-  local = argv[optind];
-  remote = argv[optind+1];
-
+  if (tracefile) {
+    if (trace_open (tracefile) < 0)
+      exit (1);
+    atexit (trace_flush);
+    sa.sa_handler = trace_handler;
+    sigaction (SIGUSR2, &sa, NULL);
+  }
+  if (pcapfile) {
+    if (pcap_open (pcapfile) < 0)
+      exit (1);
+    atexit (pcap_flush);
+  }
+  if (tracefile || pcapfile) {
+    sa.sa_handler = fatal_handler;
+    sigaction (SIGINT, &sa, NULL);
+    sigaction (SIGTERM, &sa, NULL);
+  }
 
-  struct sockaddr_storage sl, sr;
-  conn_t *cn = conn_alloc ();
-  c.single_connection = 1;
-  
-  if(c.sender_receiver == SENDER)
-  {
-    infile = open(input, O_RDONLY);
-    if(infile < 0)
-    {
-      fprintf(stderr, "input file open error\n");
+  if (samplefile) {
+    size_t n = strlen (samplefile);
+    struct timespec ts;
+    if (!(sample_fp = fopen (samplefile, "w"))) {
+      perror (samplefile);
       exit (1);
     }
-    cn->rfd = infile;
-    cn->wfd = STDOUT_FILENO;
+    sample_csv = n >= 4 && !strcmp (samplefile + n - 4, ".csv");
+    if (sample_csv)
+      fprintf (sample_fp, "time_ms,conn,cwnd,inflight,bytes_in_flight,"
+	       "srtt_ms,rttvar_ms,min_rtt_ms,delivered,delivery_rate_bps\n");
+    clock_gettime (RLIB_CLOCK, &ts);
+    sample_t0 = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    sample_interval = (uint64_t) interval * 1000000;
   }
-  else if(c.sender_receiver == RECEIVER)
-  {
-    cn->rfd = STDIN_FILENO;
-    outfile = open(output, O_RDWR|O_CREAT, S_IWRITE|S_IREAD);
-    if(outfile < 0)
-    {
-      fprintf(stderr, "output file open error\n");
+
+  if (outdir) {
+    /* Each worker owns a socket bound to the same port with
+     * SO_REUSEPORT, so the kernel hashes a peer's 4-tuple to the
+     * same worker every time, and its own event loop. */
+    struct config_server *cs = xmalloc (workers * sizeof (*cs));
+    struct sockaddr_storage ss;
+    pthread_t tid;
+    int i;
+    if (get_address (&ss, 1, 1, AF_INET, argv[optind]) < 0)
       exit (1);
+    for (i = 0; i < workers; i++) {
+      memset (&cs[i], 0, sizeof (cs[i]));
+      cs[i].c = c;
+      cs[i].outdir = outdir;
+      cs[i].udp_socket = workers > 1 ? listen_on_shared (1, &ss)
+				     : listen_on (1, &ss);
+      if (cs[i].udp_socket < 0)
+	exit (1);
     }
-    cn->wfd = outfile;
+    for (i = 1; i < workers; i++)
+      if ((errno = pthread_create (&tid, NULL, server_worker, &cs[i]))) {
+	perror ("pthread_create");
+	exit (1);
+      }
+    do_server (loop_create (), &cs[0]);
   }
 
+  loop_t *l = loop_create ();
+  struct dir_xfer *d = NULL;
+  struct stat sb;
+  int rfd, wfd, i;
+  conn_t *conn;
+  c.single_connection = 1;
 
-  if (get_address (&sr, 0, 1, AF_INET, remote) < 0
-      || get_address (&sl, 1, 1, sr.ss_family, local) < 0
-      || (cn->nfd = listen_on (1, &sl)) < 0)
+  /* A lone directory is sent or received file by file */
+  if (nfiles == 1 && !c.byte_seq && stat (files[0], &sb) == 0
+      && S_ISDIR (sb.st_mode)) {
+    if (c.sender_receiver == SENDER)
+      d = dir_send_open (files[0], &fds[0]);
+    else
+      d = dir_recv_open (files[0]);
+    if (!d)
+      exit (1);
+    if (c.resume)
+      usage ();
+  }
+
+  for (i = 0; i < nfiles && !d; i++) {
+    if (c.sender_receiver == SENDER)
+      fds[i] = open (files[i], O_RDONLY);
+    else
+      fds[i] = open (files[i], O_RDWR|O_CREAT|(c.resume ? 0 : O_TRUNC),
+		     S_IWRITE|S_IREAD);
+    if (fds[i] < 0) {
+      fprintf (stderr, "%s: %s\n", files[i], strerror (errno));
       exit (1);
-  if (connect (cn->nfd, (struct sockaddr *) &sr, addrsize (&sr)) < 0) 
+    }
+  }
+  
+  if(c.sender_receiver == SENDER)
   {
-    perror ("connect error");
-    exit (1);
+    l->infile = fds[0];
+    rfd = l->infile;
+    wfd = STDOUT_FILENO;
+  }
+  else if (d)
+  {
+    rfd = STDIN_FILENO;
+    wfd = STDOUT_FILENO;
+  }
+  else
+  {
+    rfd = STDIN_FILENO;
+    l->outfile = fds[0];
+    wfd = l->outfile;
+    if (c.resume) {
+      l->resume_file = xmalloc (strlen (files[0]) + sizeof (RESUME_SUFFIX));
+      sprintf (l->resume_file, "%s" RESUME_SUFFIX, files[0]);
+    }
   }
-  cn->sender_receiver = c.sender_receiver;
-  cn->server = 0;
-  cn->peer = sr;
-  make_async (cn->rfd);
-  make_async (cn->wfd);
-  make_async (cn->nfd);
-  cn->rel = rel_create (cn, NULL, &c);
-
-  conn_mkevents ();
-  while (conn_list)
-    conn_poll (&c);
+
+  if (d)
+    conn = conn_start_dir (l, &c, rfd, wfd, d, argv[optind], argv[optind+1]);
+  else
+    conn = conn_start_streams (l, &c, rfd, wfd, fds + 1, nfiles - 1,
+			       argv[optind], argv[optind+1]);
+  if (!conn)
+    exit (1);
+
+  while (l->conn_list)
+    conn_poll (l, &c);
+  loop_destroy (l);
   return 0;
 }
+
+#endif /* !RLIB_NO_MAIN */
@@ -46,6 +46,9 @@
             number in any connection is 1, so if you have not received
             any packets yet, you should set the ackno field to 1.
 
+   - rwnd:  16-bit receive window (unused), followed by 8 bits of
+            PKT_* flags and a spare byte.
+
    The following fields only exist in a data packet:
 
    - seqno: Each packet transmitted in a stream of data must me
@@ -55,12 +58,23 @@
             packets.  That means that once a packet is transmitted, it
             cannot be merged with another packet for retransmission.
 
+            With -b both ends number bytes instead, TCP style: seqno
+            is that of the first payload byte, ackno the next byte
+            expected, and an EOF takes up one seqno.  Retransmissions
+            may then merge several small packets into one.
+
+            Seqnos are 32-bit serial numbers that wrap around (RFC
+            1982); -I starts a connection at some other seqno than 1,
+            e.g. just short of 2^32, to exercise the wrap.
+
    - data:  Contains (len - 12) bytes of payload data for the
             application.
 
    To conserve packets, a sender should not send more than one
    unacknowledged Data frame with less than the maximum number of
    packets (500), somewhat like TCP's Nagle algorithm.
+   reliable.c does this unless run with --nodelay, sending a short
+   frame early only if it has waited the --flush-delay.
 
  */
 
@@ -70,19 +84,101 @@ struct ack_packet {
   uint16_t cksum;
   uint16_t len;
   uint32_t ackno;
-  uint32_t rwnd;
+  uint16_t rwnd;
+  uint8_t flags;		/* PKT_* */
+  uint8_t spare;
 };
 
 struct packet {
   uint16_t cksum;
   uint16_t len;
   uint32_t ackno;
-  uint32_t rwnd;
+  uint16_t rwnd;
+  uint8_t flags;		/* PKT_* */
+  uint8_t spare;
   uint32_t seqno;		/* Only valid if length > 8 */
-  char data[1000];
+  char data[];			/* Up to max_datagram - 16 bytes */
 };
 typedef struct packet packet_t;
 
+/* A PKT_PROBE data packet is padding only, sent to find out whether
+   datagrams of its size get through (path MTU discovery).  It is
+   answered by a PKT_PROBE ack whose ackno is the probe's seqno; probe
+   seqnos are a space of their own. */
+#define PKT_PROBE 0x01
+
+/* With forward error correction (-f) a sender numbers the data
+   packets of each group of up to FEC_MAX_GROUP consecutive seqnos
+   1, 2, ... in their spare byte, and follows the group with a
+   PKT_PARITY packet: seqno is the group's first seqno, spare the
+   group size, rwnd the XOR of the payload lengths, ackno the XOR of
+   their flags << 16 | rwnd, and data the XOR of the payloads, each
+   zero-padded to the longest.  A receiver missing
+   one packet of a group can rebuild it from the others. */
+#define PKT_PARITY 0x02
+#define FEC_MAX_GROUP 32
+
+/* A PKT_COMPRESSED data packet's payload is an lz block (see lz.h)
+   that expands to rwnd bytes, at most MAX_DATAGRAM - 16.  Any
+   receiver decodes it; only senders need -z. */
+#define PKT_COMPRESSED 0x04
+
+/* A PKT_STREAM data packet belongs to one of several independent
+   streams multiplexed over the connection, one per file when -s or
+   -r is given more than once.  Its payload starts with a struct
+   stream_header naming the stream and the packet's place in it,
+   counting from 0; the rest is that stream's data, lz-compressed if
+   PKT_COMPRESSED is also set (rwnd then covers only the rest), or
+   nothing for the stream's EOF.  Packets are still acked by the
+   connection seqno and share one congestion window, but a receiver
+   hands each stream its data as soon as that stream's own earlier
+   packets are in, whatever other streams are still missing.  The
+   connection's EOF, a plain data packet, comes after every stream's
+   EOF.  Both ends must have the same number of streams. */
+#define PKT_STREAM 0x08
+#define MAX_STREAMS 256
+
+struct stream_header {
+  uint16_t sid;			/* Stream, 0 .. streams - 1 */
+  uint16_t spare;
+  uint32_t seqno;		/* Packets of this stream before this one */
+};
+
+/* A transfer run with -R at both ends picks up where an earlier one
+   died.  Before any data flows the receiver sends a PKT_RESUME data
+   packet whose payload is a struct resume_point: the offset its
+   output continues at, as of its last checkpoint, and the FNV-1a
+   hash of the bytes before it.  The sender answers with a PKT_RESUME
+   packet giving the offset it sends from, which is the same one if
+   its input starts with bytes of that hash and 0 otherwise, or
+   without -R.  Neither uses up a seqno.  The receiver repeats its
+   request every timeout, and drops data and sends nothing else
+   until it has the answer; the sender sends no data before
+   answering, or before some other packet from the receiver shows
+   it runs without -R, when it starts at 0. */
+#define PKT_RESUME 0x10
+
+struct resume_point {		/* Big-endian */
+  uint64_t offset;
+  uint64_t hash;
+};
+
+/* A resuming receiver checkpoints its output each RESUME_INTERVAL
+   bytes written: it syncs the file, then replaces the sidecar file
+   output.resume with a "<offset> <hash in hex>" line, and removes
+   it once the transfer is complete.  Started again, it cuts the
+   output back to that offset, or to nothing without a checkpoint,
+   since later bytes may never have reached the disk. */
+#define RESUME_INTERVAL (8 << 20)
+#define RESUME_SUFFIX ".resume"
+#define FNV_BASIS 0xcbf29ce484222325ULL	/* Hash of no bytes */
+
+/* Every path is assumed to carry datagrams of BASE_DATAGRAM bytes, the
+   fixed size of earlier versions.  Bigger ones have to be probed for,
+   up to the largest a UDP/IPv4 datagram can be. */
+#define BASE_DATAGRAM 1016
+#define MAX_DATAGRAM 65507
+
 /* -----------------------------------------------------------------------
 
    Important notes about the library:
@@ -112,10 +208,10 @@ typedef struct packet packet_t;
                   CLOCK_MONOTONIC useful for keeping track of when
                   packets are sent.  Run "man clock_gettime".
 
-   * Your task is to implement the following seven functions:
+   * Your task is to implement the following eight functions:
 
        rel_create, rel_destroy, rel_recvpkt, rel_demux,
-       rel_read, rel_output, rel_timer
+       rel_read, rel_output, rel_timer, rel_stats
 
      as well to augment the reliable_state data structure.  All the
      changes you need to make are in the file reliable.c.
@@ -132,7 +228,14 @@ typedef struct packet packet_t;
      need to invoke rel_create yourself from within rel_demux when you
      notice a new connection (which will show up as a packet with
      sequence number 1 from a sockaddr_storage that you have not seen
-     before (which you can test for using addreq()).
+     before (which you can test for using addreq()).  Create its
+     conn_t on the loop rel_demux was called for with conn_create
+     first, then pass it to rel_create.
+
+   * All library state hangs off a loop_t, and rel_demux is handed
+     the loop it runs on.  Keep any state of your own that is shared
+     between connections in loop->rel_state rather than in globals,
+     so independent loops can run on different threads.
 
    * A rel_t is deallocated by rel_destroy().  The library will call
      rel_destroy when it receives an ICMP port unreachable (signifying
@@ -174,24 +277,51 @@ typedef struct packet packet_t;
      point you can send out more Acks to get more data from the remote
      side.
 
-   * The function rel_timer is called periodically, currently at a
-     rate 1/5 of the retransmission interval.  You can use this timer
-     to inspect packets and retransmit packets that have not been
-     acknowledged.  Do not retransmit every packet every time the
-     timer is fired!  You must keep track of which packets need to be
-     retransmitted when.
+   * Each connection has one timer, kept by the library in a hashed
+     timer wheel.  Arm it with conn_settimer whenever you need to be
+     woken up (typically when the oldest unacknowledged packet will
+     time out), and the library will call rel_timer for that
+     connection once the deadline passes.  The timer is one-shot:
+     rel_timer must re-arm it if more packets remain outstanding.
+     Arming and cancelling are O(1), and conn_poll sleeps exactly
+     until the earliest deadline of all connections, so there is no
+     periodic tick.
+
+   * With --sample, every loop calls rel_sample for each connection
+     once per sampling interval, from the same place it runs timers,
+     and writes the values as a time series.  Without it the sampler
+     costs one test per conn_poll.
+
+   * Sending the process SIGUSR1 makes each loop call rel_stats for
+     every live connection on its next conn_poll iteration.  The
+     signal handler only bumps a counter, so rel_stats runs in normal
+     context and may print freely.
 
 */
 
 struct config_common {
   int window;			/* # of unacknowledged packets in flight */
-  int timer;			/* How often rel_timer called in milliseconds */
   int timeout;			/* Retransmission timeout in milliseconds */
   int single_connection;        /* Exit after first connection failure */
   int sender_receiver;          /* sender or receiver*/
+  int ack_every;		/* Delayed acks: ack every N in-order packets */
+  int ack_delay;		/* ...or after this many ms; 0 = timeout / 2 */
+  int byte_seq;			/* seqno/ackno count bytes, not packets */
+  int nodelay;			/* Send short reads at once, no coalescing */
+  int flush_delay;		/* ...else hold them up to this many ms;
+				   0 = timeout / 2 */
+  int max_datagram;		/* Largest datagram to probe for or accept */
+  uint32_t isn;			/* First seqno, 1 unless testing wraparound */
+  int fec_group;		/* Largest FEC group, 0 = no parity sent */
+  int compress;			/* Send payloads lz-compressed where it pays */
+  int concurrency;		/* Most streams sent at once, 0 = all */
+  int resume;			/* Resume an earlier transfer, see
+				   PKT_RESUME */
 };
 
 typedef struct reliable_state rel_t;
+typedef struct loop loop_t;
+struct dir_xfer;
 
 extern char *progname;		/* Set to name of program by main */
 extern int opt_debug;		/* When != 0, print packets */
@@ -233,6 +363,8 @@ typedef struct chunk chunk_t;
 
 struct conn {
   rel_t *rel;			/* Data from reliable */
+  loop_t *loop;			/* Event loop this connection runs on */
+  uint32_t id;			/* Process-unique, names it in traces */
 
   int rpoll;			/* offsets into cevents array */
   int wpoll;
@@ -240,6 +372,10 @@ struct conn {
 
   int rfd;			/* input file descriptor */
   int wfd;			/* output file descriptor */
+  int nstreams;			/* Streams, see conn_stream_input; 0 if
+				   rfd/wfd carry the only one */
+  int *sfd;			/* Files of streams 1 .. nstreams - 1... */
+  struct dir_xfer *dir;		/* ...or the directory they are in */
   int nfd;			/* network file descriptor */
   char server;			/* non-zero on server */
   int sender_receiver;          /* sender = 1, receiver = 2*/
@@ -253,14 +389,109 @@ struct conn {
   chunk_t *outq;		/* chunks not yet written */
   chunk_t **outqtail;
 
+  char resume;			/* Checkpointing wfd, see RESUME_INTERVAL */
+  uint64_t written;		/* Bytes written to wfd... */
+  uint64_t written_hash;	/* ...and their FNV-1a hash */
+  uint64_t checkpoint;		/* written as of the last checkpoint */
+
   struct conn *next;		/* Linked list of connections */
   struct conn **prev;
+
+  uint64_t sample_time;		/* conn_clock at the last sample */
+  uint64_t sample_delivered;	/* rel_sample delivered at that time */
+
+  uint64_t texpire;		/* Timer wheel tick rel_timer is due */
+  struct conn *tnext;		/* Timer wheel bucket list */
+  struct conn **tprev;		/* NULL when timer not armed */
 };
 typedef struct conn conn_t;
 
-/* You only need to call this in the server, when rel_create gets a
- * NULL conn_t. */
-conn_t *conn_create (rel_t *, const struct sockaddr_storage *);
+/* Hashed timer wheel geometry, see conn_settimer. */
+#define WHEEL_BITS 8
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+
+/* An event loop: the poll set, connections, timers and clock driven
+ * by conn_poll.  Loops share no state, so several can run in one
+ * process, each on its own thread. */
+struct loop {
+  struct pollfd *cevents;	/* poll set; [0] is the server socket */
+  int ncevents;
+  int cevents_generation;	/* Changes when cevents must be rebuilt */
+  int last_cg;			/* Generation cevents was built for */
+  conn_t **evreaders;		/* Connection reading each cevents slot */
+  conn_t **evwriters;		/* Connection writing each cevents slot */
+  conn_t *conn_list;		/* All connections on this loop */
+
+  uint64_t now;			/* Cached conn_clock value */
+  conn_t *wheel[WHEEL_SIZE];	/* Timer buckets, by expiry tick */
+  uint64_t wheel_bits[WHEEL_SIZE / 64]; /* Bit set per non-empty bucket */
+  uint64_t wheel_tick;		/* Last tick processed */
+  int wheel_count;		/* Number of armed timers */
+
+  struct config_server *serverconf; /* Non-NULL when running a server */
+  int infile;			/* Sender's input file, or -1 */
+  int outfile;			/* Receiver's output file, or -1 */
+  char *resume_file;		/* Its checkpoint with -R, or NULL */
+
+  void *rel_state;		/* Free for reliable.c's per-loop state */
+  packet_t *rxbuf;		/* Received datagrams land here... */
+  size_t rxsize;		/* ...so they are cut off after this */
+  int stats_seen;		/* Last SIGUSR1 generation handled */
+  uint64_t sample_next;		/* conn_clock deadline of the next sample */
+
+  struct {			/* System calls made, for benchmarks */
+    uint64_t polls;
+    uint64_t sends;
+    uint64_t recvs;		/* Including the final EAGAIN */
+    uint64_t reads;
+    uint64_t writes;
+  } counters;
+};
+
+loop_t *loop_create (void);
+void loop_destroy (loop_t *);	/* Once its conn_list is empty */
+
+/* Run one iteration of the event loop: wait for I/O or the next
+ * timer, then dispatch to the rel_ functions. */
+void conn_poll (loop_t *, const struct config_common *);
+
+/* You only need to call this in the server, from rel_demux, to
+ * create the connection for a new peer before calling rel_create. */
+conn_t *conn_create (loop_t *, rel_t *, const struct sockaddr_storage *);
+
+/* Set up a single-connection endpoint on l: bind the UDP port local,
+ * connect it to remote ("[host:]port"), and call rel_create.  rfd
+ * and wfd are the application's input and output.  Returns NULL on
+ * error.  This is what main does for -s and -r. */
+conn_t *conn_start (loop_t *l, const struct config_common *cc,
+		    int rfd, int wfd, char *local, char *remote);
+
+/* Like conn_start, for a connection multiplexing n + 1 streams (see
+ * PKT_STREAM): rfd/wfd are stream 0, and fds[0 .. n - 1] streams 1
+ * to n, the sender's input or the receiver's output.  Those must be
+ * regular files, which never block, so they are read and written
+ * directly rather than through the poll set. */
+conn_t *conn_start_streams (loop_t *l, const struct config_common *cc,
+			    int rfd, int wfd, const int *fds, int n,
+			    char *local, char *remote);
+
+/* Like conn_start_streams, with the files of directory transfer d as
+ * streams 1 and on (see dirxfer.h).  rfd is the manifest for a
+ * sender; a receiver reads it off stream 0 itself. */
+conn_t *conn_start_dir (loop_t *l, const struct config_common *cc,
+			int rfd, int wfd, struct dir_xfer *d,
+			char *local, char *remote);
+
+/* The -S server, on a loop driven by the caller: receive each
+ * connection arriving on UDP port local into its own file in outdir,
+ * named <address>_<port> after the peer.  server_poll is one
+ * conn_poll iteration plus taking in datagrams; server_stop closes
+ * the port once every connection is gone.  Returns NULL on error. */
+struct config_server *server_start (loop_t *l, const struct config_common *cc,
+				    char *local, char *outdir);
+void server_poll (loop_t *l, struct config_server *cs);
+void server_stop (loop_t *l, struct config_server *cs);
 
 /* Call this function to send a UDP packet to the other side. */
 int conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len);
@@ -289,9 +520,39 @@ int conn_output (conn_t *c, const void *buf, size_t len);
  * data currently available, and -1 on EOF or error. */
 int conn_input (conn_t *c, void *buf, size_t len);
 
+/* The same as conn_input, conn_output and conn_bufspace for one of
+ * the streams of a connection set up by conn_start_streams or
+ * conn_start_dir; stream 0 is the one those work on.  There is
+ * always buffer space for the other streams, as their output is
+ * written out at once, except for a file the manifest of a
+ * directory transfer has not named yet. */
+int conn_stream_input (conn_t *c, int sid, void *buf, size_t len);
+int conn_stream_output (conn_t *c, int sid, const void *buf, size_t len);
+size_t conn_stream_bufspace (conn_t *c, int sid);
+
+/* Resuming (see PKT_RESUME).  The receiver's output continues at
+ * *off, after bytes that hash to *hash; it can still throw them away
+ * and start over at 0 until it outputs anything.  The sender skips
+ * the first off bytes of its input if they hash to hash, returning 0,
+ * or else returns -1 with the input still at its start; either way
+ * before reading any. */
+void conn_output_resume (conn_t *c, uint64_t *off, uint64_t *hash);
+void conn_output_restart (conn_t *c);
+int conn_input_resume (conn_t *c, uint64_t off, uint64_t hash);
+
 /* Deallocate a connection */
 void conn_destroy (conn_t *c);
 
+/* Current time in nanoseconds on a monotonic clock.  The clock is
+ * read once per conn_poll iteration, so repeated calls while
+ * handling one batch of events are free and return the same value. */
+uint64_t conn_clock (conn_t *c);
+
+/* Arrange for rel_timer to be called on this connection's rel_t in
+ * delay milliseconds.  Re-arming replaces any pending deadline, and
+ * a negative delay cancels the timer. */
+void conn_settimer (conn_t *c, long delay);
+
 /* Functions you must provide (in reliable.c). */
 
 rel_t *rel_create (conn_t *, const struct sockaddr_storage *,
@@ -301,14 +562,27 @@ void rel_destroy (rel_t *);
 /* This function gets called on clients, when packets arrive: */
 void rel_recvpkt (rel_t *, packet_t *pkt, size_t len);
 /* This function gets called on servers, when packets arrive: */
-void rel_demux (const struct config_common *cc,
+void rel_demux (loop_t *, const struct config_common *cc,
 		const struct sockaddr_storage *client,
 		packet_t *pkt, size_t len);
 
 /* Notification handlers */
 void rel_read (rel_t *);    /* Invoked when you can call conn_input */
 void rel_output (rel_t *);  /* Invoked when some output drained */
-void rel_timer (void); /* Invoked roughly each timer/5 milliseconds */
+void rel_timer (rel_t *); /* Invoked when conn_settimer deadline passes */
+void rel_stats (rel_t *);  /* Invoked on SIGUSR1 to report statistics */
+
+/* Congestion state polled by the --sample time series. */
+struct rel_sample {
+  uint32_t cwnd;		/* Window, in packets */
+  uint32_t inflight;		/* Unacknowledged packets */
+  uint64_t inflight_bytes;	/* Their payload bytes */
+  uint64_t srtt;		/* Nanoseconds, 0 before the first sample */
+  uint64_t rttvar;
+  uint64_t min_rtt;
+  uint64_t delivered;		/* Payload bytes acked or output so far */
+};
+void rel_sample (rel_t *, struct rel_sample *);
 
 
 
@@ -328,6 +602,10 @@ int make_async (int s);
 /* Bind to a particular socket (and listen if not dgram). */
 int listen_on (int dgram, struct sockaddr_storage *ss);
 
+/* Like listen_on, but with SO_REUSEPORT set so several sockets can
+ * bind the same port and have the kernel spread peers across them. */
+int listen_on_shared (int dgram, struct sockaddr_storage *ss);
+
 /* Convenient way to get a socket connected to a destination */
 int connect_to (int dgram, const struct sockaddr_storage *ss);
 
@@ -349,3 +627,9 @@ int connect_to (int dgram, const struct sockaddr_storage *ss);
 #if NEED_CLOCK_GETTIME
 int clock_gettime (int, struct timespec *);
 #endif /* NEED_CLOCK_GETTIME */
+
+/* Clock behind conn_clock.  CLOCK_MONOTONIC_COARSE trades resolution
+ * (typically one scheduler tick) for a cheaper read. */
+#ifndef RLIB_CLOCK
+# define RLIB_CLOCK CLOCK_MONOTONIC
+#endif /* !RLIB_CLOCK */
@@ -0,0 +1,91 @@
+/* Binary packet trace ring, see trace.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "trace.h"
+
+struct trace_event *trace_ring;
+uint64_t trace_head;
+
+static char *trace_path;
+
+static const char *const trace_names[TR_NTYPES] = {
+  [TR_SEND] = "send",
+  [TR_RECV] = "recv",
+  [TR_ACK] = "ack",
+  [TR_RETRANSMIT] = "retransmit",
+  [TR_CWND] = "cwnd",
+  [TR_TIMER] = "timer",
+};
+
+const char *
+trace_type_name (int type)
+{
+  if (type <= 0 || type >= TR_NTYPES)
+    return "unknown";
+  return trace_names[type];
+}
+
+int
+trace_open (const char *path)
+{
+  trace_ring = calloc (TRACE_EVENTS, sizeof (*trace_ring));
+  trace_path = strdup (path);
+  if (!trace_ring || !trace_path) {
+    fprintf (stderr, "trace: out of memory\n");
+    free (trace_ring);
+    trace_ring = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/* Only async-signal-safe calls below: this runs from signal handlers. */
+void
+trace_flush (void)
+{
+  struct trace_header h;
+  struct iovec iov[3];
+  uint64_t head, first;
+  int fd, saved_errno = errno;
+
+  if (!trace_ring)
+    return;
+  head = __atomic_load_n (&trace_head, __ATOMIC_RELAXED);
+  first = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+
+  memset (&h, 0, sizeof (h));
+  memcpy (h.magic, TRACE_MAGIC, sizeof (TRACE_MAGIC));
+  h.version = TRACE_VERSION;
+  h.event_size = sizeof (struct trace_event);
+  h.count = head - first;
+  h.dropped = first;
+
+  /* The live events are [first, head), which may wrap the ring */
+  iov[0].iov_base = &h;
+  iov[0].iov_len = sizeof (h);
+  iov[1].iov_base = &trace_ring[first & (TRACE_EVENTS - 1)];
+  iov[1].iov_len = (head - first < TRACE_EVENTS
+		    ? head - first
+		    : TRACE_EVENTS - (first & (TRACE_EVENTS - 1)))
+    * sizeof (struct trace_event);
+  iov[2].iov_base = trace_ring;
+  iov[2].iov_len = (head - first) * sizeof (struct trace_event)
+    - iov[1].iov_len;
+
+  fd = open (trace_path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  if (fd >= 0) {
+    if (writev (fd, iov, 3) < 0) {
+      static const char msg[] = "trace: write failed\n";
+      if (write (2, msg, sizeof (msg) - 1) < 0) {}
+    }
+    close (fd);
+  }
+  errno = saved_errno;
+}
@@ -0,0 +1,104 @@
+#ifndef TRACE_H
+#define TRACE_H 1
+
+#include <stdint.h>
+#include <time.h>
+
+/* -----------------------------------------------------------------------
+
+   Binary packet trace.
+
+   Events are fixed-size records written into an in-memory ring with
+   a single atomic increment, so recording costs a clock read and a
+   few stores instead of a formatted fprintf.  Any thread may record;
+   when the ring is full the oldest events are overwritten.
+
+   The ring is written to the trace file by trace_flush, which uses
+   only open/write/close and is therefore safe to call from a signal
+   handler.  Each flush rewrites the file with a snapshot of the
+   ring.  The file is a struct trace_header followed by count
+   struct trace_event records, oldest first, in host byte order.
+   tracedump decodes it.
+
+   An event whose slot is being rewritten while a flush runs may come
+   out torn; the trace is a debugging aid, not an audit log.
+
+ */
+
+/* Same clock as conn_clock, see rlib.h. */
+#ifndef RLIB_CLOCK
+# define RLIB_CLOCK CLOCK_MONOTONIC
+#endif /* !RLIB_CLOCK */
+
+#define TRACE_MAGIC "RLTRACE"
+#define TRACE_VERSION 1
+
+/* Ring capacity in events, must be a power of two. */
+#ifndef TRACE_EVENTS
+# define TRACE_EVENTS (1 << 18)
+#endif /* !TRACE_EVENTS */
+
+enum trace_type {
+  TR_SEND = 1,			/* a = seqno (0 for acks), b = ackno */
+  TR_RECV,			/* a = seqno (0 for acks), b = ackno */
+  TR_ACK,			/* a = ackno, b = window after the ack */
+  TR_RETRANSMIT,		/* a = seqno, b = TR_RTX_* cause */
+  TR_CWND,			/* a = old window, b = new window */
+  TR_TIMER,			/* rel_timer fired */
+  TR_NTYPES
+};
+
+#define TR_RTX_TIMEOUT 0
+#define TR_RTX_FAST 1
+
+struct trace_event {
+  uint64_t ts;			/* Nanoseconds on RLIB_CLOCK */
+  uint32_t conn;		/* conn_t id */
+  uint8_t type;			/* enum trace_type */
+  uint8_t pad;
+  uint16_t len;			/* Datagram length for TR_SEND/TR_RECV */
+  uint32_t a;
+  uint32_t b;
+};
+
+struct trace_header {
+  char magic[8];		/* TRACE_MAGIC, NUL padded */
+  uint32_t version;
+  uint32_t event_size;		/* sizeof (struct trace_event) */
+  uint64_t count;		/* Events that follow */
+  uint64_t dropped;		/* Older events overwritten in the ring */
+};
+
+extern struct trace_event *trace_ring; /* NULL when tracing is off */
+extern uint64_t trace_head;	/* Total events ever recorded */
+
+/* Allocate the ring and remember where trace_flush writes it.
+ * Returns 0 on success, -1 on error. */
+int trace_open (const char *path);
+
+/* Write the current ring contents to the trace file. */
+void trace_flush (void);
+
+const char *trace_type_name (int type);
+
+static inline void
+trace_event (int type, uint32_t conn, uint16_t len, uint32_t a, uint32_t b)
+{
+  struct trace_event *e;
+  struct timespec ts;
+
+  if (!trace_ring)
+    return;
+  clock_gettime (RLIB_CLOCK, &ts);
+  e = &trace_ring[__atomic_fetch_add (&trace_head, 1, __ATOMIC_RELAXED)
+		  & (TRACE_EVENTS - 1)];
+  e->ts = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  e->conn = conn;
+  e->type = type;
+  e->pad = 0;
+  e->len = len;
+  e->a = a;
+  e->b = b;
+}
+
+#endif /* !TRACE_H */
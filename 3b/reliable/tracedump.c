@@ -0,0 +1,76 @@
+/* Decode a binary trace written by reliable -T, see trace.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+static void
+usage (const char *progname)
+{
+  fprintf (stderr, "usage: %s [-c] trace-file\n"
+	   "       -c: print CSV instead of aligned text\n", progname);
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct trace_header h;
+  struct trace_event e;
+  uint64_t i, t0 = 0;
+  int opt, csv = 0;
+  FILE *fp;
+
+  while ((opt = getopt (argc, argv, "c")) != -1)
+    switch (opt) {
+    case 'c':
+      csv = 1;
+      break;
+    default:
+      usage (argv[0]);
+    }
+  if (optind + 1 != argc)
+    usage (argv[0]);
+
+  if (!(fp = fopen (argv[optind], "rb"))) {
+    perror (argv[optind]);
+    exit (1);
+  }
+  if (fread (&h, sizeof (h), 1, fp) != 1
+      || memcmp (h.magic, TRACE_MAGIC, sizeof (TRACE_MAGIC))
+      || h.version != TRACE_VERSION
+      || h.event_size != sizeof (struct trace_event)) {
+    fprintf (stderr, "%s: not a version %d trace file\n",
+	     argv[optind], TRACE_VERSION);
+    exit (1);
+  }
+
+  if (csv)
+    printf ("ts_ns,rel_us,conn,type,len,a,b\n");
+  else if (h.dropped)
+    printf ("# %llu older events were overwritten\n",
+	    (unsigned long long) h.dropped);
+
+  for (i = 0; i < h.count; i++) {
+    if (fread (&e, sizeof (e), 1, fp) != 1) {
+      fprintf (stderr, "%s: truncated after %llu events\n",
+	       argv[optind], (unsigned long long) i);
+      exit (1);
+    }
+    if (i == 0)
+      t0 = e.ts;
+    if (csv)
+      printf ("%llu,%.3f,%u,%s,%u,%u,%u\n", (unsigned long long) e.ts,
+	      (e.ts - t0) / 1000.0, e.conn, trace_type_name (e.type),
+	      e.len, e.a, e.b);
+    else
+      printf ("%14.3f us  conn %-4u %-10s len %-5u %10u %10u\n",
+	      (e.ts - t0) / 1000.0, e.conn, trace_type_name (e.type),
+	      e.len, e.a, e.b);
+  }
+  fclose (fp);
+  return 0;
+}